@@ -0,0 +1,581 @@
+/*
+ * Benchmarks for the memory pool.
+ *
+ * usage: denver_os_pa_c_bench [name [iterations]]
+ *        runs all benchmarks, or the one given by name
+ */
+
+#define _GNU_SOURCE // for sched_yield()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mem_pool.h"
+#include "mem_chan.h"
+
+
+/*****            constants            *****/
+
+static const size_t     BENCH_POOL_SIZE         = 64 * 1024 * 1024;
+static const size_t     BENCH_MSG_SIZE          = 64;
+static const unsigned   BENCH_CHAN_CAPACITY     = 1024;
+static const unsigned   BENCH_ITERATIONS        = 1000000;
+static const size_t     BENCH_CLONE_POOL_SIZE   = 256 * 1024 * 1024;
+static const size_t     BENCH_CLONE_WRITES      = 16;       // pages written per clone
+static const unsigned   BENCH_MT_HELD           = 16;       // allocations held per thread
+#define                 BENCH_MT_MAX_THREADS    64
+#define                 BENCH_CHURN_LIVE        1000        // allocations held in the churn
+
+
+/*****         helper routines         *****/
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned iterations, double seconds) {
+    printf("%-28s %10u ops %8.3f s %12.0f ops/s %8.1f ns/op\n",
+           name, iterations, seconds, iterations / seconds, seconds * 1e9 / iterations);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static pool_pt open_shared_pool(char *name, size_t len) {
+    snprintf(name, len, "/mem_bench_%d", (int) getpid());
+    shm_unlink(name);
+    return mem_pool_open_shm(name, BENCH_POOL_SIZE, FIRST_FIT);
+}
+
+static void close_shared_pool(const char *name, pool_pt pool) {
+    mem_pool_close(pool);
+    shm_unlink(name);
+}
+
+static void wait_children(unsigned num_children) {
+    for (unsigned u = 0; u < num_children; u++) {
+        int status = 0;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "child failed with status %d\n", status);
+    }
+}
+
+
+/*****         channel senders and receivers        *****/
+
+static void send_msgs(pool_pt pool, chan_pt chan, unsigned first, unsigned count) {
+    for (unsigned u = first; u < first + count; u++) {
+        alloc_pt alloc;
+        while ((alloc = mem_new_alloc(pool, BENCH_MSG_SIZE)) == NULL)
+            sched_yield();
+        memcpy(alloc->mem, &u, sizeof(u));
+        while (mem_chan_send(chan, alloc) != ALLOC_OK)
+            sched_yield();
+    }
+}
+
+static unsigned recv_msgs(chan_pt chan, unsigned first, unsigned count, int ordered) {
+    unsigned errors = 0;
+    chan_msg_t msg;
+
+    for (unsigned u = first; u < first + count; u++) {
+        while (mem_chan_recv(chan, &msg) != ALLOC_OK)
+            sched_yield();
+        unsigned seq;
+        memcpy(&seq, msg.mem, sizeof(seq));
+        // messages from a single sender arrive in order
+        if (ordered && seq != u)
+            errors++;
+        if (mem_chan_release(chan, &msg) != ALLOC_OK)
+            errors++;
+    }
+
+    return errors;
+}
+
+
+/*****            benchmarks           *****/
+
+// baseline: the same messages copied through a pipe
+static void bench_pipe(unsigned iterations) {
+    char buf[BENCH_MSG_SIZE];
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return;
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (unsigned u = 0; u < iterations; u++) {
+            size_t got = 0;
+            while (got < sizeof(buf)) {
+                ssize_t ret = read(fds[0], buf + got, sizeof(buf) - got);
+                if (ret <= 0)
+                    _exit(1);
+                got += ret;
+            }
+        }
+        _exit(0);
+    }
+    memset(buf, 0, sizeof(buf));
+    for (unsigned u = 0; u < iterations; u++) {
+        memcpy(buf, &u, sizeof(u));
+        if (write(fds[1], buf, sizeof(buf)) != sizeof(buf))
+            break;
+    }
+    wait_children(1);
+    report("pipe/copy", iterations, now() - start);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void bench_chan(const char *label, chan_kind kind,
+                       unsigned num_senders, unsigned num_receivers,
+                       unsigned iterations) {
+    char name[64];
+    pool_pt pool = open_shared_pool(name, sizeof(name));
+    if (pool == NULL)
+        return;
+    chan_pt chan = mem_chan_open(pool, BENCH_CHAN_CAPACITY, kind);
+    if (chan == NULL) {
+        close_shared_pool(name, pool);
+        return;
+    }
+    size_t chan_offset = mem_chan_offset(chan);
+
+    double start = now();
+    for (unsigned r = 0; r < num_receivers; r++) {
+        if (fork() == 0) {
+            // attach like an unrelated process would
+            pool_pt child_pool = mem_pool_open_shm(name, 0, FIRST_FIT);
+            chan_pt child_chan = mem_chan_attach(child_pool, chan_offset);
+            if (child_chan == NULL)
+                _exit(1);
+            unsigned errors = recv_msgs(child_chan, 0, iterations / num_receivers, num_senders == 1);
+            mem_chan_close(child_chan);
+            mem_pool_close(child_pool);
+            _exit(errors ? 2 : 0);
+        }
+    }
+    for (unsigned s = 1; s < num_senders; s++) {
+        if (fork() == 0) {
+            pool_pt child_pool = mem_pool_open_shm(name, 0, FIRST_FIT);
+            chan_pt child_chan = mem_chan_attach(child_pool, chan_offset);
+            if (child_chan == NULL)
+                _exit(1);
+            send_msgs(child_pool, child_chan, s * (iterations / num_senders), iterations / num_senders);
+            mem_chan_close(child_chan);
+            mem_pool_close(child_pool);
+            _exit(0);
+        }
+    }
+    send_msgs(pool, chan, 0, iterations / num_senders);
+    wait_children(num_receivers + num_senders - 1);
+    report(label, iterations, now() - start);
+
+    mem_chan_destroy(chan);
+    close_shared_pool(name, pool);
+}
+
+// one-way latency, as half of a round trip over a pair of channels
+static void bench_chan_latency(unsigned iterations) {
+    char name[64];
+    pool_pt pool = open_shared_pool(name, sizeof(name));
+    if (pool == NULL)
+        return;
+    chan_pt ping = mem_chan_open(pool, BENCH_CHAN_CAPACITY, CHAN_SPSC);
+    chan_pt pong = mem_chan_open(pool, BENCH_CHAN_CAPACITY, CHAN_SPSC);
+    double *samples = malloc(iterations * sizeof(double));
+    if (ping == NULL || pong == NULL || samples == NULL) {
+        close_shared_pool(name, pool);
+        return;
+    }
+    size_t ping_offset = mem_chan_offset(ping), pong_offset = mem_chan_offset(pong);
+
+    if (fork() == 0) {
+        pool_pt child_pool = mem_pool_open_shm(name, 0, FIRST_FIT);
+        chan_pt child_ping = mem_chan_attach(child_pool, ping_offset);
+        chan_pt child_pong = mem_chan_attach(child_pool, pong_offset);
+        if (child_ping == NULL || child_pong == NULL)
+            _exit(1);
+        chan_msg_t msg;
+        for (unsigned u = 0; u < iterations; u++) {
+            while (mem_chan_recv(child_ping, &msg) != ALLOC_OK)
+                sched_yield();
+            mem_chan_release(child_ping, &msg);
+            send_msgs(child_pool, child_pong, u, 1);
+        }
+        _exit(0);
+    }
+
+    double start = now();
+    for (unsigned u = 0; u < iterations; u++) {
+        double t = now();
+        send_msgs(pool, ping, u, 1);
+        recv_msgs(pong, u, 1, 1);
+        samples[u] = (now() - t) / 2;
+    }
+    double elapsed = now() - start;
+    wait_children(1);
+
+    qsort(samples, iterations, sizeof(double), cmp_double);
+    report("chan/round trip", iterations, elapsed);
+    printf("%-28s one-way p50 %8.1f ns   p99 %8.1f ns\n", "",
+           samples[iterations / 2] * 1e9, samples[iterations * 99 / 100] * 1e9);
+
+    free(samples);
+    mem_chan_destroy(ping);
+    mem_chan_destroy(pong);
+    close_shared_pool(name, pool);
+}
+
+
+// a full copy of a pool, against a copy-on-write clone that then writes a
+// few pages of its own
+static void bench_clone(unsigned iterations) {
+    pool_pt pool = mem_pool_open(BENCH_CLONE_POOL_SIZE, FIRST_FIT);
+    if (pool == NULL)
+        return;
+    alloc_pt alloc = mem_new_alloc(pool, BENCH_CLONE_POOL_SIZE);
+    memset(alloc->mem, 1, alloc->size);
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    char *copy = malloc(BENCH_CLONE_POOL_SIZE);
+    double start = now();
+    for (unsigned u = 0; u < iterations; u++)
+        memcpy(copy, pool->mem, BENCH_CLONE_POOL_SIZE);
+    report("clone/memcpy 256M", iterations, now() - start);
+    free(copy);
+
+    start = now();
+    for (unsigned u = 0; u < iterations; u++) {
+        pool_pt clone = mem_pool_clone(pool);
+        if (clone == NULL)
+            break;
+        for (size_t w = 0; w < BENCH_CLONE_WRITES; w++)
+            clone->mem[(w * 4099 % (BENCH_CLONE_POOL_SIZE / page)) * page] = (char) u;
+        mem_del_alloc(clone, mem_pool_alloc_at(clone, 0));
+        mem_pool_close(clone);
+    }
+    report("clone/cow 256M", iterations, now() - start);
+
+    mem_del_alloc(pool, alloc);
+    mem_pool_close(pool);
+}
+
+
+/*****       threads on thread-safe pools       *****/
+
+typedef struct _mt_arg {
+    pool_pt pool;
+    pthread_mutex_t *global_lock;   // the lock every call used to take, or NULL
+    unsigned iterations;
+} mt_arg_t;
+
+static void *mt_worker(void *p) {
+    mt_arg_t *arg = p;
+    alloc_pt held[BENCH_MT_HELD];
+
+    memset(held, 0, sizeof(held));
+    for (unsigned u = 0; u < arg->iterations; u++) {
+        unsigned slot = u % BENCH_MT_HELD;
+        if (arg->global_lock != NULL)
+            pthread_mutex_lock(arg->global_lock);
+        if (held[slot] != NULL)
+            mem_del_alloc(arg->pool, held[slot]);
+        held[slot] = mem_new_alloc(arg->pool, BENCH_MSG_SIZE);
+        if (arg->global_lock != NULL)
+            pthread_mutex_unlock(arg->global_lock);
+    }
+    for (unsigned slot = 0; slot < BENCH_MT_HELD; slot++) {
+        if (held[slot] != NULL)
+            mem_del_alloc(arg->pool, held[slot]);
+    }
+
+    return NULL;
+}
+
+// one pool for all threads, a pool per thread, or a pool per thread behind
+// one global lock, without caches (0), with thread caches (1) or with per-CPU
+// caches (2)
+static void bench_mt(const char *label, unsigned num_threads, int pool_per_thread,
+                     int global_lock, int cached, unsigned iterations) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t threads[BENCH_MT_MAX_THREADS];
+    mt_arg_t args[BENCH_MT_MAX_THREADS];
+    char name[64];
+
+    for (unsigned t = 0; t < num_threads; t++) {
+        if (t == 0 || pool_per_thread)
+            args[t].pool = global_lock ? mem_pool_open(BENCH_POOL_SIZE, FIRST_FIT)
+                                       : mem_pool_open_mt(BENCH_POOL_SIZE, FIRST_FIT);
+        else
+            args[t].pool = args[0].pool;
+        if (cached == 1 && (t == 0 || pool_per_thread))
+            mem_pool_enable_cache(args[t].pool);
+        if (cached == 2 && (t == 0 || pool_per_thread))
+            mem_pool_enable_cpu_cache(args[t].pool);
+        args[t].global_lock = global_lock ? &lock : NULL;
+        args[t].iterations = iterations / num_threads;
+    }
+
+    double start = now();
+    for (unsigned t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, mt_worker, &args[t]);
+    for (unsigned t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    snprintf(name, sizeof(name), "%s %u", label, num_threads);
+    report(name, iterations, now() - start);
+
+    for (unsigned t = 0; t < num_threads; t++) {
+        if (t == 0 || pool_per_thread)
+            mem_pool_close(args[t].pool);
+    }
+}
+
+
+// a pipeline: one thread allocates, another deletes
+typedef struct _handoff {
+    pool_pt pool;
+    pthread_mutex_t *global_lock;
+    unsigned iterations;
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    alloc_pt ring[1024];
+} handoff_t;
+
+static void *handoff_consumer(void *p) {
+    handoff_t *h = p;
+
+    for (unsigned u = 0; u < h->iterations; u++) {
+        while (atomic_load_explicit(&h->tail, memory_order_acquire) == u)
+            sched_yield();
+        alloc_pt alloc = h->ring[u % 1024];
+        atomic_store_explicit(&h->head, u + 1, memory_order_release);
+        if (h->global_lock != NULL)
+            pthread_mutex_lock(h->global_lock);
+        mem_del_alloc(h->pool, alloc);
+        if (h->global_lock != NULL)
+            pthread_mutex_unlock(h->global_lock);
+    }
+
+    return NULL;
+}
+
+static void bench_handoff(const char *label, int global_lock, unsigned iterations) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static handoff_t h;
+    pthread_t consumer;
+
+    h.pool = global_lock ? mem_pool_open(BENCH_POOL_SIZE, FIRST_FIT)
+                         : mem_pool_open_mt(BENCH_POOL_SIZE, FIRST_FIT);
+    h.global_lock = global_lock ? &lock : NULL;
+    h.iterations = iterations;
+    atomic_init(&h.head, 0);
+    atomic_init(&h.tail, 0);
+
+    double start = now();
+    pthread_create(&consumer, NULL, handoff_consumer, &h);
+    for (unsigned u = 0; u < iterations; u++) {
+        while (u - atomic_load_explicit(&h.head, memory_order_acquire) >= 1024)
+            sched_yield();
+        if (h.global_lock != NULL)
+            pthread_mutex_lock(h.global_lock);
+        h.ring[u % 1024] = mem_new_alloc(h.pool, BENCH_MSG_SIZE);
+        if (h.global_lock != NULL)
+            pthread_mutex_unlock(h.global_lock);
+        atomic_store_explicit(&h.tail, u + 1, memory_order_release);
+    }
+    pthread_join(consumer, NULL);
+    report(label, iterations, now() - start);
+
+    mem_pool_close(h.pool);
+}
+
+
+// short-lived pools, opened and closed from every thread
+static void *open_close_worker(void *p) {
+    unsigned iterations = *(unsigned *) p;
+
+    for (unsigned u = 0; u < iterations; u++)
+        mem_pool_close(mem_pool_open(BENCH_MSG_SIZE, FIRST_FIT));
+
+    return NULL;
+}
+
+static void bench_open_close(unsigned num_threads, unsigned iterations) {
+    pthread_t threads[BENCH_MT_MAX_THREADS];
+    unsigned per_thread = iterations / num_threads;
+    char name[64];
+
+    double start = now();
+    for (unsigned t = 0; t < num_threads; t++)
+        pthread_create(&threads[t], NULL, open_close_worker, &per_thread);
+    for (unsigned t = 0; t < num_threads; t++)
+        pthread_join(threads[t], NULL);
+    snprintf(name, sizeof(name), "store/open+close %u", num_threads);
+    report(name, per_thread * num_threads, now() - start);
+}
+
+
+/*****             metadata            *****/
+
+// bytes malloc-ed, on the heap or mapped
+static size_t malloced() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+// a pool full of small allocations: time per allocation, and the bytes of
+// metadata (node heap, gap index and records) it took per segment on the way
+// (none for a pool sized up front, see mem_pool_open_ex)
+static void bench_meta(const char *label, unsigned num_allocs, const pool_config_t *config) {
+    size_t size = BENCH_MSG_SIZE / 2;
+    pool_pt pool = mem_pool_open_ex((size_t) num_allocs * BENCH_MSG_SIZE, BEST_FIT, config);
+    char name[64];
+
+    // the slowest allocation is one that grows the metadata
+    size_t before = malloced();
+    double worst = 0;
+    double start = now();
+    for (unsigned u = 0; u < num_allocs; u++) {
+        double op_start = now();
+        mem_new_alloc(pool, size);
+        double op = now() - op_start;
+        if (op > worst)
+            worst = op;
+    }
+    double seconds = now() - start;
+    size_t after = malloced();
+
+    snprintf(name, sizeof(name), "%s", label);
+    report(name, num_allocs, seconds);
+    snprintf(name, sizeof(name), "%s worst (us)", label);
+    printf("%-28s %10.1f\n", name, worst * 1e6);
+    snprintf(name, sizeof(name), "%s bytes/segment", label);
+    printf("%-28s %10.1f\n", name, (double) (after - before) / (num_allocs + 1));
+
+    for (unsigned u = num_allocs; u-- > 0; )
+        mem_del_alloc(pool, mem_pool_alloc_at(pool, u * size));
+    mem_pool_close(pool);
+}
+
+// allocations that only fit at the end of a pool riddled with small gaps,
+// so every one of them searches all of the pool's metadata
+static void bench_fit(const char *label, alloc_policy policy, unsigned num_gaps, unsigned iterations) {
+    size_t size = BENCH_MSG_SIZE / 2;
+    pool_pt pool = mem_pool_open((size_t) num_gaps * BENCH_MSG_SIZE * 2, policy);
+
+    for (unsigned u = 0; u < 2 * num_gaps; u++)
+        mem_new_alloc(pool, size);
+    for (unsigned u = 0; u < 2 * num_gaps; u += 2)
+        mem_del_alloc(pool, mem_pool_alloc_at(pool, u * size));
+
+    double start = now();
+    for (unsigned u = 0; u < iterations; u++)
+        mem_del_alloc(pool, mem_new_alloc(pool, 2 * size));
+    report(label, iterations, now() - start);
+
+    for (unsigned u = 1; u < 2 * num_gaps; u += 2)
+        mem_del_alloc(pool, mem_pool_alloc_at(pool, u * size));
+    mem_pool_close(pool);
+}
+
+// deletes and allocations of mixed sizes all over a pool, so that the deletes
+// merge with gaps on either side, with the metadata in nodes or in the pool
+static void bench_churn(const char *label, pool_pt pool, unsigned iterations) {
+    alloc_pt live[BENCH_CHURN_LIVE];
+    unsigned seed = 1;
+
+    for (unsigned u = 0; u < BENCH_CHURN_LIVE; u++)
+        live[u] = mem_new_alloc(pool, 64 + (u % 16) * 64);
+
+    double start = now();
+    for (unsigned u = 0; u < iterations; u++) {
+        seed = seed * 1103515245 + 12345;
+        unsigned slot = (seed >> 16) % BENCH_CHURN_LIVE;
+        mem_del_alloc(pool, live[slot]);
+        live[slot] = mem_new_alloc(pool, 64 + ((seed >> 8) % 16) * 64);
+    }
+    report(label, iterations, now() - start);
+
+    for (unsigned u = 0; u < BENCH_CHURN_LIVE; u++)
+        mem_del_alloc(pool, live[u]);
+    mem_pool_close(pool);
+}
+
+
+/*****              driver             *****/
+
+int main(int argc, char *argv[]) {
+    const char *which = (argc > 1) ? argv[1] : NULL;
+    unsigned iterations = (argc > 2) ? (unsigned) strtoul(argv[2], NULL, 10) : BENCH_ITERATIONS;
+
+    if (mem_init() != ALLOC_OK)
+        return 1;
+
+    if (which == NULL || strcmp(which, "chan") == 0) {
+        bench_pipe(iterations);
+        bench_chan("chan/spsc", CHAN_SPSC, 1, 1, iterations);
+        bench_chan("chan/mpmc 2x2", CHAN_MPMC, 2, 2, iterations);
+        bench_chan_latency(iterations / 10);
+    }
+
+    if (which == NULL || strcmp(which, "clone") == 0)
+        bench_clone(iterations / 10000 + 1);
+
+    if (which == NULL || strcmp(which, "mt") == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned max_threads = (num_cpus > 4) ? (unsigned) num_cpus : 4;
+        if (max_threads > BENCH_MT_MAX_THREADS)
+            max_threads = BENCH_MT_MAX_THREADS;
+        for (unsigned t = 1; t <= max_threads; t *= 2) {
+            bench_mt("mt/global lock", t, 1, 1, 0, iterations);
+            bench_mt("mt/pool per thread", t, 1, 0, 0, iterations);
+            bench_mt("mt/shared pool", t, 0, 0, 0, iterations);
+            bench_mt("mt/cached shared pool", t, 0, 0, 1, iterations);
+            bench_mt("mt/cpu-cached shared pool", t, 0, 0, 2, iterations);
+        }
+        bench_handoff("mt/handoff global lock", 1, iterations);
+        bench_handoff("mt/handoff remote free", 0, iterations);
+    }
+
+    if (which == NULL || strcmp(which, "store") == 0) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        unsigned max_threads = (num_cpus > 4) ? (unsigned) num_cpus : 4;
+        if (max_threads > BENCH_MT_MAX_THREADS)
+            max_threads = BENCH_MT_MAX_THREADS;
+        for (unsigned t = 1; t <= max_threads; t *= 2)
+            bench_open_close(t, iterations);
+    }
+
+    if (which == NULL || strcmp(which, "meta") == 0) {
+        pool_config_t sized = { .expected_allocs = iterations / 50 };
+        bench_meta("meta/fill", iterations / 50, NULL);
+        bench_meta("meta/fill sized", iterations / 50, &sized);
+        bench_fit("meta/first fit search", FIRST_FIT, iterations / 100, iterations / 100);
+        bench_fit("meta/best fit search", BEST_FIT, iterations / 100, iterations / 100);
+        bench_churn("meta/churn nodes", mem_pool_open(BENCH_CHURN_LIVE * 2048, FIRST_FIT), iterations);
+        bench_churn("meta/churn inline", mem_pool_open_inline(BENCH_CHURN_LIVE * 2048, FIRST_FIT), iterations);
+    }
+
+    mem_free();
+
+    return 0;
+}
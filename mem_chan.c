@@ -0,0 +1,282 @@
+/*
+ * Zero-copy message channel over a (shared) memory pool.
+ *
+ * The ring of the channel is an allocation in the pool itself, and carries
+ * offsets into the pool instead of the messages, so it works the same for
+ * threads sharing a pool and for processes sharing a shared pool.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#include "mem_chan.h"
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned long  MEM_CHAN_MAGIC          = 0x4d454d4348414e31; // "MEMCHAN1"
+static const size_t         MEM_CHAN_ALIGN          = 64;  // cache line
+static const unsigned       MEM_CHAN_MAX_CAPACITY   = 1u << 31; // largest power of 2 in an unsigned
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef struct _chan_slot {
+    atomic_size_t seq;          // MPMC only, turn of the slot
+    size_t offset;
+    size_t size;
+    unsigned ix;                // where the pool keeps the record
+} chan_slot_t, *chan_slot_pt;
+
+// the shared part of a channel, in the pool
+typedef struct _chan_ring {
+    unsigned long magic;
+    size_t alloc_offset;        // offset of the allocation holding the ring
+    unsigned capacity;
+    chan_kind kind;
+    _Alignas(64) atomic_size_t head;    // next message to receive
+    _Alignas(64) atomic_size_t tail;    // next message to send
+    _Alignas(64) chan_slot_t slots[];
+} chan_ring_t, *chan_ring_pt;
+
+// the process-local part of a channel
+typedef struct _chan {
+    pool_pt pool;
+    chan_ring_pt ring;
+    size_t mask;
+    size_t head_cache;          // SPSC only, head as last seen by the sender
+    size_t tail_cache;          // SPSC only, tail as last seen by the receiver
+} chan_t;
+
+
+
+/****************************************/
+/*                                      */
+/* Definitions of user-facing functions */
+/*                                      */
+/****************************************/
+chan_pt mem_chan_open(pool_pt pool, unsigned capacity, chan_kind kind) {
+    // a capacity that can't be rounded up can't be had
+    if (capacity > MEM_CHAN_MAX_CAPACITY)
+        return NULL;
+
+    // round the capacity up to a power of 2, for masking
+    unsigned ring_capacity = 1;
+    while (ring_capacity < capacity)
+        ring_capacity <<= 1;
+
+    chan_t *chan = malloc(sizeof(chan_t));
+    if (chan == NULL)
+        return NULL;
+
+    // allocate the ring with room to align it to a cache line
+    alloc_pt alloc = mem_new_alloc(pool,
+                                   sizeof(chan_ring_t)
+                                   + ring_capacity * sizeof(chan_slot_t)
+                                   + MEM_CHAN_ALIGN);
+    if (alloc == NULL) {
+        free(chan);
+        return NULL;
+    }
+
+    uintptr_t addr = ((uintptr_t) alloc->mem + MEM_CHAN_ALIGN - 1) & ~(MEM_CHAN_ALIGN - 1);
+    chan_ring_pt ring = (chan_ring_pt) addr;
+
+    ring->alloc_offset = alloc->mem - pool->mem;
+    ring->capacity = ring_capacity;
+    ring->kind = kind;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    for (unsigned u = 0; u < ring_capacity; u++)
+        atomic_init(&ring->slots[u].seq, u);
+
+    // publish the ring last, for processes attaching by offset
+    atomic_thread_fence(memory_order_release);
+    ring->magic = MEM_CHAN_MAGIC;
+
+    chan->pool = pool;
+    chan->ring = ring;
+    chan->mask = ring_capacity - 1;
+    chan->head_cache = 0;
+    chan->tail_cache = 0;
+
+    return chan;
+}
+
+chan_pt mem_chan_attach(pool_pt pool, size_t offset) {
+    // a ring header, where mem_chan_open puts one
+    if (offset > pool->total_size || pool->total_size - offset < sizeof(chan_ring_t)
+        || (uintptr_t) (pool->mem + offset) % MEM_CHAN_ALIGN != 0)
+        return NULL;
+
+    chan_ring_pt ring = (chan_ring_pt) (pool->mem + offset);
+    if (ring->magic != MEM_CHAN_MAGIC)
+        return NULL;
+    atomic_thread_fence(memory_order_acquire);
+
+    // and a ring that mem_chan_open could have made, all in the pool
+    unsigned capacity = ring->capacity;
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0
+        || (ring->kind != CHAN_SPSC && ring->kind != CHAN_MPMC)
+        || (pool->total_size - offset - sizeof(chan_ring_t)) / sizeof(chan_slot_t) < capacity)
+        return NULL;
+
+    chan_t *chan = malloc(sizeof(chan_t));
+    if (chan == NULL)
+        return NULL;
+
+    chan->pool = pool;
+    chan->ring = ring;
+    chan->mask = capacity - 1;
+    chan->head_cache = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    chan->tail_cache = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    return chan;
+}
+
+size_t mem_chan_offset(chan_pt chan) {
+    return (char *) chan->ring - chan->pool->mem;
+}
+
+alloc_status mem_chan_close(chan_pt chan) {
+    if (chan == NULL)
+        return ALLOC_NOT_FREED;
+
+    free(chan);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_chan_destroy(chan_pt chan) {
+    if (chan == NULL)
+        return ALLOC_NOT_FREED;
+
+    // the ring's allocation has to go back to the pool
+    alloc_pt alloc = mem_pool_alloc_at(chan->pool, chan->ring->alloc_offset);
+    if (alloc == NULL)
+        return ALLOC_FAIL;
+    chan->ring->magic = 0;
+    if (mem_del_alloc(chan->pool, alloc) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    free(chan);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_chan_send(chan_pt chan, alloc_pt alloc) {
+    chan_ring_pt ring = chan->ring;
+    chan_slot_pt slot;
+    size_t pos;
+
+    // the receiver gets the record back by where the pool keeps it
+    unsigned ix = mem_pool_alloc_ix(chan->pool, alloc);
+    if (ix == UINT_MAX)
+        return ALLOC_FAIL;
+
+    if (ring->kind == CHAN_SPSC) {
+        // single sender: only the receiver moves head, re-read it when full
+        pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (pos - chan->head_cache > chan->mask) {
+            chan->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (pos - chan->head_cache > chan->mask)
+                return ALLOC_FAIL;
+        }
+
+        slot = &ring->slots[pos & chan->mask];
+        slot->offset = alloc->mem - chan->pool->mem;
+        slot->size = alloc->size;
+        slot->ix = ix;
+        atomic_store_explicit(&ring->tail, pos + 1, memory_order_release);
+
+        return ALLOC_OK;
+    }
+
+    // several senders: claim a slot whose turn it is to be written
+    pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        slot = &ring->slots[pos & chan->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return ALLOC_FAIL;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->offset = alloc->mem - chan->pool->mem;
+    slot->size = alloc->size;
+    slot->ix = ix;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_chan_recv(chan_pt chan, chan_msg_pt msg) {
+    chan_ring_pt ring = chan->ring;
+    chan_slot_pt slot;
+    size_t pos;
+
+    if (ring->kind == CHAN_SPSC) {
+        // single receiver: only the sender moves tail, re-read it when empty
+        pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (pos == chan->tail_cache) {
+            chan->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (pos == chan->tail_cache)
+                return ALLOC_FAIL;
+        }
+
+        slot = &ring->slots[pos & chan->mask];
+        msg->mem = chan->pool->mem + slot->offset;
+        msg->size = slot->size;
+        msg->ix = slot->ix;
+        atomic_store_explicit(&ring->head, pos + 1, memory_order_release);
+
+        return ALLOC_OK;
+    }
+
+    // several receivers: claim a slot whose turn it is to be read
+    pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    for (;;) {
+        slot = &ring->slots[pos & chan->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return ALLOC_FAIL;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+
+    msg->mem = chan->pool->mem + slot->offset;
+    msg->size = slot->size;
+    msg->ix = slot->ix;
+    atomic_store_explicit(&slot->seq, pos + chan->mask + 1, memory_order_release);
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_chan_release(chan_pt chan, chan_msg_pt msg) {
+    return mem_del_alloc_ix(chan->pool, msg->ix, msg->mem - chan->pool->mem);
+}
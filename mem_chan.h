@@ -0,0 +1,64 @@
+/*
+ * Zero-copy message channel over a (shared) memory pool.
+ */
+
+#ifndef DENVER_OS_PA_C_MEM_CHAN_H
+#define DENVER_OS_PA_C_MEM_CHAN_H
+
+#include <stddef.h>
+
+#include "mem_pool.h"
+
+/* type declarations */
+
+typedef enum _chan_kind { CHAN_SPSC, CHAN_MPMC } chan_kind;
+
+typedef struct _chan *chan_pt;
+
+// a received message: its allocation, and where the pool keeps its record
+typedef struct _chan_msg {
+    size_t size;
+    char *mem;
+    unsigned ix;                // see mem_pool_alloc_ix
+} chan_msg_t, *chan_msg_pt;
+
+/* function declarations */
+
+// creates a channel holding up to capacity (rounded up to a power of 2, of
+// 2^31 at most) messages; the ring lives in the pool, so other processes
+// sharing the pool can attach to it by its offset
+chan_pt
+mem_chan_open(pool_pt pool, unsigned capacity, chan_kind kind);
+
+// attaches to the channel at offset (see mem_chan_offset), NULL unless a
+// whole ring is there, in the pool
+chan_pt
+mem_chan_attach(pool_pt pool, size_t offset);
+
+size_t
+mem_chan_offset(chan_pt chan);
+
+// detaches from the channel, the ring stays in the pool
+alloc_status
+mem_chan_close(chan_pt chan);
+
+// detaches from the channel and deletes the ring from the pool
+alloc_status
+mem_chan_destroy(chan_pt chan);
+
+// publishes an allocation from the channel's pool, the receiver owns it after
+// note: non-blocking, ALLOC_FAIL when the channel is full (or the allocation
+// isn't one of the pool's)
+alloc_status
+mem_chan_send(chan_pt chan, alloc_pt alloc);
+
+// takes the oldest message, msg->mem is its address in this process
+// note: non-blocking, ALLOC_FAIL when the channel is empty
+alloc_status
+mem_chan_recv(chan_pt chan, chan_msg_pt msg);
+
+// deletes a received message from the pool, in O(1)
+alloc_status
+mem_chan_release(chan_pt chan, chan_msg_pt msg);
+
+#endif //DENVER_OS_PA_C_MEM_CHAN_H
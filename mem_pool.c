@@ -2,9 +2,40 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _GNU_SOURCE // for mremap()
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+
+// per-CPU caches use restartable sequences where glibc registers them, and
+// the critical sections below are written for the architecture
+// note: not under ThreadSanitizer, which can't see their ordering
+#if defined(__x86_64__) && defined(__has_include) && !defined(__SANITIZE_THREAD__)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEM_RSEQ
+#endif
+#endif
+
+// the fit search scans node sizes with AVX2 or AVX-512 where the CPU has them
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define MEM_SIMD
+#endif
 
 #include "mem_pool.h"
 
@@ -13,20 +44,49 @@
 /* Constants */
 /*           */
 /*************/
-static const float      MEM_FILL_FACTOR                 = 0.75;
-static const unsigned   MEM_EXPAND_FACTOR               = 2;
+static const float      MEM_FILL_FACTOR                 = 0.75; // of the node heap and the gap index,
+static const unsigned   MEM_EXPAND_FACTOR               = 2;    // unless configured (see mem_pool_open_ex)
+static const unsigned   MEM_MAX_EXPAND_FACTOR           = 16;
+static const size_t     MEM_SMALL_POOL_SIZE             = 16 * 1024; // pool memory after the head, not mapped
+
+static const unsigned   MEM_POOL_STORE_INIT_CAPACITY    = 20;   // slots in the first chunk
+#define                 MEM_POOL_STORE_NUM_CHUNKS       26      // each twice the size of the last
+static const unsigned   MEM_POOL_STORE_TRIMMING         = 1u << 31; // flag in store_users
+
+#define                 MEM_NODE_HEAP_INIT_CAPACITY     40u     // nodes in the first chunk
+#define                 MEM_NODE_HEAP_NUM_CHUNKS        26      // each twice the size of the last
+
+#define                 MEM_GAP_IX_INIT_CAPACITY        40u
+
+static const unsigned   MEM_HANDLE_TABLE_INIT_CAPACITY  = 64;
+
+static const size_t     MEM_DEFRAG_STEP                 = 64 * 1024; // bytes per step of the defrag thread
+static const double     MEM_DEFRAG_THRESHOLD            = 0.1; // fragmentation it leaves alone
+static const unsigned   MEM_DEFRAG_TARGETS              = 8;   // gaps that fit, tried per allocation
 
-static const unsigned   MEM_POOL_STORE_INIT_CAPACITY    = 20;
-static const float      MEM_POOL_STORE_FILL_FACTOR      = 0.75;
-static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = 2;
+static const unsigned   MEM_NIL                         = UINT_MAX; // end of a node list
 
-static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
-static const float      MEM_NODE_HEAP_FILL_FACTOR       = 0.75;
-static const unsigned   MEM_NODE_HEAP_EXPAND_FACTOR     = 2;
+static const char       MEM_POOL_FILE_MAGIC[8]          = "MEMPOOL";
+#ifndef MEM_COMPACT_NODES
+static const unsigned   MEM_POOL_FILE_VERSION           = 1;
+static const size_t     MEM_POOL_MAX_SIZE               = SIZE_MAX;
+#else
+static const unsigned   MEM_POOL_FILE_VERSION           = 2;   // node heaps of compact nodes
+static const size_t     MEM_POOL_MAX_SIZE               = INT_MAX; // offsets and sizes of 31 bits
+#endif
 
-static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
-static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
-static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
+static const size_t     MEM_TAG_NIL                     = SIZE_MAX; // end of the free list of an inline pool
+#define                 MEM_TAG_PAYLOAD                 offsetof(tag_hdr_t, prev_free)
+#define                 MEM_TAG_MIN_BLOCK               (sizeof(tag_hdr_t) + sizeof(size_t))
+
+static const char       MEM_POOL_SNAP_MAGIC[8]          = "MEMSNAP";
+static const unsigned   MEM_POOL_SNAP_VERSION           = 1;
+
+#define                 MEM_CACHE_NUM_CLASSES           32  // size classes of 16, 32, .. 512 bytes
+#define                 MEM_CACHE_BIN_CAPACITY          64  // blocks per size class and thread
+static const size_t     MEM_CACHE_CLASS_SIZE            = 16;
+static const unsigned   MEM_CACHE_REFILL                = 16; // blocks allocated on a miss
+static const unsigned   MEM_CACHE_FLUSH                 = 32; // blocks deleted on an overflow
 
 
 
@@ -35,27 +95,210 @@ static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
 /* Type declarations */
 /*                   */
 /*********************/
+#ifndef MEM_COMPACT_NODES
 typedef struct _node {
-    alloc_t alloc_record;
+    union {
+        alloc_t alloc_record;  // handed out for allocations
+        size_t size;           // size
+    };
+    size_t offset;             // position of the segment in pool.mem
     unsigned used;
     unsigned allocated;
-    struct _node *next, *prev; // doubly-linked list for gap deletion
+    unsigned next, prev;       // doubly-linked list for gap deletion (node heap indices)
+} node_t, *node_pt;
+
+typedef size_t gap_size_t;
+
+typedef struct _gap {
+    gap_size_t size;
+    unsigned node;             // node heap index
+} gap_t, *gap_pt;
+#else
+// compact nodes: 16 bytes, for pools under 2 GB, with the allocation records
+// kept apart (see _mem_record), so that gaps and unused nodes don't pay for them
+typedef struct _node {
+    unsigned offset : 31;      // position of the segment in pool.mem
+    unsigned used : 1;
+    unsigned size : 31;
+    unsigned allocated : 1;
+    unsigned next, prev;       // doubly-linked list for gap deletion (node heap indices)
 } node_t, *node_pt;
 
+typedef unsigned gap_size_t;
+
 typedef struct _gap {
-    size_t size;
-    node_pt node;
+    gap_size_t size;
+    unsigned node;             // node heap index
 } gap_t, *gap_pt;
 
+_Static_assert(sizeof(node_t) == 16, "compact nodes are 16 bytes");
+#endif
+
+// header at the start of the backing file of a file-backed or shared pool
+// note: holds offsets and counts only, so the file can be mapped anywhere
+typedef struct _pool_hdr {
+    char magic[8];
+    unsigned version;
+    pthread_mutex_t lock;      // process-shared and robust, taken by shared pools
+    alloc_policy policy;
+    size_t total_size;
+    size_t alloc_size;
+    unsigned num_allocs;
+    unsigned num_gaps;
+    unsigned total_nodes;
+    unsigned used_nodes;
+    unsigned gap_ix_capacity;
+    size_t mem_off;            // file offset of the pool memory
+    size_t meta_off;           // file offset of the node heap, the gap index follows it
+    uintptr_t mem_addr;        // address the pool memory was last mapped at
+} pool_hdr_t, *pool_hdr_pt;
+
+// header of a pool snapshot, followed by the segments (as pool_segment_t)
+// and then the contents of the allocations, back to back
+typedef struct _pool_snap_hdr {
+    char magic[8];
+    unsigned version;
+    alloc_policy policy;
+    size_t total_size;
+    size_t alloc_size;
+    unsigned num_allocs;
+    unsigned num_segments;
+} pool_snap_hdr_t, *pool_snap_hdr_pt;
+
+// a chunk of the node heap, with the allocation records and the SoA view of
+// its nodes (see _mem_soa_build)
+// note: chunks never move once allocated, so neither do allocation records
+typedef struct _node_chunk {
+    node_pt nodes;             // mapped pools: a slice of the metadata mapping
+    alloc_pt records;          // compact nodes only, allocated on demand
+    gap_size_t *gap_sizes;     // size of the gap, 0 for other nodes
+    unsigned char *used;       // 1 for used nodes
+    unsigned *gens;            // generation of the ref of each node, 0 for none,
+                               // allocated on demand (see mem_ref_of)
+} node_chunk_t, *node_chunk_pt;
+
+// header of a block of an inline pool, in pool.mem, in place of a node
+// note: the tag is repeated in a footer at the end of the block, so that
+// both neighbours of a block are found from its own offset and size
+typedef struct _tag_hdr {
+    alloc_t alloc_record;      // handed out for allocations
+    size_t tag;                // size of the block << 1 | allocated
+    size_t prev_free;          // free blocks only, in what is otherwise the payload:
+    size_t next_free;          // offsets of the neighbours in the free list
+} tag_hdr_t, *tag_hdr_pt;
+
+// a thread's cache of freed blocks of one pool, by size class
+typedef struct _thread_cache {
+    _Atomic(struct _pool_mgr *) pool_mgr;   // NULL once the pool has closed
+    struct _thread_cache *next;             // the thread's caches
+    struct _thread_cache *pool_next;        // the pool's caches
+    unsigned counts[MEM_CACHE_NUM_CLASSES];
+    char *bins[MEM_CACHE_NUM_CLASSES][MEM_CACHE_BIN_CAPACITY];  // blocks, see _mem_cache_put
+} thread_cache_t, *thread_cache_pt;
+
+// a CPU's cache of freed blocks of one pool, by size class
+typedef struct _cpu_cache {
+    _Alignas(64) atomic_flag lock;          // without restartable sequences only
+    unsigned long counts[MEM_CACHE_NUM_CLASSES];
+    char *bins[MEM_CACHE_NUM_CLASSES][MEM_CACHE_BIN_CAPACITY];  // blocks, see _mem_cache_put
+} cpu_cache_t, *cpu_cache_pt;
+
+// what a delete by another thread leaves in the block, see mem_del_alloc
+typedef struct _remote_free {
+    char *next;                // block of the next one, or NULL
+    alloc_pt alloc;            // its mem is &mem_pending_free meanwhile
+} remote_free_t;
+
+// a slot of the handle table of a pool
+typedef struct _handle_slot {
+    alloc_pt alloc;             // NULL for vacated slots
+    unsigned pins;
+    unsigned next_free;         // vacated slots only, index + 1 of the next one
+} handle_slot_t, *handle_slot_pt;
+
+// a slot of the pool store
+typedef struct _pool_slot {
+    _Atomic(struct _pool_mgr *) pool_mgr;
+    atomic_uint next_free;      // vacated slots only, index + 1 of the next one
+} pool_slot_t, *pool_slot_pt;
+
+// an allocator context: a pool store of its own
+// note: lock-free, chunks of slots that never move, slots that have never
+// been used, and a stack of vacated slots to reuse first
+struct _mem_ctx {
+    _Alignas(64) _Atomic(pool_slot_pt) *store; // the chunks, allocated on demand
+    atomic_uint store_size;         // slots used at least once
+    _Atomic(uint64_t) store_free;   // vacated slots: tag << 32 | index + 1
+    atomic_uint store_live;         // pools in the store
+    atomic_uint store_trim_at;      // live pools to trim the store at
+    atomic_uint store_users;        // threads in the store, | TRIMMING
+};
+
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
+    node_chunk_t chunks[MEM_NODE_HEAP_NUM_CHUNKS]; // the node heap, see _mem_chunk_of
+    unsigned num_chunks;
     unsigned total_nodes;
     unsigned used_nodes;
+    unsigned head;             // node heap index of the first segment (0 until compacted)
+    handle_slot_pt handles;    // the handle table, allocated on demand
+    unsigned handles_size;     // slots used at least once
+    unsigned handles_capacity;
+    unsigned handles_free;     // vacated slots, index + 1 of the first one
+    unsigned defrag_next;      // handle table slot the next defrag step starts at
+    unsigned ref_gen;          // generation of the last ref handed out, 0 until then
+    int defragging;            // thread-safe pools only, with a defrag thread
+    int defrag_stop;           // under defrag_lock
+    unsigned defrag_period_ms;
+    unsigned defrag_slice_us;
+    pthread_t defrag_thread;
+    pthread_mutex_t defrag_lock;
+    pthread_cond_t defrag_cond;
     gap_pt gap_ix;
     unsigned gap_ix_capacity;
+    float fill_factor;         // the node heap and the gap index grow when this full,
+    unsigned expand_factor;    // by this factor
+    unsigned max_segments;     // realtime pools only, the metadata is reserved for as many
+    size_t cost;               // metadata entries visited by the last new or del alloc
+    unsigned shrink_wait;      // deletes until the node heap is checked for shrinking again
+    unsigned reserved_nodes;   // the node heap and the gap index don't shrink below
+    unsigned reserved_gaps;    // what mem_pool_open_ex reserved
+    int soa;                   // the chunks have their SoA view
+    int tagged;                // inline pools only, boundary tags instead of a node heap
+    size_t free_head;          // inline pools only, offset of the first free block
+    int in_buffer;             // inline pools in a caller's buffer, with their mgr, not in the store
+    int headed;                // the mgr is in a pool_head_t, with the first metadata
+    int small;                 // headed pools only, the pool memory follows the head
+    node_pt node_heap;         // mapped pools only, the node heap as mapped
+    pool_hdr_pt hdr;           // mapped pools only, NULL otherwise
+    int fd;                    // mapped pools, or the base pages of cloned pools, -1 otherwise
+    size_t meta_len;           // mapped pools only, length of the metadata mapping
+    int shared;                // mapped into several processes, take hdr->lock
+    int mt;                    // thread-safe pools only, take lock
+    pthread_mutex_t lock;      // thread-safe pools only
+    int cached;                // thread-safe pools only, with thread caches
+    thread_cache_pt caches;    // cached pools only, under thread_cache_lock
+    cpu_cache_pt cpu_caches;   // thread-safe pools only, with per-CPU caches
+    unsigned num_cpus;         // per-CPU cached pools only
+    int rseq;                  // per-CPU cached pools only, lock-free
+    pthread_t owner;           // thread-safe pools only, the thread that opened it
+    _Atomic(char *) remote_frees; // thread-safe pools only, blocks deleted by other threads
+    mem_ctx_pt ctx;            // context of the pool store
+    unsigned store_ix;         // slot in the pool store
 } pool_mgr_t, *pool_mgr_pt;
 
+// the mgr of a pool opened by mem_ctx_pool_open, with the metadata the pool
+// starts out with, in a single allocation, followed by the pool memory of a
+// small pool, so that opening and closing a small pool is a malloc and a free
+// note: the metadata outgrows the head, to chunks and a gap index of its own
+typedef struct _pool_head {
+    pool_mgr_t mgr;
+    node_t nodes[MEM_NODE_HEAP_INIT_CAPACITY];          // the first chunk
+    gap_size_t gap_sizes[MEM_NODE_HEAP_INIT_CAPACITY];  // and its SoA view
+    unsigned char used[MEM_NODE_HEAP_INIT_CAPACITY];
+    gap_t gap_ix[MEM_GAP_IX_INIT_CAPACITY];
+} pool_head_t, *pool_head_pt;
+
 
 
 /***************************/
@@ -63,9 +306,20 @@ typedef struct _pool_mgr {
 /* Static global variables */
 /*                         */
 /***************************/
-static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
-static unsigned pool_store_size = 0;
-static unsigned pool_store_capacity = 0;
+// the context of mem_init/mem_free and of the functions without a context
+static mem_ctx_t mem_default_ctx;
+
+static _Thread_local thread_cache_pt thread_caches = NULL; // most recently used first
+static pthread_mutex_t thread_cache_lock = PTHREAD_MUTEX_INITIALIZER; // for linking caches to pools
+static pthread_key_t thread_cache_key; // to flush a thread's caches when it exits
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+// the mem of a record while a delete by another thread is pending, so that
+// it can't be deleted again meanwhile (records that are deleted get a NULL mem)
+static char mem_pending_free;
+
+// the mem of a record while its block is in a cache, likewise
+static char mem_cached_block;
 
 
 
@@ -74,9 +328,44 @@ static unsigned pool_store_capacity = 0;
 /* Forward declarations of static functions */
 /*                                          */
 /********************************************/
-static alloc_status _mem_resize_pool_store();
+static alloc_status _mem_ctx_init(mem_ctx_pt ctx);
+static alloc_status _mem_ctx_free(mem_ctx_pt ctx);
+static pool_slot_pt _mem_store_slot(mem_ctx_pt ctx, unsigned ix, int alloc);
+static alloc_status _mem_store_pool(mem_ctx_pt ctx, pool_mgr_pt pool_mgr);
+static void _mem_unstore_pool(pool_mgr_pt pool_mgr);
+static void _mem_store_enter(mem_ctx_pt ctx);
+static void _mem_store_exit(mem_ctx_pt ctx);
+static void _mem_trim_store(mem_ctx_pt ctx);
+static pool_mgr_pt _mem_clone(pool_mgr_pt pool_mgr);
+static void
+        _mem_compact(pool_mgr_pt pool_mgr,
+                     mem_relocate_fn relocate,
+                     void *ctx,
+                     const size_t *pinned,
+                     unsigned num_pinned);
+static void
+        _mem_place_gap(pool_mgr_pt pool_mgr,
+                       unsigned ix,
+                       size_t offset,
+                       size_t size,
+                       unsigned *last);
+static size_t *_mem_pinned(pool_mgr_pt pool_mgr, unsigned *num_pinned);
+static int _mem_cmp_offsets(const void *a, const void *b);
+static handle_slot_pt _mem_handle_slot(pool_mgr_pt pool_mgr, mem_handle_t handle);
+static node_pt _mem_defrag_target(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_move_alloc(pool_mgr_pt pool_mgr, node_pt node, node_pt gap);
+static void *_mem_defrag_main(void *arg);
+static alloc_status _mem_enable_refs(pool_mgr_pt pool_mgr);
+static unsigned *_mem_node_gen(pool_mgr_pt pool_mgr, unsigned ix);
+static node_pt _mem_ref_node(pool_mgr_pt pool_mgr, mem_ref_t ref);
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
+static void _mem_shrink_meta(pool_mgr_pt pool_mgr);
+static alloc_status _mem_vacate_chunk(pool_mgr_pt pool_mgr, unsigned c);
+static alloc_status
+        _mem_resize_meta_map(pool_mgr_pt pool_mgr,
+                             unsigned total_nodes,
+                             unsigned gap_ix_capacity);
 static alloc_status
         _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                            size_t size,
@@ -86,6 +375,94 @@ static alloc_status
                                 size_t size,
                                 node_pt node);
 static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static pool_pt
+        _mem_pool_open_fd(mem_ctx_pt ctx,
+                          int fd,
+                          size_t size,
+                          alloc_policy policy,
+                          int shared);
+static void _mem_init_top_node(pool_mgr_pt pool_mgr);
+static void _mem_sync_hdr(pool_mgr_pt pool_mgr);
+static alloc_status _mem_sync_mgr(pool_mgr_pt pool_mgr);
+static alloc_status _mem_lock(pool_mgr_pt pool_mgr);
+static void _mem_unlock(pool_mgr_pt pool_mgr);
+static void _mem_repair(pool_mgr_pt pool_mgr);
+static void _mem_init_mt(pool_mgr_pt pool_mgr);
+static alloc_pt _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static node_pt _mem_unused_node(pool_mgr_pt pool_mgr);
+static alloc_status _mem_merge_gap(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_node(pool_mgr_pt pool_mgr, unsigned ix);
+static unsigned _mem_chunk_of(unsigned ix);
+static unsigned _mem_chunk_first(unsigned c);
+static unsigned _mem_chunk_len(pool_mgr_pt pool_mgr, unsigned c);
+static alloc_status _mem_add_chunk(pool_mgr_pt pool_mgr);
+static void _mem_map_chunks(pool_mgr_pt pool_mgr);
+static void _mem_free_chunks(pool_mgr_pt pool_mgr);
+static int _mem_in_head(pool_mgr_pt pool_mgr, const void *meta);
+static void _mem_meta_free(pool_mgr_pt pool_mgr, void *meta);
+static void *_mem_meta_realloc(pool_mgr_pt pool_mgr, void *meta, size_t len, size_t new_len);
+static unsigned _mem_node_ix(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_alloc_node(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_pt _mem_alloc_of(pool_mgr_pt pool_mgr, unsigned ix, size_t offset);
+static alloc_pt _mem_record(pool_mgr_pt pool_mgr, node_pt node);
+static int _mem_claimed(pool_mgr_pt pool_mgr, unsigned ix);
+static void _mem_place_record(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_reserve_records(pool_mgr_pt pool_mgr);
+static void _mem_set_used(pool_mgr_pt pool_mgr, node_pt node, unsigned used);
+static void _mem_set_gap_size(pool_mgr_pt pool_mgr, unsigned ix, gap_size_t size);
+static void _mem_soa_build(pool_mgr_pt pool_mgr);
+static void _mem_soa_grow(pool_mgr_pt pool_mgr, unsigned from);
+static void _mem_soa_free(pool_mgr_pt pool_mgr);
+static unsigned _mem_fit_scan(const gap_size_t *sizes, unsigned n, size_t size);
+static unsigned _mem_fit_scan_scalar(const gap_size_t *sizes, unsigned n, gap_size_t min);
+#ifdef MEM_SIMD
+static unsigned _mem_fit_scan_avx2(const gap_size_t *sizes, unsigned n, gap_size_t min);
+static unsigned _mem_fit_scan_avx512(const gap_size_t *sizes, unsigned n, gap_size_t min);
+#endif
+static char *_mem_claim(pool_mgr_pt pool_mgr, alloc_pt alloc, char *mark);
+static thread_cache_pt _mem_cache_get(pool_mgr_pt pool_mgr);
+static char *_mem_cache_put(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_pt _mem_cache_take(char *mem);
+static alloc_pt _mem_cache_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_cache_free(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static void _mem_cache_flush(thread_cache_pt cache, unsigned class, unsigned count);
+static void _mem_cache_key_init();
+static void _mem_cache_exit(void *caches);
+static int _mem_cacheable(size_t size);
+static alloc_status _mem_cpu_cache_init(pool_mgr_pt pool_mgr);
+static int _mem_cpu_push(pool_mgr_pt pool_mgr, unsigned class, char *mem);
+static int _mem_cpu_pop(pool_mgr_pt pool_mgr, unsigned class, char **mem);
+static alloc_pt _mem_cpu_cache_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_cpu_cache_free(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static void _mem_cpu_cache_drop(pool_mgr_pt pool_mgr, char **mems, unsigned count);
+static void _mem_drain_remote(pool_mgr_pt pool_mgr);
+static size_t _mem_cached_blocks(pool_mgr_pt pool_mgr);
+static alloc_status
+        _mem_reserve(pool_mgr_pt pool_mgr,
+                     unsigned num_nodes,
+                     unsigned num_gaps);
+static alloc_status
+        _mem_rebuild(pool_mgr_pt pool_mgr,
+                     const pool_segment_t *segments,
+                     unsigned num_segments);
+static int _mem_gap_cmp(const void *a, const void *b);
+static tag_hdr_pt _mem_tag_block(pool_mgr_pt pool_mgr, size_t offset);
+static void _mem_tag_set(pool_mgr_pt pool_mgr, size_t offset, size_t size, unsigned allocated);
+static void _mem_tag_init(pool_mgr_pt pool_mgr);
+static void _mem_tag_link(pool_mgr_pt pool_mgr, size_t offset, size_t prev);
+static void _mem_tag_unlink(pool_mgr_pt pool_mgr, size_t offset);
+static alloc_pt _mem_tag_new_alloc(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_tag_del_alloc(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static tag_hdr_pt _mem_tag_allocated(pool_mgr_pt pool_mgr, size_t offset);
+static alloc_status _mem_write_all(int fd, const void *buf, size_t len);
+static alloc_status _mem_read_all(int fd, void *buf, size_t len);
+static size_t _mem_map_len(size_t size);
+static alloc_status
+        _mem_copy_dirty(const char *mem,
+                        size_t len,
+                        char *dst,
+                        int dst_fd);
 
 
 
@@ -99,16 +476,10 @@ alloc_status mem_init() {
     // allocate the pool store with initial capacity
     // note: holds pointers only, other functions to allocate/deallocate
 
-    if (pool_store == NULL) {
-        pool_store = calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_pt));
-        pool_store_capacity = MEM_POOL_STORE_INIT_CAPACITY;
-        if (pool_store == NULL)
-            return  ALLOC_FAIL;
-        else
-            return  ALLOC_OK;
-    } else {
+    if (mem_default_ctx.store == NULL)
+        return _mem_ctx_init(&mem_default_ctx);
+    else
         return ALLOC_CALLED_AGAIN;
-    }
 }
 
 alloc_status mem_free() {
@@ -117,441 +488,4017 @@ alloc_status mem_free() {
     // can free the pool store array
     // update static variables
 
-    if (pool_store == NULL)
-        return ALLOC_CALLED_AGAIN;
+    if (mem_default_ctx.store == NULL)
+        return ALLOC_CALLED_AGAIN;
+
+    return _mem_ctx_free(&mem_default_ctx);
+}
+
+mem_ctx_pt mem_ctx_open() {
+    // a context of its own cache lines
+    mem_ctx_pt ctx = aligned_alloc(_Alignof(mem_ctx_t), sizeof(mem_ctx_t));
+    if (ctx == NULL)
+        return NULL;
+
+    if (_mem_ctx_init(ctx) != ALLOC_OK) {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+alloc_status mem_ctx_close(mem_ctx_pt ctx) {
+    if (ctx == NULL || ctx == &mem_default_ctx)
+        return ALLOC_FAIL;
+
+    alloc_status status = _mem_ctx_free(ctx);
+    free(ctx);
+
+    return status;
+}
+
+unsigned mem_store_slots() {
+    return mem_ctx_store_slots(&mem_default_ctx);
+}
+
+unsigned mem_ctx_store_slots(mem_ctx_pt ctx) {
+    if (ctx == NULL || ctx->store == NULL)
+        return 0;
+
+    return atomic_load_explicit(&ctx->store_size, memory_order_relaxed);
+}
+
+pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    return mem_ctx_pool_open(&mem_default_ctx, size, policy);
+}
+
+pool_pt mem_ctx_pool_open(mem_ctx_pt ctx, size_t size, alloc_policy policy) {
+    // make sure there the pool store is allocated
+    if (ctx == NULL || ctx->store == NULL || size > MEM_POOL_MAX_SIZE)
+        return NULL;
+
+    // allocate a new mem pool mgr, with the pool's first metadata, and the
+    // memory pool itself of a small pool
+    int small = size <= MEM_SMALL_POOL_SIZE;
+    pool_head_pt head = small ? calloc(1, sizeof(pool_head_t) + size) : malloc(sizeof(pool_head_t));
+
+    // check success, on error return null
+    if (head == NULL)
+        return NULL;
+
+    // allocate a new memory pool, unless it is small
+    // note: mapped rather than malloc-ed, so that mem_pool_clone can later
+    // map the pool's pages copy-on-write in place
+    pool_mgr_pt pool_mgr = &head->mgr;
+    if (small)
+        pool_mgr->pool.mem = (char *) (head + 1);
+    else
+        pool_mgr->pool.mem = mmap(NULL, _mem_map_len(size), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool_mgr->pool.mem == MAP_FAILED) {
+        free(head);
+        return NULL;
+    }
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size;
+    memset(pool_mgr->chunks, 0, sizeof(pool_mgr->chunks));
+    pool_mgr->num_chunks = 0;
+    pool_mgr->total_nodes = 0;
+    pool_mgr->soa = 0;
+    pool_mgr->tagged = 0;
+    pool_mgr->in_buffer = 0;
+    pool_mgr->headed = 1;
+    pool_mgr->small = small;
+    pool_mgr->fill_factor = MEM_FILL_FACTOR;
+    pool_mgr->expand_factor = MEM_EXPAND_FACTOR;
+    pool_mgr->max_segments = 0;
+    pool_mgr->cost = 0;
+    pool_mgr->shrink_wait = 0;
+    pool_mgr->reserved_nodes = 0;
+    pool_mgr->reserved_gaps = 0;
+    pool_mgr->head = 0;
+    pool_mgr->handles = NULL;
+    pool_mgr->handles_size = 0;
+    pool_mgr->handles_capacity = 0;
+    pool_mgr->handles_free = 0;
+    pool_mgr->defrag_next = 0;
+    pool_mgr->ref_gen = 0;
+    pool_mgr->defragging = 0;
+    pool_mgr->node_heap = NULL;
+    pool_mgr->hdr = NULL;
+    pool_mgr->fd = -1;
+    pool_mgr->meta_len = 0;
+    pool_mgr->shared = 0;
+    pool_mgr->mt = 0;
+    pool_mgr->cached = 0;
+    pool_mgr->caches = NULL;
+    pool_mgr->cpu_caches = NULL;
+
+    // a new node heap (its first chunk) and a new gap index, in the head
+    // check success, on error deallocate mgr/pool and return null
+    if (_mem_add_chunk(pool_mgr) != ALLOC_OK) {
+        if (!small)
+            munmap(pool_mgr->pool.mem, _mem_map_len(size));
+        free(head);
+        return NULL;
+    }
+    memset(head->gap_ix, 0, sizeof(head->gap_ix));
+    pool_mgr->gap_ix = head->gap_ix;
+    pool_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+
+    // assign all the pointers and update meta data
+    _mem_init_top_node(pool_mgr);
+    _mem_soa_build(pool_mgr);
+
+    //   link pool mgr to pool store
+    if (_mem_store_pool(ctx, pool_mgr) != ALLOC_OK) {
+        _mem_free_chunks(pool_mgr);
+        _mem_meta_free(pool_mgr, pool_mgr->gap_ix);
+        if (!small)
+            munmap(pool_mgr->pool.mem, _mem_map_len(size));
+        free(head);
+        return NULL;
+    }
+
+    // return the address of the mgr, cast to (pool_pt)
+    return (pool_pt) pool_mgr;
+}
+
+pool_pt mem_pool_open_mt(size_t size, alloc_policy policy) {
+    return mem_ctx_pool_open_mt(&mem_default_ctx, size, policy);
+}
+
+pool_pt mem_ctx_pool_open_mt(mem_ctx_pt ctx, size_t size, alloc_policy policy) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) mem_ctx_pool_open(ctx, size, policy);
+
+    if (pool_mgr == NULL)
+        return NULL;
+
+    _mem_init_mt(pool_mgr);
+
+    return (pool_pt) pool_mgr;
+}
+
+pool_pt mem_pool_open_inline(size_t size, alloc_policy policy) {
+    return mem_ctx_pool_open_inline(&mem_default_ctx, size, policy);
+}
+
+pool_pt mem_ctx_pool_open_inline(mem_ctx_pt ctx, size_t size, alloc_policy policy) {
+    // room for one block at least
+    if (size < MEM_TAG_MIN_BLOCK)
+        return NULL;
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) mem_ctx_pool_open(ctx, size, policy);
+    if (pool_mgr == NULL)
+        return NULL;
+
+    // the tags in pool.mem take the place of the node heap and the gap index
+    _mem_free_chunks(pool_mgr);
+    _mem_meta_free(pool_mgr, pool_mgr->gap_ix);
+    pool_mgr->gap_ix = NULL;
+    pool_mgr->gap_ix_capacity = 0;
+    pool_mgr->total_nodes = 0;
+    pool_mgr->tagged = 1;
+    _mem_tag_init(pool_mgr);
+
+    return (pool_pt) pool_mgr;
+}
+
+pool_pt mem_pool_open_in(void *buffer, size_t size, alloc_policy policy) {
+    // the mgr at the start of the buffer, and the pool memory right after it
+    uintptr_t start = (uintptr_t) buffer;
+    uintptr_t mgr = (start + _Alignof(pool_mgr_t) - 1) & ~(uintptr_t) (_Alignof(pool_mgr_t) - 1);
+    uintptr_t mem = (mgr + sizeof(pool_mgr_t) + sizeof(size_t) - 1) & ~(uintptr_t) (sizeof(size_t) - 1);
+
+    // room for one block at least
+    if (buffer == NULL || size < mem - start || size - (mem - start) < MEM_TAG_MIN_BLOCK)
+        return NULL;
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) mgr;
+    memset(pool_mgr, 0, sizeof(pool_mgr_t));
+    pool_mgr->pool.mem = (char *) mem;
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = size - (mem - start);
+    pool_mgr->fd = -1;
+    pool_mgr->fill_factor = MEM_FILL_FACTOR;
+    pool_mgr->expand_factor = MEM_EXPAND_FACTOR;
+    pool_mgr->max_segments = 0;
+    pool_mgr->cost = 0;
+    pool_mgr->shrink_wait = 0;
+    pool_mgr->reserved_nodes = 0;
+    pool_mgr->reserved_gaps = 0;
+    pool_mgr->head = 0;
+    pool_mgr->handles = NULL;
+    pool_mgr->handles_size = 0;
+    pool_mgr->handles_capacity = 0;
+    pool_mgr->handles_free = 0;
+    pool_mgr->defrag_next = 0;
+    pool_mgr->ref_gen = 0;
+    pool_mgr->defragging = 0;
+    pool_mgr->tagged = 1;
+    pool_mgr->in_buffer = 1;
+    _mem_tag_init(pool_mgr);
+
+    return (pool_pt) pool_mgr;
+}
+
+pool_pt mem_pool_open_ex(size_t size, alloc_policy policy, const pool_config_t *config) {
+    return mem_ctx_pool_open_ex(&mem_default_ctx, size, policy, config);
+}
+
+pool_pt mem_ctx_pool_open_ex(mem_ctx_pt ctx, size_t size, alloc_policy policy, const pool_config_t *config) {
+    static const pool_config_t defaults = { 0 };
+    if (config == NULL)
+        config = &defaults;
+
+    // 0 is the default, anything else has to make sense
+    // note: the node heap holds a fixed number of nodes at most, and grows
+    // before it is full, so it holds the nodes of fewer segments than that
+    unsigned flags = config->flags;
+    float fill_factor = (config->fill_factor != 0) ? config->fill_factor : MEM_FILL_FACTOR;
+    double max_segments = (double) _mem_chunk_first(MEM_NODE_HEAP_NUM_CHUNKS) * fill_factor;
+    if ((config->fill_factor != 0 && !(config->fill_factor > 0 && config->fill_factor < 1))
+        || config->expand_factor == 1 || config->expand_factor > MEM_MAX_EXPAND_FACTOR
+        || 2.0 * config->expected_allocs + 1 > max_segments
+        || (flags & ~(POOL_MT | POOL_INLINE | POOL_CACHE | POOL_CPU_CACHE | POOL_REALTIME)) != 0
+        || ((flags & (POOL_CACHE | POOL_CPU_CACHE)) && !(flags & POOL_MT))
+        || ((flags & POOL_CACHE) && (flags & POOL_CPU_CACHE)))
+        return NULL;
+
+    // realtime pools: a node heap to reserve, and nothing to allocate later
+    if ((flags & POOL_REALTIME)
+        && (config->max_segments == 0 || config->max_segments > max_segments
+            || (flags & (POOL_INLINE | POOL_CACHE | POOL_CPU_CACHE))))
+        return NULL;
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) ((flags & POOL_INLINE)
+                                          ? mem_ctx_pool_open_inline(ctx, size, policy)
+                                          : mem_ctx_pool_open(ctx, size, policy));
+    if (pool_mgr == NULL)
+        return NULL;
+
+    if (config->fill_factor != 0)
+        pool_mgr->fill_factor = config->fill_factor;
+    if (config->expand_factor != 0)
+        pool_mgr->expand_factor = config->expand_factor;
+
+    // the metadata of the expected allocations and the gaps between them, all
+    // at once (inline pools have none)
+    if (!pool_mgr->tagged && config->expected_allocs > 0
+        && (_mem_reserve(pool_mgr, 2 * config->expected_allocs + 1, config->expected_allocs + 1) != ALLOC_OK
+            || _mem_reserve_records(pool_mgr) != ALLOC_OK)) {
+        mem_pool_close((pool_pt) pool_mgr);
+        return NULL;
+    }
+    pool_mgr->reserved_nodes = pool_mgr->total_nodes;
+    pool_mgr->reserved_gaps = pool_mgr->gap_ix_capacity;
+
+    // the metadata of the most segments there can be, and of the gaps among
+    // them (every other one at most), and it can't grow from then on
+    if (flags & POOL_REALTIME) {
+        if (_mem_reserve(pool_mgr, config->max_segments, (config->max_segments + 1) / 2 + 1) != ALLOC_OK
+            || _mem_reserve_records(pool_mgr) != ALLOC_OK) {
+            mem_pool_close((pool_pt) pool_mgr);
+            return NULL;
+        }
+        pool_mgr->max_segments = config->max_segments;
+    }
+
+    if (flags & POOL_MT)
+        _mem_init_mt(pool_mgr);
+    if (((flags & POOL_CACHE) && mem_pool_enable_cache((pool_pt) pool_mgr) != ALLOC_OK)
+        || ((flags & POOL_CPU_CACHE) && mem_pool_enable_cpu_cache((pool_pt) pool_mgr) != ALLOC_OK)) {
+        mem_pool_close((pool_pt) pool_mgr);
+        return NULL;
+    }
+
+    return (pool_pt) pool_mgr;
+}
+
+size_t mem_pool_worst_case(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || pool_mgr->max_segments == 0)
+        return 0;
+
+    // new: the fit search (nodes, or a bisection of the gap index), the gap
+    // taken out of the gap index, the search for an unused node and the gap
+    // left over put in; del: two gaps out, the merged one in
+    size_t nodes = pool_mgr->total_nodes;
+    size_t gaps = pool_mgr->gap_ix_capacity;
+    size_t new_cost = nodes + 32 + (gaps + 1) + nodes + gaps;
+    size_t del_cost = 2 * (gaps + 1) + gaps;
+
+    return (new_cost > del_cost) ? new_cost : del_cost;
+}
+
+size_t mem_pool_last_cost(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    return (pool_mgr == NULL) ? 0 : pool_mgr->cost;
+}
+
+alloc_status mem_pool_enable_cache(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // caches only make sense in front of a lock, and one kind at a time
+    // note: nor in a pool with refs, whose blocks would be reused without
+    // their refs going stale
+    if (pool_mgr == NULL || !pool_mgr->mt || pool_mgr->cpu_caches != NULL || pool_mgr->ref_gen != 0)
+        return ALLOC_FAIL;
+
+    pthread_once(&thread_cache_once, _mem_cache_key_init);
+    pool_mgr->cached = 1;
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_pool_enable_cpu_cache(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // caches only make sense in front of a lock, and one kind at a time
+    if (pool_mgr == NULL || !pool_mgr->mt || pool_mgr->cached || pool_mgr->cpu_caches != NULL
+        || pool_mgr->ref_gen != 0)
+        return ALLOC_FAIL;
+
+    return _mem_cpu_cache_init(pool_mgr);
+}
+
+alloc_status mem_pool_flush_cache(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // per-CPU caches: the CPU the thread is running on
+    if (pool_mgr != NULL && pool_mgr->cpu_caches != NULL) {
+        char *mems[MEM_CACHE_BIN_CAPACITY];
+        for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++) {
+            unsigned count = 0;
+            while (count < MEM_CACHE_BIN_CAPACITY && _mem_cpu_pop(pool_mgr, c, &mems[count]) > 0)
+                count++;
+            _mem_cpu_cache_drop(pool_mgr, mems, count);
+        }
+        return ALLOC_OK;
+    }
+
+    if (pool_mgr == NULL || !pool_mgr->cached)
+        return ALLOC_FAIL;
+
+    for (thread_cache_pt cache = thread_caches; cache != NULL; cache = cache->next) {
+        if (atomic_load_explicit(&cache->pool_mgr, memory_order_relaxed) != pool_mgr)
+            continue;
+        if (_mem_lock(pool_mgr) != ALLOC_OK)
+            return ALLOC_FAIL;
+        for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++)
+            _mem_cache_flush(cache, c, cache->counts[c]);
+        _mem_sync_hdr(pool_mgr);
+        _mem_unlock(pool_mgr);
+    }
+
+    return ALLOC_OK;
+}
+
+pool_pt mem_pool_open_file(const char *path, size_t size, alloc_policy policy) {
+    return mem_ctx_pool_open_file(&mem_default_ctx, path, size, policy);
+}
+
+pool_pt mem_ctx_pool_open_file(mem_ctx_pt ctx, const char *path, size_t size, alloc_policy policy) {
+    // make sure there the pool store is allocated
+    if (ctx == NULL || ctx->store == NULL)
+        return NULL;
+
+    // open the backing file and make sure no other process has the pool open
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return NULL;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // note: the lock is held for as long as the pool stays open
+    return _mem_pool_open_fd(ctx, fd, size, policy, 0);
+}
+
+pool_pt mem_pool_open_shm(const char *name, size_t size, alloc_policy policy) {
+    return mem_ctx_pool_open_shm(&mem_default_ctx, name, size, policy);
+}
+
+pool_pt mem_ctx_pool_open_shm(mem_ctx_pt ctx, const char *name, size_t size, alloc_policy policy) {
+    // make sure there the pool store is allocated
+    if (ctx == NULL || ctx->store == NULL)
+        return NULL;
+
+    // open the shared memory object, serializing with other processes
+    // opening it, so that exactly one of them initializes the pool
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return NULL;
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pool_pt pool = _mem_pool_open_fd(ctx, fd, size, policy, 1);
+    if (pool != NULL)
+        flock(fd, LOCK_UN);
+
+    return pool;
+}
+
+alloc_status mem_pool_close(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // check if this pool is allocated
+    if (pool_mgr == NULL)
+        return ALLOC_NOT_FREED;
+
+    // a pool with allocations is left as it is, caches and all, but for the
+    // blocks in its caches and the deletes of other threads, which go anyway
+    // note: in the order the caches are flushed in, below
+    if (pool_mgr->hdr == NULL) {
+        pthread_mutex_lock(&thread_cache_lock);
+        if (_mem_lock(pool_mgr) != ALLOC_OK) {
+            pthread_mutex_unlock(&thread_cache_lock);
+            return ALLOC_NOT_FREED;
+        }
+        size_t live = pool_mgr->pool.num_allocs - _mem_cached_blocks(pool_mgr);
+        _mem_unlock(pool_mgr);
+        pthread_mutex_unlock(&thread_cache_lock);
+        if (live != 0)
+            return ALLOC_NOT_FREED;
+    }
+
+    // the defrag thread first, it takes the lock
+    if (pool_mgr->defragging)
+        mem_pool_defrag_stop(pool);
+
+    // blocks in thread caches go back to the pool, and the caches let go of it
+    if (pool_mgr->cached) {
+        pthread_mutex_lock(&thread_cache_lock);
+        _mem_lock(pool_mgr);
+        while (pool_mgr->caches != NULL) {
+            thread_cache_pt cache = pool_mgr->caches;
+            for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++)
+                _mem_cache_flush(cache, c, cache->counts[c]);
+            pool_mgr->caches = cache->pool_next;
+            atomic_store_explicit(&cache->pool_mgr, NULL, memory_order_relaxed);
+        }
+        _mem_unlock(pool_mgr);
+        pthread_mutex_unlock(&thread_cache_lock);
+    }
+    if (pool_mgr->mt)
+        _mem_drain_remote(pool_mgr);
+    if (pool_mgr->cpu_caches != NULL) {
+        for (unsigned cpu = 0; cpu < pool_mgr->num_cpus; cpu++) {
+            cpu_cache_pt cache = &pool_mgr->cpu_caches[cpu];
+            for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++) {
+                for (unsigned u = 0; u < cache->counts[c]; u++)
+                    _mem_del_alloc(pool_mgr, _mem_cache_take(cache->bins[c][u]));
+                cache->counts[c] = 0;
+            }
+        }
+        _mem_sync_hdr(pool_mgr);
+    }
+
+    if (pool_mgr->hdr != NULL) {
+        // mapped pools keep their allocations, they are only unmapped
+        _mem_free_chunks(pool_mgr);
+        munmap(pool_mgr->node_heap, pool_mgr->meta_len);
+        munmap(pool_mgr->hdr, pool_mgr->hdr->meta_off);
+        close(pool_mgr->fd);
+    } else {
+        // check if pool has only one gap
+        if (pool_mgr->pool.num_gaps != 1)
+            return ALLOC_NOT_FREED;
+
+        // check if it has zero allocations
+        if (pool_mgr->pool.num_allocs != 0)
+            return ALLOC_NOT_FREED;
+
+        // pools in a caller's buffer have nothing else, and the buffer is the caller's
+        if (pool_mgr->in_buffer)
+            return ALLOC_OK;
+
+        // free memory pool, and the pages it shares with its clones
+        // (small pools: with the mgr)
+        if (!pool_mgr->small)
+            munmap(pool_mgr->pool.mem, _mem_map_len(pool_mgr->pool.total_size));
+        if (pool_mgr->fd >= 0)
+            close(pool_mgr->fd);
+
+        // free node heap
+        _mem_free_chunks(pool_mgr);
+
+        // free gap index
+        _mem_meta_free(pool_mgr, pool_mgr->gap_ix);
+
+        // free handle table
+        free(pool_mgr->handles);
+    }
+
+    // thread-safe pools: no other thread can be using the pool anymore
+    if (pool_mgr->mt) {
+        pthread_mutex_destroy(&pool_mgr->lock);
+        free(pool_mgr->cpu_caches);
+    }
+
+    // vacate the mgr's slot in the pool store, for the next pool to reuse
+    _mem_unstore_pool(pool_mgr);
+
+    // free mgr
+    free(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // small sizes come out of the calling thread's (or CPU's) cache
+    if (pool_mgr->cached && _mem_cacheable(size))
+        return _mem_cache_alloc(pool_mgr, size);
+    if (pool_mgr->cpu_caches != NULL && _mem_cacheable(size))
+        return _mem_cpu_cache_alloc(pool_mgr, size);
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    alloc_pt alloc = _mem_new_alloc(pool_mgr, size);
+    _mem_sync_hdr(pool_mgr);
+    _mem_unlock(pool_mgr);
+
+    return alloc;
+}
+
+alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // blocks of exactly a class size go to the calling thread's (or CPU's) cache
+    if (alloc != NULL && _mem_cacheable(alloc->size) && alloc->size % MEM_CACHE_CLASS_SIZE == 0) {
+        if (pool_mgr->cached)
+            return _mem_cache_free(pool_mgr, alloc);
+        if (pool_mgr->cpu_caches != NULL)
+            return _mem_cpu_cache_free(pool_mgr, alloc);
+    }
+
+    // other threads leave the block to the next one to take the lock, through
+    // a lock-free stack linked through the blocks themselves
+    // note: the record's mem is claimed first, so that only the record of an
+    // allocation in the pool goes, and only once (see mem_pending_free)
+    if (pool_mgr->mt && alloc != NULL && alloc->size >= sizeof(remote_free_t)
+        && !pthread_equal(pthread_self(), pool_mgr->owner)) {
+        char *mem = _mem_claim(pool_mgr, alloc, &mem_pending_free);
+        if (mem == NULL)
+            return ALLOC_FAIL;
+
+        remote_free_t entry = { atomic_load_explicit(&pool_mgr->remote_frees, memory_order_relaxed), alloc };
+        do {
+            memcpy(mem, &entry, sizeof(remote_free_t));
+        } while (!atomic_compare_exchange_weak_explicit(&pool_mgr->remote_frees, &entry.next, mem,
+                                                        memory_order_release,
+                                                        memory_order_relaxed));
+        return ALLOC_OK;
+    }
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    alloc_status status = _mem_del_alloc(pool_mgr, alloc);
+    _mem_sync_hdr(pool_mgr);
+    _mem_unlock(pool_mgr);
+
+    return status;
+}
+
+alloc_pt mem_pool_alloc_at(pool_pt pool, size_t offset) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    alloc_pt alloc = NULL;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    // inline pools: walk the blocks, by their tags
+    for (size_t block = 0; pool_mgr->tagged && block < pool_mgr->pool.total_size; ) {
+        tag_hdr_pt hdr = _mem_tag_block(pool_mgr, block);
+        if (block + MEM_TAG_PAYLOAD > offset)
+            break;
+        if (block + MEM_TAG_PAYLOAD == offset && (hdr->tag & 1)) {
+            alloc = &hdr->alloc_record;
+            break;
+        }
+        block += hdr->tag >> 1;
+    }
+
+    // walk the segments in address order
+    for (node_pt node = _mem_node(pool_mgr, pool_mgr->head); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+        if (node->offset > offset)
+            break;
+        if (node->offset == offset && node->allocated) {
+            if (_mem_reserve_records(pool_mgr) == ALLOC_OK)
+                alloc = _mem_record(pool_mgr, node);
+            break;
+        }
+    }
+    _mem_unlock(pool_mgr);
+
+    return alloc;
+}
+
+unsigned mem_pool_alloc_ix(pool_pt pool, alloc_pt alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    unsigned ix = UINT_MAX;
+
+    if (pool_mgr == NULL || alloc == NULL)
+        return UINT_MAX;
+
+    // mapped pools: taking the lock may remap the metadata, and the record
+    // with it, so go by this process's mapping, which only it changes
+    // note: the node of a live allocation doesn't change under it
+    if (pool_mgr->hdr != NULL && !pool_mgr->tagged) {
+        node_pt node = _mem_alloc_node(pool_mgr, alloc);
+        if (node != NULL && node->used && node->allocated
+            && node->offset == (size_t) (alloc->mem - pool_mgr->pool.mem))
+            ix = _mem_node_ix(pool_mgr, node);
+        return ix;
+    }
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return UINT_MAX;
+
+    // inline pools: the record is in the block, which the offset finds
+    if (pool_mgr->tagged) {
+        uintptr_t addr = (uintptr_t) alloc, base = (uintptr_t) pool_mgr->pool.mem;
+        if (addr >= base && _mem_tag_allocated(pool_mgr, addr - base) == (tag_hdr_pt) alloc)
+            ix = 0;
+    } else {
+        node_pt node = _mem_alloc_node(pool_mgr, alloc);
+        if (node != NULL && node->used && node->allocated)
+            ix = _mem_node_ix(pool_mgr, node);
+    }
+    _mem_unlock(pool_mgr);
+
+    return ix;
+}
+
+alloc_status mem_del_alloc_ix(pool_pt pool, unsigned ix, size_t offset) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    alloc_pt alloc = _mem_alloc_of(pool_mgr, ix, offset);
+
+    // mapped pools: delete it under the same lock, taking it again may move
+    // the record
+    if (pool_mgr->hdr != NULL) {
+        alloc_status status = (alloc != NULL) ? _mem_del_alloc(pool_mgr, alloc) : ALLOC_FAIL;
+        _mem_sync_hdr(pool_mgr);
+        _mem_unlock(pool_mgr);
+        return status;
+    }
+    _mem_unlock(pool_mgr);
+
+    // otherwise the record stays put, and may have to go to a cache or
+    // another thread like any other
+    return (alloc != NULL) ? mem_del_alloc(pool, alloc) : ALLOC_FAIL;
+}
+
+void mem_inspect_pool(pool_pt pool,
+                      pool_segment_pt *segments,
+                      unsigned *num_segments) {
+    // get the mgr from the pool
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return;
+
+    // allocate the segments array with size == used_nodes
+    pool_segment_pt seg_array = calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+
+    // check successful
+    if (seg_array == NULL) {
+        _mem_unlock(pool_mgr);
+        return;
+    }
+
+    // loop through the node heap and the segments array
+    //    for each node, write the size and allocated in the segment
+    // "return" the values:
+    /*
+                    *segments = segs;
+                    *num_segments = pool_mgr->used_nodes;
+     */
+    pool_segment_pt segment = seg_array;
+    if (pool_mgr->tagged) {
+        // inline pools: the blocks, tags included
+        for (size_t block = 0; block < pool_mgr->pool.total_size; segment++) {
+            size_t tag = _mem_tag_block(pool_mgr, block)->tag;
+            segment->size = tag >> 1;
+            segment->allocated = tag & 1;
+            block += tag >> 1;
+        }
+        *segments = seg_array;
+        *num_segments = pool_mgr->used_nodes;
+        _mem_unlock(pool_mgr);
+        return;
+    }
+    node_pt target_node = _mem_node(pool_mgr, pool_mgr->head);
+    for (int i = 0; i < pool_mgr->used_nodes; i++) {
+        segment->size = target_node->size;
+        segment->allocated = target_node->allocated;
+        segment++;
+        target_node = _mem_node(pool_mgr, target_node->next);
+    }
+
+    *segments = seg_array;
+    *num_segments = pool_mgr->used_nodes;
+
+    _mem_unlock(pool_mgr);
+}
+
+
+
+alloc_status mem_pool_save(pool_pt pool, int fd) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_OK;
+
+    // the segments of an inline pool include its tags, which a snapshot can't
+    if (pool_mgr->tagged)
+        return ALLOC_FAIL;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    // the segments, same as mem_inspect_pool
+    pool_segment_pt segs = calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+    if (segs == NULL) {
+        _mem_unlock(pool_mgr);
+        return ALLOC_FAIL;
+    }
+    unsigned num_segs = 0;
+    for (node_pt node = _mem_node(pool_mgr, pool_mgr->head); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+        segs[num_segs].size = node->size;
+        segs[num_segs].allocated = node->allocated;
+        num_segs++;
+    }
+
+    pool_snap_hdr_t hdr;
+    memset(&hdr, 0, sizeof(pool_snap_hdr_t));
+    memcpy(hdr.magic, MEM_POOL_SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = MEM_POOL_SNAP_VERSION;
+    hdr.policy = pool_mgr->pool.policy;
+    hdr.total_size = pool_mgr->pool.total_size;
+    hdr.alloc_size = pool_mgr->pool.alloc_size;
+    hdr.num_allocs = pool_mgr->pool.num_allocs;
+    hdr.num_segments = num_segs;
+
+    if (_mem_write_all(fd, &hdr, sizeof(pool_snap_hdr_t)) != ALLOC_OK
+        || _mem_write_all(fd, segs, num_segs * sizeof(pool_segment_t)) != ALLOC_OK)
+        status = ALLOC_FAIL;
+    free(segs);
+
+    // the contents of the allocations, skipping the gaps
+    // note: adjacent allocations are contiguous, so write them in one go
+    size_t run_offset = 0, run_size = 0;
+    for (node_pt node = _mem_node(pool_mgr, pool_mgr->head); node != NULL && status == ALLOC_OK;
+         node = _mem_node(pool_mgr, node->next)) {
+        if (node->allocated) {
+            if (run_size == 0)
+                run_offset = node->offset;
+            run_size += node->size;
+        }
+        if ((!node->allocated || node->next == MEM_NIL) && run_size != 0) {
+            status = _mem_write_all(fd, pool_mgr->pool.mem + run_offset, run_size);
+            run_size = 0;
+        }
+    }
+
+    _mem_unlock(pool_mgr);
+
+    return status;
+}
+
+pool_pt mem_pool_load(int fd) {
+    return mem_ctx_pool_load(&mem_default_ctx, fd);
+}
+
+pool_pt mem_ctx_pool_load(mem_ctx_pt ctx, int fd) {
+    pool_snap_hdr_t hdr;
+    pool_segment_pt segs = NULL;
+    const char *data = NULL;
+    void *map = NULL;
+    size_t map_len = 0;
+    struct stat st;
+
+    // make sure there the pool store is allocated
+    if (ctx == NULL || ctx->store == NULL)
+        return NULL;
+
+    if (_mem_read_all(fd, &hdr, sizeof(pool_snap_hdr_t)) != ALLOC_OK
+        || memcmp(hdr.magic, MEM_POOL_SNAP_MAGIC, sizeof(hdr.magic)) != 0
+        || hdr.version != MEM_POOL_SNAP_VERSION
+        || hdr.num_segments == 0)
+        return NULL;
+
+    // the segments are small, read them (into aligned memory)
+    size_t segs_len = hdr.num_segments * sizeof(pool_segment_t);
+    segs = malloc(segs_len);
+    if (segs == NULL || _mem_read_all(fd, segs, segs_len) != ALLOC_OK) {
+        free(segs);
+        return NULL;
+    }
+
+    // map the contents in a snapshot file, read anything else (e.g. a pipe)
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos >= 0 && hdr.alloc_size > 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && (size_t) (st.st_size - pos) >= hdr.alloc_size) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        off_t map_off = pos / page * page;
+        map_len = (pos - map_off) + hdr.alloc_size;
+        map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_off);
+        if (map == MAP_FAILED) {
+            free(segs);
+            return NULL;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        data = (const char *) map + (pos - map_off);
+        lseek(fd, (off_t) hdr.alloc_size, SEEK_CUR);
+    }
+
+    // lay the segments out in a new pool, in one pass
+    // note: the contents are as long as the allocations, or there's no telling
+    // where they end
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) mem_ctx_pool_open(ctx, hdr.total_size, hdr.policy);
+    if (pool_mgr != NULL
+        && (_mem_rebuild(pool_mgr, segs, hdr.num_segments) != ALLOC_OK
+            || pool_mgr->pool.alloc_size != hdr.alloc_size)) {
+        pool_mgr->pool.num_allocs = 0;
+        pool_mgr->pool.num_gaps = 1;
+        mem_pool_close((pool_pt) pool_mgr);
+        pool_mgr = NULL;
+    }
+
+    // and copy the contents in
+    if (pool_mgr != NULL) {
+        size_t data_off = 0;
+        for (node_pt node = _mem_node(pool_mgr, pool_mgr->head); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+            if (!node->allocated)
+                continue;
+            if (data != NULL) {
+                memcpy(pool_mgr->pool.mem + node->offset, data + data_off, node->size);
+            } else if (_mem_read_all(fd, pool_mgr->pool.mem + node->offset, node->size) != ALLOC_OK) {
+                pool_mgr->pool.num_allocs = 0;
+                pool_mgr->pool.num_gaps = 1;
+                mem_pool_close((pool_pt) pool_mgr);
+                pool_mgr = NULL;
+                break;
+            }
+            data_off += node->size;
+        }
+    }
+
+    if (map != NULL)
+        munmap(map, map_len);
+    free(segs);
+
+    return (pool_pt) pool_mgr;
+}
+
+
+
+pool_pt mem_pool_clone(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // make sure there the pool store is allocated
+    if (pool_mgr == NULL || pool_mgr->ctx == NULL || pool_mgr->ctx->store == NULL)
+        return NULL;
+
+    // mapped pools are written through to their file, which can't be shared
+    // copy-on-write with a clone, and the records of inline pools are in the
+    // pool's pages, at the pool's addresses
+    if (pool_mgr->hdr != NULL || pool_mgr->tagged)
+        return NULL;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+    pool_mgr_pt clone = _mem_clone(pool_mgr);
+    _mem_unlock(pool_mgr);
+
+    if (clone == NULL)
+        return NULL;
+
+    // a clone of a thread-safe pool is thread-safe, and starts out with
+    // empty caches
+    clone->caches = NULL;
+    clone->defragging = 0;
+    if (clone->cpu_caches != NULL && _mem_cpu_cache_init(clone) != ALLOC_OK)
+        clone->cpu_caches = NULL;
+    if (clone->mt)
+        _mem_init_mt(clone);
+
+    //   a realtime clone gets all of its records up front, as its pool did
+    //   link pool mgr to the pool store of the pool
+    if ((clone->max_segments != 0 && _mem_reserve_records(clone) != ALLOC_OK)
+        || _mem_store_pool(pool_mgr->ctx, clone) != ALLOC_OK) {
+        free(clone->cpu_caches);
+        if (!clone->small) {
+            munmap(clone->pool.mem, _mem_map_len(clone->pool.total_size));
+            close(clone->fd);
+        }
+        _mem_free_chunks(clone);
+        free(clone->gap_ix);
+        free(clone->handles);
+        free(clone);
+        return NULL;
+    }
+
+    return (pool_pt) clone;
+}
+
+alloc_status mem_pool_compact(pool_pt pool, mem_relocate_fn relocate, void *ctx) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL)
+        return ALLOC_FAIL;
+
+    // other processes hold offsets into mapped pools, the records of inline
+    // pools would move along with their blocks, and caches hold blocks
+    if (pool_mgr->hdr != NULL || pool_mgr->tagged || pool_mgr->cached || pool_mgr->cpu_caches != NULL)
+        return ALLOC_FAIL;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    // pinned handles stay put
+    unsigned num_pinned = 0;
+    size_t *pinned = _mem_pinned(pool_mgr, &num_pinned);
+    if (num_pinned > 0 && pinned == NULL) {
+        _mem_unlock(pool_mgr);
+        return ALLOC_FAIL;
+    }
+    _mem_compact(pool_mgr, relocate, ctx, pinned, num_pinned);
+    free(pinned);
+    _mem_unlock(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+mem_handle_t mem_handle_new(pool_pt pool, size_t size) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // only pools that can be compacted, see mem_pool_compact
+    if (pool_mgr == NULL || pool_mgr->hdr != NULL || pool_mgr->tagged
+        || pool_mgr->cached || pool_mgr->cpu_caches != NULL)
+        return 0;
+
+    alloc_pt alloc = mem_new_alloc(pool, size);
+    if (alloc == NULL)
+        return 0;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK) {
+        mem_del_alloc(pool, alloc);
+        return 0;
+    }
+
+    // a vacated slot, or a new one, growing the table as needed
+    if (pool_mgr->handles_free == 0 && pool_mgr->handles_size == pool_mgr->handles_capacity) {
+        unsigned capacity = (pool_mgr->handles_capacity == 0)
+                            ? MEM_HANDLE_TABLE_INIT_CAPACITY
+                            : pool_mgr->handles_capacity * pool_mgr->expand_factor;
+        handle_slot_pt handles = realloc(pool_mgr->handles, sizeof(handle_slot_t) * capacity);
+        if (handles == NULL) {
+            _mem_unlock(pool_mgr);
+            mem_del_alloc(pool, alloc);
+            return 0;
+        }
+        pool_mgr->handles = handles;
+        pool_mgr->handles_capacity = capacity;
+    }
+
+    unsigned ix;
+    if (pool_mgr->handles_free != 0) {
+        ix = pool_mgr->handles_free - 1;
+        pool_mgr->handles_free = pool_mgr->handles[ix].next_free;
+    } else {
+        ix = pool_mgr->handles_size++;
+    }
+    pool_mgr->handles[ix].alloc = alloc;
+    pool_mgr->handles[ix].pins = 0;
+    pool_mgr->handles[ix].next_free = 0;
+    _mem_unlock(pool_mgr);
+
+    return ix + 1;
+}
+
+alloc_status mem_handle_del(pool_pt pool, mem_handle_t handle) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    // pinned handles can't go
+    handle_slot_pt slot = _mem_handle_slot(pool_mgr, handle);
+    if (slot == NULL || slot->pins > 0) {
+        _mem_unlock(pool_mgr);
+        return ALLOC_FAIL;
+    }
+    alloc_pt alloc = slot->alloc;
+    slot->alloc = NULL;
+    slot->next_free = pool_mgr->handles_free;
+    pool_mgr->handles_free = handle;
+    _mem_unlock(pool_mgr);
+
+    return mem_del_alloc(pool, alloc);
+}
+
+void *mem_handle_pin(pool_pt pool, mem_handle_t handle) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    handle_slot_pt slot = _mem_handle_slot(pool_mgr, handle);
+    void *mem = NULL;
+    if (slot != NULL && slot->pins < UINT_MAX) {
+        slot->pins++;
+        mem = slot->alloc->mem;
+    }
+    _mem_unlock(pool_mgr);
+
+    return mem;
+}
+
+alloc_status mem_handle_unpin(pool_pt pool, mem_handle_t handle) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    handle_slot_pt slot = _mem_handle_slot(pool_mgr, handle);
+    alloc_status status = ALLOC_FAIL;
+    if (slot != NULL && slot->pins > 0) {
+        slot->pins--;
+        status = ALLOC_OK;
+    }
+    _mem_unlock(pool_mgr);
+
+    return status;
+}
+
+mem_ref_t mem_ref_new(pool_pt pool, size_t size) {
+    alloc_pt alloc = mem_new_alloc(pool, size);
+    if (alloc == NULL)
+        return 0;
+
+    mem_ref_t ref = mem_ref_of(pool, alloc);
+    if (ref == 0)
+        mem_del_alloc(pool, alloc);
+
+    return ref;
+}
+
+mem_ref_t mem_ref_of(pool_pt pool, alloc_pt alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // only pools whose nodes are the allocations, and whose blocks are never
+    // reused behind the node heap's back
+    if (pool_mgr == NULL || pool_mgr->hdr != NULL || pool_mgr->tagged
+        || pool_mgr->cached || pool_mgr->cpu_caches != NULL)
+        return 0;
+
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return 0;
+
+    node_pt node = _mem_alloc_node(pool_mgr, alloc);
+    if (node == NULL || !node->used || !node->allocated
+        || (pool_mgr->ref_gen == 0 && _mem_enable_refs(pool_mgr) != ALLOC_OK)) {
+        _mem_unlock(pool_mgr);
+        return 0;
+    }
+
+    // an allocation keeps its ref until it is deleted, and the generations
+    // come from the pool, so that no two allocations ever share one
+    unsigned ix = _mem_node_ix(pool_mgr, node);
+    unsigned *gen = _mem_node_gen(pool_mgr, ix);
+    if (*gen == 0) {
+        if (++pool_mgr->ref_gen == 0)
+            pool_mgr->ref_gen = 1;
+        *gen = pool_mgr->ref_gen;
+    }
+    mem_ref_t ref = (mem_ref_t) *gen << 32 | (ix + 1);
+    _mem_unlock(pool_mgr);
+
+    return ref;
+}
+
+alloc_pt mem_ref_resolve(pool_pt pool, mem_ref_t ref) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    // note: compact nodes may have no records yet, e.g. in a clone
+    node_pt node = _mem_ref_node(pool_mgr, ref);
+    alloc_pt alloc = NULL;
+    if (node != NULL && _mem_reserve_records(pool_mgr) == ALLOC_OK)
+        alloc = _mem_record(pool_mgr, node);
+    _mem_unlock(pool_mgr);
+
+    return alloc;
+}
+
+alloc_status mem_ref_del(pool_pt pool, mem_ref_t ref) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || _mem_lock(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    node_pt node = _mem_ref_node(pool_mgr, ref);
+    alloc_status status = ALLOC_FAIL;
+    if (node != NULL && _mem_reserve_records(pool_mgr) == ALLOC_OK)
+        status = _mem_del_alloc(pool_mgr, _mem_record(pool_mgr, node));
+    _mem_unlock(pool_mgr);
+
+    return status;
+}
+
+double mem_pool_fragmentation(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || pool_mgr->tagged || _mem_lock(pool_mgr) != ALLOC_OK)
+        return 0;
+
+    // the gap index is sorted by size, the largest gap is the last
+    size_t free_size = pool_mgr->pool.total_size - pool_mgr->pool.alloc_size;
+    double fragmentation = 0;
+    if (pool_mgr->pool.num_gaps > 0 && free_size > 0)
+        fragmentation = 1 - (double) pool_mgr->gap_ix[pool_mgr->pool.num_gaps - 1].size / free_size;
+    _mem_unlock(pool_mgr);
+
+    return fragmentation;
+}
+
+size_t mem_pool_defrag(pool_pt pool, size_t max_bytes) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || pool_mgr->hdr != NULL || pool_mgr->tagged
+        || _mem_lock(pool_mgr) != ALLOC_OK)
+        return 0;
+
+    // the handles take turns, from where the last step left off, and each
+    // unpinned one moves down into a gap before it, if one fits
+    // note: the moves count into no operation's cost
+    size_t cost = pool_mgr->cost;
+    size_t moved = 0;
+    for (unsigned visited = 0; visited < pool_mgr->handles_size && moved < max_bytes; visited++) {
+        if (pool_mgr->defrag_next >= pool_mgr->handles_size)
+            pool_mgr->defrag_next = 0;
+        handle_slot_pt slot = &pool_mgr->handles[pool_mgr->defrag_next++];
+        if (slot->alloc == NULL || slot->pins > 0)
+            continue;
+
+        // within the budget, but for the first move of the step
+        node_pt node = _mem_alloc_node(pool_mgr, slot->alloc);
+        if (node == NULL || (moved > 0 && node->size > max_bytes - moved))
+            continue;
+        node_pt gap = _mem_defrag_target(pool_mgr, node);
+        if (gap == NULL)
+            continue;
+        if (_mem_move_alloc(pool_mgr, node, gap) != ALLOC_OK)
+            break;
+        moved += node->size;
+    }
+    pool_mgr->cost = cost;
+    _mem_unlock(pool_mgr);
+
+    return moved;
+}
+
+alloc_status mem_pool_defrag_start(pool_pt pool, unsigned period_ms, unsigned slice_us) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    // the thread shares the pool, so it has to be thread-safe
+    if (pool_mgr == NULL || !pool_mgr->mt || pool_mgr->defragging
+        || pool_mgr->hdr != NULL || pool_mgr->tagged || slice_us == 0)
+        return ALLOC_FAIL;
+
+    pool_mgr->defrag_stop = 0;
+    pool_mgr->defrag_period_ms = period_ms;
+    pool_mgr->defrag_slice_us = slice_us;
+    pthread_mutex_init(&pool_mgr->defrag_lock, NULL);
+    pthread_cond_init(&pool_mgr->defrag_cond, NULL);
+    if (pthread_create(&pool_mgr->defrag_thread, NULL, _mem_defrag_main, pool_mgr) != 0) {
+        pthread_cond_destroy(&pool_mgr->defrag_cond);
+        pthread_mutex_destroy(&pool_mgr->defrag_lock);
+        return ALLOC_FAIL;
+    }
+    pool_mgr->defragging = 1;
+
+    return ALLOC_OK;
+}
+
+alloc_status mem_pool_defrag_stop(pool_pt pool) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+
+    if (pool_mgr == NULL || !pool_mgr->defragging)
+        return ALLOC_FAIL;
+
+    pthread_mutex_lock(&pool_mgr->defrag_lock);
+    pool_mgr->defrag_stop = 1;
+    pthread_cond_signal(&pool_mgr->defrag_cond);
+    pthread_mutex_unlock(&pool_mgr->defrag_lock);
+    pthread_join(pool_mgr->defrag_thread, NULL);
+
+    pthread_cond_destroy(&pool_mgr->defrag_cond);
+    pthread_mutex_destroy(&pool_mgr->defrag_lock);
+    pool_mgr->defragging = 0;
+
+    return ALLOC_OK;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+// mem_pool_clone, with the pool locked
+static pool_mgr_pt _mem_clone(pool_mgr_pt pool_mgr) {
+    size_t map_len = _mem_map_len(pool_mgr->pool.total_size);
+    int small = pool_mgr->small;
+
+    // the first clone moves the pool's pages to a base file (present pages
+    // only), which the pool and all its clones then map copy-on-write
+    // note: small pools are copied outright instead, pool memory and all
+    if (!small && pool_mgr->fd < 0) {
+        int fd = memfd_create("mem_pool", MFD_CLOEXEC);
+        if (fd < 0)
+            return NULL;
+        if (ftruncate(fd, (off_t) map_len) != 0
+            || _mem_copy_dirty(pool_mgr->pool.mem, map_len, NULL, fd) != ALLOC_OK
+            || mmap(pool_mgr->pool.mem, map_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        pool_mgr->fd = fd;
+    }
+
+    // the metadata of a clone is allocated apart, but for small pools the
+    // pool memory still follows the mgr, as in a head
+    pool_mgr_pt clone = malloc(small ? sizeof(pool_head_t) + pool_mgr->pool.total_size : sizeof(pool_mgr_t));
+    if (clone == NULL)
+        return NULL;
+    *clone = *pool_mgr;
+    clone->headed = 0;
+
+    if (small) {
+        clone->fd = -1;
+        clone->pool.mem = (char *) ((pool_head_pt) clone + 1);
+        memcpy(clone->pool.mem, pool_mgr->pool.mem, pool_mgr->pool.total_size);
+    } else {
+        clone->fd = dup(pool_mgr->fd);
+        clone->pool.mem = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE, clone->fd, 0);
+    }
+    clone->gap_ix = malloc(sizeof(gap_t) * pool_mgr->gap_ix_capacity);
+    clone->handles = NULL;
+    if (pool_mgr->handles != NULL)
+        clone->handles = malloc(sizeof(handle_slot_t) * pool_mgr->handles_capacity);
+    int chunks_ok = 1;
+    for (unsigned c = 0; c < clone->num_chunks; c++) {
+        memset(&clone->chunks[c], 0, sizeof(node_chunk_t));
+        clone->chunks[c].nodes = malloc(sizeof(node_t) * _mem_chunk_len(clone, c));
+        chunks_ok = chunks_ok && clone->chunks[c].nodes != NULL;
+        if (pool_mgr->chunks[c].gens != NULL) {
+            clone->chunks[c].gens = malloc(sizeof(unsigned) * _mem_chunk_len(clone, c));
+            chunks_ok = chunks_ok && clone->chunks[c].gens != NULL;
+        }
+    }
+    clone->soa = 0;
+    if ((!small && (clone->fd < 0 || clone->pool.mem == MAP_FAILED))
+        || !chunks_ok || clone->gap_ix == NULL
+        || (pool_mgr->handles != NULL && clone->handles == NULL)) {
+        if (!small && clone->pool.mem != MAP_FAILED)
+            munmap(clone->pool.mem, map_len);
+        if (clone->fd >= 0)
+            close(clone->fd);
+        _mem_free_chunks(clone);
+        free(clone->gap_ix);
+        free(clone->handles);
+        free(clone);
+        return NULL;
+    }
+
+    // pages written since the base file was made are the pool's own
+    // note: so are the records the handles of the clone go by, and the
+    // deletes below
+    if ((!small && _mem_copy_dirty(pool_mgr->pool.mem, map_len, clone->pool.mem, -1) != ALLOC_OK)
+        || _mem_reserve_records(clone) != ALLOC_OK) {
+        if (!small)
+            munmap(clone->pool.mem, map_len);
+        if (clone->fd >= 0)
+            close(clone->fd);
+        _mem_free_chunks(clone);
+        free(clone->gap_ix);
+        free(clone->handles);
+        free(clone);
+        return NULL;
+    }
+
+    // the metadata is index-based, so it copies as is, except for the
+    // addresses in the allocation records
+    // note: and so are the refs, which stay valid in the clone
+    for (unsigned c = 0; c < clone->num_chunks; c++) {
+        memcpy(clone->chunks[c].nodes, pool_mgr->chunks[c].nodes,
+               sizeof(node_t) * _mem_chunk_len(clone, c));
+        if (clone->chunks[c].gens != NULL)
+            memcpy(clone->chunks[c].gens, pool_mgr->chunks[c].gens,
+                   sizeof(unsigned) * _mem_chunk_len(clone, c));
+    }
+    memcpy(clone->gap_ix, pool_mgr->gap_ix, sizeof(gap_t) * pool_mgr->gap_ix_capacity);
+
+    // blocks in the pool's caches, or whose delete by another thread is
+    // pending, are deleted in the clone, which has neither to give them back
+    // note: the next allocation, past a gap that a delete may merge, stays put
+    for (node_pt node = _mem_node(clone, clone->head); node != NULL; ) {
+        node_pt next = _mem_node(clone, node->next);
+        if (next != NULL && !next->allocated)
+            next = _mem_node(clone, next->next);
+        int claimed = node->allocated && _mem_claimed(pool_mgr, _mem_node_ix(clone, node));
+        _mem_place_record(clone, node);
+        if (claimed)
+            _mem_del_alloc(clone, _mem_record(clone, node));
+        node = next;
+    }
+    _mem_soa_build(clone);
+
+    // the handles go by the same nodes, unpinned
+    for (unsigned u = 0; u < clone->handles_size; u++) {
+        clone->handles[u] = pool_mgr->handles[u];
+        clone->handles[u].pins = 0;
+        if (clone->handles[u].alloc != NULL) {
+            node_pt node = _mem_alloc_node(pool_mgr, pool_mgr->handles[u].alloc);
+            clone->handles[u].alloc = _mem_record(clone, _mem_node(clone, _mem_node_ix(pool_mgr, node)));
+        }
+    }
+
+    return clone;
+}
+
+static alloc_pt _mem_new_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    pool_pt pool = &pool_mgr->pool;
+
+    if (pool_mgr->tagged)
+        return _mem_tag_new_alloc(pool_mgr, size);
+    pool_mgr->cost = 0;
+
+    // check if any gaps, return null if none
+    if (pool_mgr->pool.num_gaps == 0)
+        return NULL;
+
+    // expand heap node, if necessary, quit on error
+    if (_mem_resize_node_heap(pool_mgr) != ALLOC_OK
+        || _mem_reserve_records(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    // check used nodes fewer than total nodes, quit on error
+    if (pool_mgr->used_nodes > pool_mgr->total_nodes)
+        return NULL;
+
+    // get a node for allocation:
+    node_pt node = NULL;
+
+    // if FIRST_FIT, then find the first sufficient node in the node heap
+    // note: by the gap sizes alone where there are, see _mem_fit_scan
+    if (pool->policy == FIRST_FIT) {
+        if (pool_mgr->soa) {
+            for (unsigned c = 0; c < pool_mgr->num_chunks && node == NULL; c++) {
+                unsigned len = _mem_chunk_len(pool_mgr, c);
+                unsigned i = _mem_fit_scan(pool_mgr->chunks[c].gap_sizes, len, size);
+                pool_mgr->cost += (i < len) ? i + 1 : len;
+                if (i < len)
+                    node = &pool_mgr->chunks[c].nodes[i];
+            }
+        } else {
+            for (unsigned i = 0; i < pool_mgr->total_nodes; i ++) {
+                node_pt candidate = _mem_node(pool_mgr, i);
+                pool_mgr->cost++;
+                if (candidate->used == 1
+                    && candidate->allocated == 0
+                    && candidate->size >= size) {
+                    node = candidate;
+                    break;
+                }
+            }
+        }
+        // if BEST_FIT, then find the first sufficient node in the gap index
+        // note: sorted by size, so by bisection
+    } else if  (pool->policy == BEST_FIT) {
+        unsigned lo = 0, hi = pool_mgr->pool.num_gaps;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo) / 2;
+            pool_mgr->cost++;
+            if (pool_mgr->gap_ix[mid].size >= size)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        if (lo < pool_mgr->pool.num_gaps)
+            node = _mem_node(pool_mgr, pool_mgr->gap_ix[lo].node);
+    } else {
+        return NULL;
+    }
+
+    // check if node found
+    if (node == NULL) {
+        return NULL;
+    }
+
+    // realtime pools: a gap left over takes a segment more than there may be
+    if (pool_mgr->max_segments != 0 && node->size != size
+        && pool_mgr->used_nodes >= pool_mgr->max_segments)
+        return NULL;
+
+    // update metadata (num_allocs, alloc_size)
+    pool->num_allocs++;
+    pool->alloc_size += size;
+
+    // calculate the size of the remaining gap, if any
+    size_t remaining_gap_size = node->size - size;
+
+    // remove node from gap index
+    if (_mem_remove_from_gap_ix(pool_mgr, size, node) != ALLOC_OK)
+        return NULL;
+
+    // convert gap_node to an allocation node of given size
+    node->allocated = 1;
+    node->size = size;
+    _mem_place_record(pool_mgr, node);
+
+    // adjust node heap:
+    //   if remaining gap, need a new node
+    if (remaining_gap_size != 0) {
+        //   find an unused one in the node heap
+        node_pt unused_node = _mem_unused_node(pool_mgr);
+
+        //   make sure one was found
+        if (unused_node == NULL)
+            return NULL;
+
+        //   initialize it to a gap node
+        unused_node->allocated = 0;
+        _mem_set_used(pool_mgr, unused_node, 1);
+        unused_node->size = remaining_gap_size;
+        unused_node->offset = node->offset + size;
+        _mem_place_record(pool_mgr, unused_node);
+
+        //   update metadata (used_nodes)
+        pool_mgr->used_nodes++;
+
+        //   update linked list (new node right after the node for allocation)
+        unsigned unused_ix = _mem_node_ix(pool_mgr, unused_node);
+        unused_node->next = node->next;
+        if (node->next != MEM_NIL)
+            _mem_node(pool_mgr, node->next)->prev = unused_ix;
+        node->next = unused_ix;
+        unused_node->prev = _mem_node_ix(pool_mgr, node);
+
+        //   add to gap index
+        //   check if successful
+        if (_mem_add_to_gap_ix(pool_mgr, remaining_gap_size, unused_node) != ALLOC_OK)
+            return NULL;
+    }
+
+    // return allocation record of the node
+    return _mem_record(pool_mgr, node);
+}
+
+// first unused node of the node heap, or NULL if there is none
+static node_pt _mem_unused_node(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->soa) {
+        for (unsigned c = 0; c < pool_mgr->num_chunks; c++) {
+            unsigned char *used = pool_mgr->chunks[c].used;
+            unsigned len = _mem_chunk_len(pool_mgr, c);
+            unsigned char *found = memchr(used, 0, len);
+            pool_mgr->cost += (found != NULL) ? (unsigned) (found - used) + 1 : len;
+            if (found != NULL)
+                return &pool_mgr->chunks[c].nodes[found - used];
+        }
+    } else {
+        for (unsigned i = 0; i < pool_mgr->total_nodes; i ++) {
+            pool_mgr->cost++;
+            if (_mem_node(pool_mgr, i)->used == 0)
+                return _mem_node(pool_mgr, i);
+        }
+    }
+
+    return NULL;
+}
+
+static alloc_status _mem_del_alloc(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    if (pool_mgr->tagged)
+        return _mem_tag_del_alloc(pool_mgr, alloc);
+    pool_mgr->cost = 0;
+
+    // get node from alloc by casting the pointer to (node_pt)
+    node_pt node = _mem_alloc_node(pool_mgr, alloc);
+
+    // this is node-to-delete
+    // make sure it's found
+    if (node == NULL || !node->used || !node->allocated)
+        return ALLOC_FAIL;
+
+    // a record whose delete by another thread is pending goes only then, and
+    // one whose block is in a cache only as the cache gives it back
+    char *mem = atomic_load_explicit((_Atomic(char *) *) &alloc->mem, memory_order_relaxed);
+    if (mem == &mem_pending_free || mem == &mem_cached_block)
+        return ALLOC_FAIL;
+
+    // its ref, if any, goes stale
+    if (pool_mgr->ref_gen != 0)
+        *_mem_node_gen(pool_mgr, _mem_node_ix(pool_mgr, node)) = 0;
+
+    // convert to gap node, and the record to a deleted one (see
+    // mem_pending_free)
+    node->allocated = 0;
+    alloc->mem = NULL;
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= node->size;
+
+    if (_mem_merge_gap(pool_mgr, node) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    // give back metadata the pool no longer needs
+    _mem_shrink_meta(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+// merges a new gap node (not in the gap index) with the gaps around it, if
+// any, and adds the result to the gap index
+static alloc_status _mem_merge_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    // if the next node in the list is also a gap, merge into node-to-delete
+    node_pt next = _mem_node(pool_mgr, node->next);
+    if (next != NULL && next->allocated == 0) {
+        //   remove the next node from gap index
+        //   check success
+        if (_mem_remove_from_gap_ix(pool_mgr, next->size, next) != ALLOC_OK)
+            return ALLOC_FAIL;
+
+        //   add the size to the node-to-delete
+        node->size += next->size;
+
+        //   update node as unused
+        _mem_set_used(pool_mgr, next, 0);
+
+        //   update metadata (used nodes)
+        pool_mgr->used_nodes--;
+
+        //   update linked list
+        node->next = next->next;
+        if (next->next != MEM_NIL)
+            _mem_node(pool_mgr, next->next)->prev = _mem_node_ix(pool_mgr, node);
+        next->next = MEM_NIL;
+        next->prev = MEM_NIL;
+    }
+
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    node_pt prev = _mem_node(pool_mgr, node->prev);
+    if (prev != NULL && prev->allocated == 0) {
+        //   remove the previous node from gap index
+        //   check success
+        if (_mem_remove_from_gap_ix(pool_mgr, prev->size, prev) != ALLOC_OK)
+            return ALLOC_FAIL;
+
+        //   add the size of node-to-delete to the previous
+        prev->size += node->size;
+
+        //   update node-to-delete as unused
+        _mem_set_used(pool_mgr, node, 0);
+
+        //   update metadata (used_nodes)
+        pool_mgr->used_nodes--;
+
+        //   update linked list
+        prev->next = node->next;
+        if (node->next != MEM_NIL)
+            _mem_node(pool_mgr, node->next)->prev = node->prev;
+        node->next = MEM_NIL;
+        node->prev = MEM_NIL;
+
+        //   change the node to add to the previous node!
+        node = prev;
+    }
+
+    // add the resulting node to the gap index
+    // check success
+    if (_mem_add_to_gap_ix(pool_mgr, node->size, node) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    return ALLOC_OK;
+}
+
+static pool_pt _mem_pool_open_fd(mem_ctx_pt ctx,
+                                 int fd,
+                                 size_t size,
+                                 alloc_policy policy,
+                                 int shared) {
+    // note: takes ownership of fd, which is closed on error
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // an empty file is a new pool, anything else has to be one of ours
+    pool_hdr_t hdr;
+    int is_new = (st.st_size == 0);
+    if (is_new) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+        if (size == 0 || size > MEM_POOL_MAX_SIZE) {
+            close(fd);
+            return NULL;
+        }
+
+        //   file layout: header page, pool memory, node heap, gap index
+        memset(&hdr, 0, sizeof(pool_hdr_t));
+        memcpy(hdr.magic, MEM_POOL_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = MEM_POOL_FILE_VERSION;
+        hdr.policy = policy;
+        hdr.total_size = size;
+        hdr.total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+        hdr.gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+        hdr.mem_off = page;
+        hdr.meta_off = page + (size + page - 1) / page * page;
+
+        if (ftruncate(fd, hdr.meta_off
+                          + hdr.total_nodes * sizeof(node_t)
+                          + hdr.gap_ix_capacity * sizeof(gap_t)) != 0) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        if (pread(fd, &hdr, sizeof(pool_hdr_t), 0) != sizeof(pool_hdr_t)
+            || memcmp(hdr.magic, MEM_POOL_FILE_MAGIC, sizeof(hdr.magic)) != 0
+            || hdr.version != MEM_POOL_FILE_VERSION
+            || (size != 0 && size != hdr.total_size)
+            || policy != hdr.policy
+            || hdr.total_size > MEM_POOL_MAX_SIZE
+            || hdr.total_nodes > _mem_chunk_first(MEM_NODE_HEAP_NUM_CHUNKS)) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    // allocate a new mem pool mgr
+    pool_mgr_pt pool_mgr = malloc(sizeof(pool_mgr_t));
+    if (pool_mgr == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    // map the header and pool memory, at the old address if it is still free
+    void *hint = hdr.mem_addr ? (void *) (hdr.mem_addr - hdr.mem_off) : NULL;
+    void *data = mmap(hint, hdr.meta_off, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        free(pool_mgr);
+        close(fd);
+        return NULL;
+    }
+
+    // map the metadata separately, so that it can grow without moving the pool
+    size_t meta_len = hdr.total_nodes * sizeof(node_t) + hdr.gap_ix_capacity * sizeof(gap_t);
+    void *meta = mmap(NULL, meta_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t) hdr.meta_off);
+    if (meta == MAP_FAILED) {
+        munmap(data, hdr.meta_off);
+        free(pool_mgr);
+        close(fd);
+        return NULL;
+    }
+
+    memset(pool_mgr->chunks, 0, sizeof(pool_mgr->chunks));
+    pool_mgr->soa = 0;
+    pool_mgr->tagged = 0;
+    pool_mgr->in_buffer = 0;
+    pool_mgr->headed = 0;
+    pool_mgr->small = 0;
+    pool_mgr->fill_factor = MEM_FILL_FACTOR;
+    pool_mgr->expand_factor = MEM_EXPAND_FACTOR;
+    pool_mgr->max_segments = 0;
+    pool_mgr->cost = 0;
+    pool_mgr->shrink_wait = 0;
+    pool_mgr->reserved_nodes = 0;
+    pool_mgr->reserved_gaps = 0;
+    pool_mgr->head = 0;
+    pool_mgr->handles = NULL;
+    pool_mgr->handles_size = 0;
+    pool_mgr->handles_capacity = 0;
+    pool_mgr->handles_free = 0;
+    pool_mgr->defrag_next = 0;
+    pool_mgr->ref_gen = 0;
+    pool_mgr->defragging = 0;
+    pool_mgr->hdr = data;
+    pool_mgr->fd = fd;
+    pool_mgr->meta_len = meta_len;
+    pool_mgr->shared = shared;
+    pool_mgr->mt = 0;
+    pool_mgr->cached = 0;
+    pool_mgr->caches = NULL;
+    pool_mgr->cpu_caches = NULL;
+    pool_mgr->pool.mem = (char *) data + hdr.mem_off;
+    pool_mgr->pool.policy = policy;
+    pool_mgr->pool.total_size = hdr.total_size;
+    pool_mgr->node_heap = meta;
+    pool_mgr->total_nodes = hdr.total_nodes;
+    pool_mgr->gap_ix = (gap_pt) (pool_mgr->node_heap + hdr.total_nodes);
+    pool_mgr->gap_ix_capacity = hdr.gap_ix_capacity;
+    _mem_map_chunks(pool_mgr);
+
+    if (is_new) {
+        pthread_mutexattr_t attr;
+
+        *pool_mgr->hdr = hdr;
+        pool_mgr->hdr->mem_addr = (uintptr_t) pool_mgr->pool.mem;
+
+        //   processes sharing the pool lock it, and survive a holder dying
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&pool_mgr->hdr->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        _mem_init_top_node(pool_mgr);
+        _mem_sync_hdr(pool_mgr);
+    } else if (!shared) {
+        _mem_sync_mgr(pool_mgr);
+
+        // the metadata is offset-based, only the cached addresses can go stale
+        if ((uintptr_t) pool_mgr->pool.mem != hdr.mem_addr) {
+            for (unsigned i = 0; i < pool_mgr->total_nodes; i++) {
+                if (_mem_node(pool_mgr, i)->used)
+                    _mem_place_record(pool_mgr, _mem_node(pool_mgr, i));
+            }
+            pool_mgr->hdr->mem_addr = (uintptr_t) pool_mgr->pool.mem;
+        }
+    }
+    // note: shared pools pick up the counters under the lock, on every call
+    _mem_soa_build(pool_mgr);
+
+    //   link pool mgr to pool store
+    if (_mem_store_pool(ctx, pool_mgr) != ALLOC_OK) {
+        _mem_free_chunks(pool_mgr);
+        munmap(pool_mgr->node_heap, pool_mgr->meta_len);
+        munmap(pool_mgr->hdr, pool_mgr->hdr->meta_off);
+        close(fd);
+        free(pool_mgr);
+        return NULL;
+    }
+
+    // return the address of the mgr, cast to (pool_pt)
+    return (pool_pt) pool_mgr;
+}
+
+static void _mem_init_top_node(pool_mgr_pt pool_mgr) {
+    //   initialize top node of node heap
+    node_pt top = _mem_node(pool_mgr, 0);
+    top->size = pool_mgr->pool.total_size;
+    top->offset = 0;
+    _mem_place_record(pool_mgr, top);
+    _mem_set_used(pool_mgr, top, 1);
+    top->allocated = 0;
+    top->next = MEM_NIL;
+    top->prev = MEM_NIL;
+    pool_mgr->head = 0;
+    pool_mgr->used_nodes = 1;
+    pool_mgr->pool.num_gaps = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+
+    //   initialize top node of gap index
+    _mem_add_to_gap_ix(pool_mgr, pool_mgr->pool.total_size, top);
+}
+
+static void _mem_sync_hdr(pool_mgr_pt pool_mgr) {
+    pool_hdr_pt hdr = pool_mgr->hdr;
+
+    // only mapped pools have a header to keep up to date
+    if (hdr == NULL)
+        return;
+
+    hdr->policy = pool_mgr->pool.policy;
+    hdr->alloc_size = pool_mgr->pool.alloc_size;
+    hdr->num_allocs = pool_mgr->pool.num_allocs;
+    hdr->num_gaps = pool_mgr->pool.num_gaps;
+    hdr->total_nodes = pool_mgr->total_nodes;
+    hdr->used_nodes = pool_mgr->used_nodes;
+    hdr->gap_ix_capacity = pool_mgr->gap_ix_capacity;
+}
+
+static alloc_status _mem_sync_mgr(pool_mgr_pt pool_mgr) {
+    pool_hdr_pt hdr = pool_mgr->hdr;
+
+    // only mapped pools have a header to pick up from
+    if (hdr == NULL)
+        return ALLOC_OK;
+
+    // another process may have grown the metadata, follow it
+    if (hdr->total_nodes != pool_mgr->total_nodes
+        || hdr->gap_ix_capacity != pool_mgr->gap_ix_capacity) {
+        size_t meta_len = hdr->total_nodes * sizeof(node_t) + hdr->gap_ix_capacity * sizeof(gap_t);
+        void *meta = mremap(pool_mgr->node_heap, pool_mgr->meta_len, meta_len, MREMAP_MAYMOVE);
+        if (meta == MAP_FAILED)
+            return ALLOC_FAIL;
+
+        pool_mgr->node_heap = meta;
+        pool_mgr->total_nodes = hdr->total_nodes;
+        pool_mgr->gap_ix = (gap_pt) (pool_mgr->node_heap + hdr->total_nodes);
+        pool_mgr->gap_ix_capacity = hdr->gap_ix_capacity;
+        pool_mgr->meta_len = meta_len;
+        _mem_map_chunks(pool_mgr);
+    }
+
+    pool_mgr->pool.alloc_size = hdr->alloc_size;
+    pool_mgr->pool.num_allocs = hdr->num_allocs;
+    pool_mgr->pool.num_gaps = hdr->num_gaps;
+    pool_mgr->used_nodes = hdr->used_nodes;
+
+    return ALLOC_OK;
+}
+
+static alloc_status _mem_lock(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->mt) {
+        if (pthread_mutex_lock(&pool_mgr->lock) != 0)
+            return ALLOC_FAIL;
+        // whoever takes the lock deletes what other threads left
+        _mem_drain_remote(pool_mgr);
+        return ALLOC_OK;
+    }
+
+    // otherwise, only shared pools need locking
+    if (!pool_mgr->shared)
+        return ALLOC_OK;
+
+    int ret = pthread_mutex_lock(&pool_mgr->hdr->lock);
+    if (ret != 0 && ret != EOWNERDEAD)
+        return ALLOC_FAIL;
+
+    if (_mem_sync_mgr(pool_mgr) != ALLOC_OK) {
+        // note: a dead owner's state stays inconsistent for the next taker
+        pthread_mutex_unlock(&pool_mgr->hdr->lock);
+        return ALLOC_FAIL;
+    }
+
+    // the previous holder died mid-operation, clean up after it
+    if (ret == EOWNERDEAD) {
+        _mem_repair(pool_mgr);
+        _mem_sync_hdr(pool_mgr);
+        pthread_mutex_consistent(&pool_mgr->hdr->lock);
+    }
+
+    return ALLOC_OK;
+}
+
+static void _mem_unlock(pool_mgr_pt pool_mgr) {
+    if (pool_mgr->mt)
+        pthread_mutex_unlock(&pool_mgr->lock);
+    else if (pool_mgr->shared)
+        pthread_mutex_unlock(&pool_mgr->hdr->lock);
+}
+
+// makes a pool thread-safe, see mem_pool_open_mt
+static void _mem_init_mt(pool_mgr_pt pool_mgr) {
+    pthread_mutexattr_t attr;
+
+    // critical sections are short, so spin a little before sleeping
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(&pool_mgr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pool_mgr->mt = 1;
+    pool_mgr->owner = pthread_self();
+    atomic_init(&pool_mgr->remote_frees, NULL);
+}
+
+// rebuilds the metadata from the segment list after an interrupted operation
+// note: the list starting at node 0 is authoritative, every operation keeps
+// it walkable at all times, at worst with a hole, an overlap or two adjacent
+// gaps, and the counters and the gap index are derived from it
+static void _mem_repair(pool_mgr_pt pool_mgr) {
+    // only nodes reachable from the top node are in use
+    for (unsigned i = 1; i < pool_mgr->total_nodes; i++)
+        _mem_node(pool_mgr, i)->used = 0;
+    for (node_pt node = _mem_node(pool_mgr, 0); node != NULL; node = _mem_node(pool_mgr, node->next))
+        node->used = 1;
+    _mem_node(pool_mgr, 0)->prev = MEM_NIL;
+
+    // fix up each segment against its successor
+    for (node_pt node = _mem_node(pool_mgr, 0); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+        node_pt next = _mem_node(pool_mgr, node->next);
+        size_t end = (next != NULL) ? next->offset : pool_mgr->pool.total_size;
+
+        //   a gap absorbing its successor: the successor is gone
+        //   adjacent gaps: merge them
+        if (next != NULL && node->allocated == 0 && next->allocated == 0) {
+            size_t next_end = next->offset + next->size;
+            if (node->offset + node->size > next_end)
+                next_end = node->offset + node->size;
+            node->size = next_end - node->offset;
+            node->next = next->next;
+            next->used = 0;
+            next = _mem_node(pool_mgr, node->next);
+            end = (next != NULL) ? next->offset : pool_mgr->pool.total_size;
+        }
+
+        //   an overlap: the segment ends where its successor starts
+        if (node->offset + node->size > end)
+            node->size = end - node->offset;
+
+        //   a hole: grow a gap over it, or put a new gap in it
+        if (node->offset + node->size < end) {
+            if (node->allocated == 0) {
+                node->size = end - node->offset;
+            } else {
+                node_pt hole = NULL;
+                for (unsigned i = 0; i < pool_mgr->total_nodes && hole == NULL; i++) {
+                    if (_mem_node(pool_mgr, i)->used == 0)
+                        hole = _mem_node(pool_mgr, i);
+                }
+                if (hole != NULL) {
+                    hole->used = 1;
+                    hole->allocated = 0;
+                    hole->offset = node->offset + node->size;
+                    hole->size = end - hole->offset;
+                    _mem_place_record(pool_mgr, hole);
+                    hole->next = node->next;
+                    node->next = _mem_node_ix(pool_mgr, hole);
+                }
+            }
+        }
+
+        next = _mem_node(pool_mgr, node->next);
+        if (next != NULL)
+            next->prev = _mem_node_ix(pool_mgr, node);
+    }
+
+    // the hole filling may have left adjacent gaps, so go once more
+    for (node_pt node = _mem_node(pool_mgr, 0); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+        node_pt next = _mem_node(pool_mgr, node->next);
+        while (next != NULL && node->allocated == 0 && next->allocated == 0) {
+            node->size += next->size;
+            node->next = next->next;
+            next->used = 0;
+            next = _mem_node(pool_mgr, node->next);
+            if (next != NULL)
+                next->prev = _mem_node_ix(pool_mgr, node);
+        }
+    }
+
+    // recount and rebuild the gap index
+    pool_mgr->used_nodes = 0;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_gaps = 0;
+    memset(pool_mgr->gap_ix, 0, sizeof(gap_t) * pool_mgr->gap_ix_capacity);
+    for (node_pt node = _mem_node(pool_mgr, 0); node != NULL; node = _mem_node(pool_mgr, node->next)) {
+        pool_mgr->used_nodes++;
+        if (node->allocated) {
+            pool_mgr->pool.num_allocs++;
+            pool_mgr->pool.alloc_size += node->size;
+        } else {
+            _mem_add_to_gap_ix(pool_mgr, node->size, node);
+        }
+    }
+    _mem_soa_build(pool_mgr);
+}
+
+// node at a node heap index, or NULL for MEM_NIL
+static node_pt _mem_node(pool_mgr_pt pool_mgr, unsigned ix) {
+    if (ix == MEM_NIL)
+        return NULL;
+
+    unsigned c = _mem_chunk_of(ix);
+    return &pool_mgr->chunks[c].nodes[ix - _mem_chunk_first(c)];
+}
+
+// node heap index of a node, by the chunk it is in
+// note: the last chunks hold most of the nodes, so look there first
+static unsigned _mem_node_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    if (node == NULL)
+        return MEM_NIL;
+
+    uintptr_t addr = (uintptr_t) node;
+    for (unsigned c = pool_mgr->num_chunks; c-- > 0; ) {
+        uintptr_t base = (uintptr_t) pool_mgr->chunks[c].nodes;
+        if (addr >= base && addr < base + sizeof(node_t) * (MEM_NODE_HEAP_INIT_CAPACITY << c))
+            return _mem_chunk_first(c) + (unsigned) ((addr - base) / sizeof(node_t));
+    }
+
+    return MEM_NIL;
+}
+
+// chunk of a node heap index
+// note: chunk c holds the INIT_CAPACITY << c nodes from INIT_CAPACITY * (2^c - 1),
+// as in the pool store, so the node heap grows a chunk at a time, and the
+// nodes already in it never move
+static unsigned _mem_chunk_of(unsigned ix) {
+    return 31 - __builtin_clz(ix / MEM_NODE_HEAP_INIT_CAPACITY + 1);
+}
+
+// node heap index of the first node of a chunk
+static unsigned _mem_chunk_first(unsigned c) {
+    return MEM_NODE_HEAP_INIT_CAPACITY * ((1u << c) - 1);
+}
+
+// nodes of a chunk in the node heap, all of them but in the last chunk of a
+// mapped pool, whose node heap grows by doubling
+static unsigned _mem_chunk_len(pool_mgr_pt pool_mgr, unsigned c) {
+    unsigned len = MEM_NODE_HEAP_INIT_CAPACITY << c;
+    unsigned left = pool_mgr->total_nodes - _mem_chunk_first(c);
+
+    return (left < len) ? left : len;
+}
+
+// grows the node heap of a pool that isn't mapped by a chunk of unused nodes
+static alloc_status _mem_add_chunk(pool_mgr_pt pool_mgr) {
+    unsigned c = pool_mgr->num_chunks;
+    if (c >= MEM_NODE_HEAP_NUM_CHUNKS)
+        return ALLOC_FAIL;
+
+    // the first chunk of a pool in one mapping is in its head
+    node_pt nodes;
+    if (c == 0 && pool_mgr->headed) {
+        nodes = ((pool_head_pt) pool_mgr)->nodes;
+        memset(nodes, 0, sizeof(((pool_head_pt) pool_mgr)->nodes));
+    } else {
+        nodes = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, sizeof(node_t));
+        if (nodes == NULL)
+            return ALLOC_FAIL;
+    }
+
+    // a pool with refs keeps the generations of every chunk
+    unsigned *gens = NULL;
+    if (pool_mgr->ref_gen != 0) {
+        gens = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, sizeof(unsigned));
+        if (gens == NULL) {
+            if (!(c == 0 && pool_mgr->headed))
+                free(nodes);
+            return ALLOC_FAIL;
+        }
+    }
+
+    unsigned total_nodes = pool_mgr->total_nodes;
+    pool_mgr->chunks[c].nodes = nodes;
+    pool_mgr->chunks[c].gens = gens;
+    pool_mgr->num_chunks++;
+    pool_mgr->total_nodes += MEM_NODE_HEAP_INIT_CAPACITY << c;
+    _mem_soa_grow(pool_mgr, total_nodes);
+
+    return ALLOC_OK;
+}
+
+// points the chunks of a mapped pool at their slices of the node heap
+// note: again after every remapping
+static void _mem_map_chunks(pool_mgr_pt pool_mgr) {
+    unsigned c = 0;
+
+    for (; c < MEM_NODE_HEAP_NUM_CHUNKS && _mem_chunk_first(c) < pool_mgr->total_nodes; c++)
+        pool_mgr->chunks[c].nodes = pool_mgr->node_heap + _mem_chunk_first(c);
+    pool_mgr->num_chunks = c;
+}
+
+// frees the chunks, but for the nodes of mapped pools, which are in the mapping
+static void _mem_free_chunks(pool_mgr_pt pool_mgr) {
+    _mem_soa_free(pool_mgr);
+    for (unsigned c = 0; c < MEM_NODE_HEAP_NUM_CHUNKS; c++) {
+        if (pool_mgr->node_heap == NULL)
+            _mem_meta_free(pool_mgr, pool_mgr->chunks[c].nodes);
+        free(pool_mgr->chunks[c].records);
+        free(pool_mgr->chunks[c].gens);
+        pool_mgr->chunks[c].nodes = NULL;
+        pool_mgr->chunks[c].records = NULL;
+        pool_mgr->chunks[c].gens = NULL;
+    }
+    pool_mgr->num_chunks = 0;
+}
+
+// whether metadata is in the head of the pool's mapping (see pool_head_t)
+static int _mem_in_head(pool_mgr_pt pool_mgr, const void *meta) {
+    return pool_mgr->headed
+           && (const char *) meta >= (const char *) pool_mgr
+           && (const char *) meta < (const char *) pool_mgr + sizeof(pool_head_t);
+}
+
+// frees metadata, unless it is in the head of the pool's mapping
+static void _mem_meta_free(pool_mgr_pt pool_mgr, void *meta) {
+    if (!_mem_in_head(pool_mgr, meta))
+        free(meta);
+}
+
+// reallocs metadata, moving it out of the head of the pool's mapping
+static void *_mem_meta_realloc(pool_mgr_pt pool_mgr, void *meta, size_t len, size_t new_len) {
+    if (!_mem_in_head(pool_mgr, meta))
+        return realloc(meta, new_len);
+
+    void *moved = malloc(new_len);
+    if (moved != NULL)
+        memcpy(moved, meta, (len < new_len) ? len : new_len);
+    return moved;
+}
+
+// record of the allocation at offset into pool->mem that node ix (or, in
+// inline pools, the block) holds, or NULL if it doesn't
+static alloc_pt _mem_alloc_of(pool_mgr_pt pool_mgr, unsigned ix, size_t offset) {
+    if (pool_mgr->tagged) {
+        tag_hdr_pt block = (offset < MEM_TAG_PAYLOAD) ? NULL
+                                                      : _mem_tag_allocated(pool_mgr, offset - MEM_TAG_PAYLOAD);
+        return (block != NULL) ? &block->alloc_record : NULL;
+    }
+
+    if (ix >= pool_mgr->total_nodes)
+        return NULL;
+    node_pt node = _mem_node(pool_mgr, ix);
+    if (!node->used || !node->allocated || node->offset != offset
+        || _mem_reserve_records(pool_mgr) != ALLOC_OK)
+        return NULL;
+
+    return _mem_record(pool_mgr, node);
+}
+
+// node of an allocation record handed out by the pool, or NULL if it is not
+// a record
+static node_pt _mem_alloc_node(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+#ifndef MEM_COMPACT_NODES
+    const size_t stride = sizeof(node_t);
+#else
+    const size_t stride = sizeof(alloc_t);
+#endif
+    uintptr_t addr = (uintptr_t) alloc;
+
+    for (unsigned c = pool_mgr->num_chunks; c-- > 0; ) {
+#ifndef MEM_COMPACT_NODES
+        uintptr_t base = (uintptr_t) pool_mgr->chunks[c].nodes;
+#else
+        uintptr_t base = (uintptr_t) pool_mgr->chunks[c].records;
+#endif
+        if (base != 0 && addr >= base && addr < base + stride * _mem_chunk_len(pool_mgr, c)
+            && (addr - base) % stride == 0)
+            return &pool_mgr->chunks[c].nodes[(addr - base) / stride];
+    }
+
+    return NULL;
+}
+
+// allocation record of an allocated node, to hand out
+// note: compact nodes have their records filled in here, in the process and
+// at the address the record is handed out in
+static alloc_pt _mem_record(pool_mgr_pt pool_mgr, node_pt node) {
+#ifndef MEM_COMPACT_NODES
+    (void) pool_mgr;
+    return &node->alloc_record;
+#else
+    unsigned ix = _mem_node_ix(pool_mgr, node);
+    unsigned c = _mem_chunk_of(ix);
+    alloc_pt alloc = &pool_mgr->chunks[c].records[ix - _mem_chunk_first(c)];
+    char *mem = pool_mgr->pool.mem + node->offset;
+
+    // a record handed out again is left alone, other threads may be reading
+    // it, and so is one that's claimed (see mem_pending_free)
+    if ((alloc->mem != mem && alloc->mem != &mem_pending_free && alloc->mem != &mem_cached_block)
+        || alloc->size != node->size) {
+        alloc->size = node->size;
+        alloc->mem = mem;
+    }
+
+    return alloc;
+#endif
+}
+
+// whether the record of an allocated node is claimed (see mem_pending_free)
+static int _mem_claimed(pool_mgr_pt pool_mgr, unsigned ix) {
+#ifndef MEM_COMPACT_NODES
+    alloc_pt alloc = &_mem_node(pool_mgr, ix)->alloc_record;
+#else
+    unsigned c = _mem_chunk_of(ix);
+    if (pool_mgr->chunks[c].records == NULL)
+        return 0;
+    alloc_pt alloc = &pool_mgr->chunks[c].records[ix - _mem_chunk_first(c)];
+#endif
+    char *mem = atomic_load_explicit((_Atomic(char *) *) &alloc->mem, memory_order_relaxed);
+
+    return mem == &mem_pending_free || mem == &mem_cached_block;
+}
+
+// points the allocation record in a node at its segment
+// note: compact nodes have none, their records are filled in when handed out
+static void _mem_place_record(pool_mgr_pt pool_mgr, node_pt node) {
+#ifndef MEM_COMPACT_NODES
+    node->alloc_record.mem = pool_mgr->pool.mem + node->offset;
+#else
+    (void) pool_mgr;
+    (void) node;
+#endif
+}
+
+// makes room for a record for every node in the node heap (compact nodes),
+// allocating the records of the chunks that have none yet, in order
+static alloc_status _mem_reserve_records(pool_mgr_pt pool_mgr) {
+#ifdef MEM_COMPACT_NODES
+    unsigned c = pool_mgr->num_chunks;
+    while (c > 0 && pool_mgr->chunks[c - 1].records == NULL)
+        c--;
+
+    for (; c < pool_mgr->num_chunks; c++) {
+        pool_mgr->chunks[c].records = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, sizeof(alloc_t));
+        if (pool_mgr->chunks[c].records == NULL)
+            return ALLOC_FAIL;
+    }
+#else
+    (void) pool_mgr;
+#endif
+
+    return ALLOC_OK;
+}
+
+// marks a node used or unused, in the node and in the SoA view
+static void _mem_set_used(pool_mgr_pt pool_mgr, node_pt node, unsigned used) {
+    node->used = used;
+    if (pool_mgr->soa) {
+        unsigned ix = _mem_node_ix(pool_mgr, node);
+        unsigned c = _mem_chunk_of(ix);
+        pool_mgr->chunks[c].used[ix - _mem_chunk_first(c)] = used;
+    }
+}
+
+// sets the gap size of a node in the SoA view, 0 for other nodes
+static void _mem_set_gap_size(pool_mgr_pt pool_mgr, unsigned ix, gap_size_t size) {
+    if (pool_mgr->soa) {
+        unsigned c = _mem_chunk_of(ix);
+        pool_mgr->chunks[c].gap_sizes[ix - _mem_chunk_first(c)] = size;
+    }
+}
+
+// (re)builds the SoA view of the node heap: the gap sizes and the used
+// flags of each chunk in arrays of their own, for the searches in
+// _mem_new_alloc to scan
+// note: an accelerator only, without it (out of memory, or a shared pool,
+// whose node heap other processes change) the searches walk the node heap
+static void _mem_soa_build(pool_mgr_pt pool_mgr) {
+    _mem_soa_free(pool_mgr);
+    if (pool_mgr->shared)
+        return;
+
+    pool_mgr->soa = 1;
+    _mem_soa_grow(pool_mgr, 0);
+    for (unsigned c = 0; pool_mgr->soa && c < pool_mgr->num_chunks; c++) {
+        node_chunk_pt chunk = &pool_mgr->chunks[c];
+        for (unsigned i = 0; i < _mem_chunk_len(pool_mgr, c); i++) {
+            node_pt node = &chunk->nodes[i];
+            chunk->gap_sizes[i] = (node->used && !node->allocated) ? node->size : 0;
+            chunk->used[i] = node->used;
+        }
+    }
+}
+
+// extends the SoA view over the new nodes of a grown node heap, from node
+// heap index from on
+// note: new nodes are unused, which is zeroes in both arrays, so the arrays
+// start out zeroed and the nodes are left alone
+static void _mem_soa_grow(pool_mgr_pt pool_mgr, unsigned from) {
+    if (!pool_mgr->soa || from >= pool_mgr->total_nodes)
+        return;
+
+    for (unsigned c = _mem_chunk_of(from); c < pool_mgr->num_chunks; c++) {
+        node_chunk_pt chunk = &pool_mgr->chunks[c];
+        if (chunk->gap_sizes != NULL)
+            continue;
+
+        // the first chunk of a pool in one mapping has its arrays in the head
+        if (c == 0 && pool_mgr->headed) {
+            pool_head_pt head = (pool_head_pt) pool_mgr;
+            memset(head->gap_sizes, 0, sizeof(head->gap_sizes));
+            memset(head->used, 0, sizeof(head->used));
+            chunk->gap_sizes = head->gap_sizes;
+            chunk->used = head->used;
+            continue;
+        }
+
+        chunk->gap_sizes = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, sizeof(gap_size_t));
+        chunk->used = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, 1);
+        if (chunk->gap_sizes == NULL || chunk->used == NULL) {
+            _mem_soa_free(pool_mgr);
+            return;
+        }
+    }
+}
+
+static void _mem_soa_free(pool_mgr_pt pool_mgr) {
+    for (unsigned c = 0; c < MEM_NODE_HEAP_NUM_CHUNKS; c++) {
+        _mem_meta_free(pool_mgr, pool_mgr->chunks[c].gap_sizes);
+        _mem_meta_free(pool_mgr, pool_mgr->chunks[c].used);
+        pool_mgr->chunks[c].gap_sizes = NULL;
+        pool_mgr->chunks[c].used = NULL;
+    }
+    pool_mgr->soa = 0;
+}
+
+// index of the first gap size of at least size, or n if there is none
+static unsigned _mem_fit_scan(const gap_size_t *sizes, unsigned n, size_t size) {
+    // other nodes are 0 in sizes, so even size 0 needs a gap of at least 1
+    // note: no gap is larger than a signed size, which the AVX2 compares need
+    if (size > MEM_POOL_MAX_SIZE || size > (size_t) LLONG_MAX)
+        return n;
+    gap_size_t min = (size == 0) ? 1 : size;
+
+#ifdef MEM_SIMD
+    if (__builtin_cpu_supports("avx512f"))
+        return _mem_fit_scan_avx512(sizes, n, min);
+    if (__builtin_cpu_supports("avx2"))
+        return _mem_fit_scan_avx2(sizes, n, min);
+#endif
+    return _mem_fit_scan_scalar(sizes, n, min);
+}
+
+static unsigned _mem_fit_scan_scalar(const gap_size_t *sizes, unsigned n, gap_size_t min) {
+    unsigned i = 0;
+    while (i < n && sizes[i] < min)
+        i++;
+    return i;
+}
+
+#ifdef MEM_SIMD
+// 4 (8 compact) sizes per compare
+// note: AVX2 compares signed, min stays below 2^63 (2^31 for compact nodes),
+// see _mem_fit_scan
+__attribute__((target("avx2")))
+static unsigned _mem_fit_scan_avx2(const gap_size_t *sizes, unsigned n, gap_size_t min) {
+    unsigned i = 0;
+#ifndef MEM_COMPACT_NODES
+    __m256i below = _mm256_set1_epi64x((long long) (min - 1));
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (sizes + i));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, below)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    __m256i below = _mm256_set1_epi32((int) (min - 1));
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (sizes + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, below)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    return i + _mem_fit_scan_scalar(sizes + i, n - i, min);
+}
+
+// 8 (16 compact) sizes per compare
+__attribute__((target("avx512f")))
+static unsigned _mem_fit_scan_avx512(const gap_size_t *sizes, unsigned n, gap_size_t min) {
+    unsigned i = 0;
+#ifndef MEM_COMPACT_NODES
+    __m512i least = _mm512_set1_epi64((long long) min);
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_loadu_si512((const void *) (sizes + i));
+        __mmask8 mask = _mm512_cmpge_epu64_mask(v, least);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    __m512i least = _mm512_set1_epi32((int) min);
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_loadu_si512((const void *) (sizes + i));
+        __mmask16 mask = _mm512_cmpge_epu32_mask(v, least);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    return i + _mem_fit_scan_scalar(sizes + i, n - i, min);
+}
+#endif
+
+static alloc_status _mem_reserve(pool_mgr_pt pool_mgr,
+                                 unsigned num_nodes,
+                                 unsigned num_gaps) {
+    // note: grown in size_t, and capped at what the node heap and the gap
+    // index can hold, so that the growth can't wrap around
+    const size_t max_nodes = _mem_chunk_first(MEM_NODE_HEAP_NUM_CHUNKS);
+    size_t total_nodes = pool_mgr->total_nodes;
+    size_t gap_ix_capacity = pool_mgr->gap_ix_capacity;
+
+    // grow the same way one allocation at a time would, but all at once
+    while (((float) num_gaps / gap_ix_capacity) > pool_mgr->fill_factor) {
+        if (gap_ix_capacity >= UINT_MAX)
+            return ALLOC_FAIL;
+        gap_ix_capacity *= pool_mgr->expand_factor;
+        if (gap_ix_capacity > UINT_MAX)
+            gap_ix_capacity = UINT_MAX;
+    }
+
+    // mapped pools grow their metadata mapping instead
+    if (pool_mgr->hdr != NULL) {
+        while (((float) num_nodes / total_nodes) > pool_mgr->fill_factor) {
+            if (total_nodes >= max_nodes)
+                return ALLOC_FAIL;
+            total_nodes *= pool_mgr->expand_factor;
+            if (total_nodes > max_nodes)
+                total_nodes = max_nodes;
+        }
+        if (total_nodes == pool_mgr->total_nodes && gap_ix_capacity == pool_mgr->gap_ix_capacity)
+            return ALLOC_OK;
+        return _mem_resize_meta_map(pool_mgr, (unsigned) total_nodes, (unsigned) gap_ix_capacity);
+    }
+
+    while (((float) num_nodes / pool_mgr->total_nodes) > pool_mgr->fill_factor) {
+        if (_mem_add_chunk(pool_mgr) != ALLOC_OK)
+            return ALLOC_FAIL;
+    }
+
+    if (gap_ix_capacity != pool_mgr->gap_ix_capacity) {
+        gap_pt updated_ix = _mem_meta_realloc(pool_mgr, pool_mgr->gap_ix,
+                                              sizeof(gap_t) * pool_mgr->gap_ix_capacity,
+                                              sizeof(gap_t) * gap_ix_capacity);
+        if (updated_ix == NULL)
+            return ALLOC_FAIL;
+        memset(updated_ix + pool_mgr->gap_ix_capacity, 0,
+               sizeof(gap_t) * (gap_ix_capacity - pool_mgr->gap_ix_capacity));
+        pool_mgr->gap_ix = updated_ix;
+        pool_mgr->gap_ix_capacity = (unsigned) gap_ix_capacity;
+    }
+
+    return ALLOC_OK;
+}
+
+// mem_pool_compact, with the pool locked, around the allocations at the
+// given offsets (sorted), which stay put
+// note: the allocations keep their nodes, which hold (or index) the records
+// handed out, so the list is relinked around them, and the first segment may
+// no longer be node 0 (see head)
+static void _mem_compact(pool_mgr_pt pool_mgr,
+                         mem_relocate_fn relocate,
+                         void *ctx,
+                         const size_t *pinned,
+                         unsigned num_pinned) {
+    size_t offset = 0;
+    unsigned last = MEM_NIL;   // the last segment so far
+    unsigned spare = MEM_NIL;  // gap nodes passed, linked by next, to reuse
+    unsigned p = 0;
+
+    // empty the gap index, the gaps are made anew
+    for (unsigned g = 0; g < pool_mgr->pool.num_gaps; g++) {
+        pool_mgr->gap_ix[g].size = 0;
+        pool_mgr->gap_ix[g].node = MEM_NIL;
+    }
+    pool_mgr->pool.num_gaps = 0;
+
+    for (unsigned ix = pool_mgr->head; ix != MEM_NIL; ) {
+        node_pt node = _mem_node(pool_mgr, ix);
+        unsigned next = node->next;
+
+        if (!node->allocated) {
+            _mem_set_gap_size(pool_mgr, ix, 0);
+            node->next = spare;
+            spare = ix;
+            ix = next;
+            continue;
+        }
+
+        while (p < num_pinned && pinned[p] < node->offset)
+            p++;
+
+        if (p < num_pinned && pinned[p] == node->offset) {
+            //   a pinned allocation stays, with the memory before it in a gap
+            //   (of a gap node passed since the last one stayed)
+            if (node->offset > offset) {
+                unsigned gap_ix = spare;
+                spare = _mem_node(pool_mgr, gap_ix)->next;
+                _mem_place_gap(pool_mgr, gap_ix, offset, node->offset - offset, &last);
+                offset = node->offset;
+            }
+        } else if (node->offset != offset) {
+            //   slide the allocation down, in address order, so it never
+            //   overwrites one that is yet to move
+            char *old_mem = pool_mgr->pool.mem + node->offset;
+            memmove(pool_mgr->pool.mem + offset, old_mem, node->size);
+            node->offset = offset;
+            _mem_place_record(pool_mgr, node);
+            (void) _mem_record(pool_mgr, node);
+            if (relocate != NULL)
+                relocate(old_mem, pool_mgr->pool.mem + offset, node->size, ctx);
+        }
+
+        node->prev = last;
+        if (last != MEM_NIL)
+            _mem_node(pool_mgr, last)->next = ix;
+        else
+            pool_mgr->head = ix;
+        last = ix;
+        offset += node->size;
+
+        ix = next;
+    }
+
+    // the rest of the pool is a single gap at the end
+    if (offset < pool_mgr->pool.total_size) {
+        unsigned gap_ix = spare;
+        spare = _mem_node(pool_mgr, gap_ix)->next;
+        _mem_place_gap(pool_mgr, gap_ix, offset, pool_mgr->pool.total_size - offset, &last);
+    }
+    _mem_node(pool_mgr, last)->next = MEM_NIL;
+
+    // the gap nodes left over go unused
+    while (spare != MEM_NIL) {
+        node_pt node = _mem_node(pool_mgr, spare);
+        spare = node->next;
+        _mem_set_used(pool_mgr, node, 0);
+        node->next = MEM_NIL;
+        node->prev = MEM_NIL;
+        pool_mgr->used_nodes--;
+    }
+
+    // and the gap index is down to an entry or a few
+    _mem_shrink_meta(pool_mgr);
+}
+
+// makes a gap node of a node passed in compaction, after the last segment
+static void _mem_place_gap(pool_mgr_pt pool_mgr, unsigned ix, size_t offset, size_t size, unsigned *last) {
+    node_pt node = _mem_node(pool_mgr, ix);
+
+    node->offset = offset;
+    node->size = size;
+    _mem_place_record(pool_mgr, node);
+    node->prev = *last;
+    node->next = MEM_NIL;
+    if (*last != MEM_NIL)
+        _mem_node(pool_mgr, *last)->next = ix;
+    else
+        pool_mgr->head = ix;
+    *last = ix;
+    _mem_add_to_gap_ix(pool_mgr, size, node);
+}
+
+// sorted offsets of the allocations of pinned handles, NULL if there are none
+static size_t *_mem_pinned(pool_mgr_pt pool_mgr, unsigned *num_pinned) {
+    *num_pinned = 0;
+    for (unsigned u = 0; u < pool_mgr->handles_size; u++)
+        *num_pinned += (pool_mgr->handles[u].alloc != NULL && pool_mgr->handles[u].pins > 0);
+    if (*num_pinned == 0)
+        return NULL;
+
+    size_t *pinned = malloc(sizeof(size_t) * *num_pinned);
+    if (pinned == NULL)
+        return NULL;
+
+    unsigned n = 0;
+    for (unsigned u = 0; u < pool_mgr->handles_size; u++)
+        if (pool_mgr->handles[u].alloc != NULL && pool_mgr->handles[u].pins > 0)
+            pinned[n++] = pool_mgr->handles[u].alloc->mem - pool_mgr->pool.mem;
+    qsort(pinned, n, sizeof(size_t), _mem_cmp_offsets);
+
+    return pinned;
+}
+
+static int _mem_cmp_offsets(const void *a, const void *b) {
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+// slot of a live handle, or NULL
+static handle_slot_pt _mem_handle_slot(pool_mgr_pt pool_mgr, mem_handle_t handle) {
+    if (handle == 0 || handle > pool_mgr->handles_size || pool_mgr->handles[handle - 1].alloc == NULL)
+        return NULL;
+
+    return &pool_mgr->handles[handle - 1];
+}
+
+// allocates the generations of every chunk, for the first ref of a pool
+static alloc_status _mem_enable_refs(pool_mgr_pt pool_mgr) {
+    for (unsigned c = 0; c < pool_mgr->num_chunks; c++) {
+        if (pool_mgr->chunks[c].gens != NULL)
+            continue;
+        pool_mgr->chunks[c].gens = calloc(MEM_NODE_HEAP_INIT_CAPACITY << c, sizeof(unsigned));
+        if (pool_mgr->chunks[c].gens == NULL)
+            return ALLOC_FAIL;
+    }
+
+    return ALLOC_OK;
+}
+
+// generation of the ref of the node at a node heap index
+static unsigned *_mem_node_gen(pool_mgr_pt pool_mgr, unsigned ix) {
+    unsigned c = _mem_chunk_of(ix);
+    return &pool_mgr->chunks[c].gens[ix - _mem_chunk_first(c)];
+}
+
+// allocated node of a live ref, or NULL
+// note: the index and the generation in the ref are checked against the
+// node heap directly, so a stale ref costs no more than a live one
+static node_pt _mem_ref_node(pool_mgr_pt pool_mgr, mem_ref_t ref) {
+    unsigned ix = (unsigned) (ref & 0xffffffffu) - 1;
+    unsigned gen = (unsigned) (ref >> 32);
+    if (pool_mgr->ref_gen == 0 || gen == 0 || ix >= pool_mgr->total_nodes
+        || *_mem_node_gen(pool_mgr, ix) != gen)
+        return NULL;
+
+    node_pt node = _mem_node(pool_mgr, ix);
+    if (!node->used || !node->allocated)
+        return NULL;
+
+    return node;
+}
+
+// a gap before an allocation for it to move down into: the smallest of the
+// first few that fit, so that the holes get filled, tightest first
+static node_pt _mem_defrag_target(pool_mgr_pt pool_mgr, node_pt node) {
+    unsigned lo = 0, hi = pool_mgr->pool.num_gaps;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (pool_mgr->gap_ix[mid].size >= node->size)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    for (unsigned g = lo; g < pool_mgr->pool.num_gaps && g < lo + MEM_DEFRAG_TARGETS; g++) {
+        node_pt gap = _mem_node(pool_mgr, pool_mgr->gap_ix[g].node);
+        if (gap->offset < node->offset)
+            return gap;
+    }
+
+    return NULL;
+}
+
+// moves an allocation down into a gap before it, keeping its node, so its
+// record stays valid, and makes a gap of the memory it leaves
+static alloc_status _mem_move_alloc(pool_mgr_pt pool_mgr, node_pt node, node_pt gap) {
+    unsigned node_ix = _mem_node_ix(pool_mgr, node);
+    unsigned gap_ix = _mem_node_ix(pool_mgr, gap);
+    size_t size = node->size;
+    size_t old_offset = node->offset;
+
+    // what's left of the gap and the memory left behind take a node each,
+    // the gap's and another one, unless the gap is used up
+    // note: realtime pools don't take a segment more than they may have
+    if (pool_mgr->max_segments != 0 && gap->size != size
+        && pool_mgr->used_nodes >= pool_mgr->max_segments)
+        return ALLOC_FAIL;
+    if (_mem_resize_node_heap(pool_mgr) != ALLOC_OK
+        || _mem_reserve_records(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
+    node_pt spare = _mem_unused_node(pool_mgr);
+    if (spare == NULL && gap->size != size)
+        return ALLOC_FAIL;
+
+    if (_mem_remove_from_gap_ix(pool_mgr, gap->size, gap) != ALLOC_OK)
+        return ALLOC_FAIL;
+    memmove(pool_mgr->pool.mem + gap->offset, pool_mgr->pool.mem + old_offset, size);
+
+    // take the allocation out of the list, the segment before it (the gap,
+    // possibly) is where the memory left behind goes
+    unsigned pred = node->prev;
+    _mem_node(pool_mgr, pred)->next = node->next;
+    if (node->next != MEM_NIL)
+        _mem_node(pool_mgr, node->next)->prev = pred;
+
+    // and put it in at the start of the gap
+    node->offset = gap->offset;
+    node->prev = gap->prev;
+    node->next = gap_ix;
+    if (gap->prev != MEM_NIL)
+        _mem_node(pool_mgr, gap->prev)->next = node_ix;
+    else
+        pool_mgr->head = node_ix;
+    gap->prev = node_ix;
+    _mem_place_record(pool_mgr, node);
+    (void) _mem_record(pool_mgr, node);
+
+    gap->offset += size;
+    gap->size -= size;
+    node_pt left;
+    if (gap->size == 0) {
+        //   the gap is used up, its node goes to the memory left behind
+        node->next = gap->next;
+        if (gap->next != MEM_NIL)
+            _mem_node(pool_mgr, gap->next)->prev = node_ix;
+        if (pred == gap_ix)
+            pred = node_ix;
+        left = gap;
+    } else {
+        if (_mem_add_to_gap_ix(pool_mgr, gap->size, gap) != ALLOC_OK)
+            return ALLOC_FAIL;
+        left = spare;
+        _mem_set_used(pool_mgr, left, 1);
+        pool_mgr->used_nodes++;
+    }
+
+    // the memory left behind is a gap, merged with the gaps around it
+    unsigned left_ix = _mem_node_ix(pool_mgr, left);
+    node_pt before = _mem_node(pool_mgr, pred);
+    left->allocated = 0;
+    left->offset = old_offset;
+    left->size = size;
+    _mem_place_record(pool_mgr, left);
+    left->prev = pred;
+    left->next = before->next;
+    if (before->next != MEM_NIL)
+        _mem_node(pool_mgr, before->next)->prev = left_ix;
+    before->next = left_ix;
+
+    return _mem_merge_gap(pool_mgr, left);
+}
+
+// the defrag thread of a pool: a slice of steps every period, while the
+// pool is fragmented, releasing the lock between steps
+static void *_mem_defrag_main(void *arg) {
+    pool_mgr_pt pool_mgr = arg;
+
+    pthread_mutex_lock(&pool_mgr->defrag_lock);
+    while (!pool_mgr->defrag_stop) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += pool_mgr->defrag_period_ms / 1000;
+        wake.tv_nsec += (long) (pool_mgr->defrag_period_ms % 1000) * 1000000;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        while (!pool_mgr->defrag_stop
+               && pthread_cond_timedwait(&pool_mgr->defrag_cond, &pool_mgr->defrag_lock, &wake) == 0)
+            ;
+        if (pool_mgr->defrag_stop)
+            break;
+        pthread_mutex_unlock(&pool_mgr->defrag_lock);
+
+        struct timespec start, now;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long elapsed_us = 0;
+        while (elapsed_us < (long) pool_mgr->defrag_slice_us
+               && mem_pool_fragmentation((pool_pt) pool_mgr) > MEM_DEFRAG_THRESHOLD
+               && mem_pool_defrag((pool_pt) pool_mgr, MEM_DEFRAG_STEP) > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed_us = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+        }
+
+        pthread_mutex_lock(&pool_mgr->defrag_lock);
+    }
+    pthread_mutex_unlock(&pool_mgr->defrag_lock);
+
+    return NULL;
+}
+
+// replaces the metadata of an empty pool with the given segments
+static alloc_status _mem_rebuild(pool_mgr_pt pool_mgr,
+                                 const pool_segment_t *segments,
+                                 unsigned num_segments) {
+    unsigned num_gaps = 0;
+    size_t total = 0;
+
+    // the segments have to tile the pool exactly (without the sum wrapping)
+    for (unsigned u = 0; u < num_segments; u++) {
+        if ((segments[u].size == 0 && num_segments > 1)
+            || segments[u].size > pool_mgr->pool.total_size - total)
+            return ALLOC_FAIL;
+        total += segments[u].size;
+        num_gaps += !segments[u].allocated;
+    }
+    if (total != pool_mgr->pool.total_size)
+        return ALLOC_FAIL;
+
+    if (_mem_reserve(pool_mgr, num_segments, num_gaps) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    // the node heap is the segment list, in order
+    for (unsigned c = 0; c < pool_mgr->num_chunks; c++)
+        memset(pool_mgr->chunks[c].nodes, 0, sizeof(node_t) * _mem_chunk_len(pool_mgr, c));
+    memset(pool_mgr->gap_ix, 0, sizeof(gap_t) * pool_mgr->gap_ix_capacity);
+    pool_mgr->head = 0;
+    pool_mgr->used_nodes = num_segments;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+    pool_mgr->pool.num_gaps = 0;
+
+    size_t offset = 0;
+    for (unsigned u = 0; u < num_segments; u++) {
+        node_pt node = _mem_node(pool_mgr, u);
+
+        node->offset = offset;
+        node->size = segments[u].size;
+        _mem_place_record(pool_mgr, node);
+        node->used = 1;
+        node->allocated = segments[u].allocated ? 1 : 0;
+        node->prev = (u > 0) ? u - 1 : MEM_NIL;
+        node->next = (u + 1 < num_segments) ? u + 1 : MEM_NIL;
+        offset += segments[u].size;
+
+        if (node->allocated) {
+            pool_mgr->pool.num_allocs++;
+            pool_mgr->pool.alloc_size += node->size;
+        } else {
+            pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = node->size;
+            pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = u;
+            pool_mgr->pool.num_gaps++;
+        }
+    }
+
+    // sort the gap index once, rather than bubbling up every entry
+    qsort(pool_mgr->gap_ix, pool_mgr->pool.num_gaps, sizeof(gap_t), _mem_gap_cmp);
+    _mem_soa_build(pool_mgr);
+
+    return ALLOC_OK;
+}
+
+// gap index order: by size, then by offset (node heap index, in a rebuilt pool)
+static int _mem_gap_cmp(const void *a, const void *b) {
+    const gap_t *x = a, *y = b;
+
+    if (x->size != y->size)
+        return (x->size < y->size) ? -1 : 1;
+    return (x->node > y->node) - (x->node < y->node);
+}
+
+// header of the block at an offset into the memory of an inline pool
+static tag_hdr_pt _mem_tag_block(pool_mgr_pt pool_mgr, size_t offset) {
+    return (tag_hdr_pt) (pool_mgr->pool.mem + offset);
+}
+
+// writes the tags of a block, at either end
+// note: blocks are multiples of 8 bytes but for the last one, so headers are
+// aligned, and only its footer may not be
+static void _mem_tag_set(pool_mgr_pt pool_mgr, size_t offset, size_t size, unsigned allocated) {
+    size_t tag = size << 1 | allocated;
+
+    _mem_tag_block(pool_mgr, offset)->tag = tag;
+    memcpy(pool_mgr->pool.mem + offset + size - sizeof(size_t), &tag, sizeof(size_t));
+}
+
+// lays an inline pool out as a single free block
+static void _mem_tag_init(pool_mgr_pt pool_mgr) {
+    _mem_tag_set(pool_mgr, 0, pool_mgr->pool.total_size, 0);
+    _mem_tag_block(pool_mgr, 0)->prev_free = MEM_TAG_NIL;
+    _mem_tag_block(pool_mgr, 0)->next_free = MEM_TAG_NIL;
+    pool_mgr->free_head = 0;
+
+    // a node per block, as far as the counters go
+    pool_mgr->used_nodes = 1;
+    pool_mgr->pool.num_gaps = 1;
+    pool_mgr->pool.num_allocs = 0;
+    pool_mgr->pool.alloc_size = 0;
+}
+
+// links a free block into the free list after prev (MEM_TAG_NIL: first)
+static void _mem_tag_link(pool_mgr_pt pool_mgr, size_t offset, size_t prev) {
+    tag_hdr_pt block = _mem_tag_block(pool_mgr, offset);
+
+    block->prev_free = prev;
+    if (prev == MEM_TAG_NIL) {
+        block->next_free = pool_mgr->free_head;
+        pool_mgr->free_head = offset;
+    } else {
+        block->next_free = _mem_tag_block(pool_mgr, prev)->next_free;
+        _mem_tag_block(pool_mgr, prev)->next_free = offset;
+    }
+    if (block->next_free != MEM_TAG_NIL)
+        _mem_tag_block(pool_mgr, block->next_free)->prev_free = offset;
+}
+
+static void _mem_tag_unlink(pool_mgr_pt pool_mgr, size_t offset) {
+    tag_hdr_pt block = _mem_tag_block(pool_mgr, offset);
+
+    if (block->prev_free == MEM_TAG_NIL)
+        pool_mgr->free_head = block->next_free;
+    else
+        _mem_tag_block(pool_mgr, block->prev_free)->next_free = block->next_free;
+    if (block->next_free != MEM_TAG_NIL)
+        _mem_tag_block(pool_mgr, block->next_free)->prev_free = block->prev_free;
+}
+
+// _mem_new_alloc for inline pools
+static alloc_pt _mem_tag_new_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    if (size > pool_mgr->pool.total_size)
+        return NULL;
+
+    // the block: the header up to the payload, the payload and the footer,
+    // in multiples of 8 bytes, and big enough to be a free block later
+    size_t need = (MEM_TAG_PAYLOAD + size + sizeof(size_t) + 7) & ~(size_t) 7;
+    if (need < MEM_TAG_MIN_BLOCK)
+        need = MEM_TAG_MIN_BLOCK;
+
+    // FIRST_FIT: the first free block in address order that is big enough,
+    // BEST_FIT: the smallest one
+    // note: the free list is in no order (see _mem_tag_del_alloc), so FIRST_FIT
+    // looks at all of it, as BEST_FIT does unless there's an exact fit
+    size_t found = MEM_TAG_NIL, found_size = 0;
+    for (size_t gap = pool_mgr->free_head; gap != MEM_TAG_NIL;
+         gap = _mem_tag_block(pool_mgr, gap)->next_free) {
+        size_t gap_size = _mem_tag_block(pool_mgr, gap)->tag >> 1;
+        if (gap_size < need)
+            continue;
+        if (found == MEM_TAG_NIL
+            || (pool_mgr->pool.policy == FIRST_FIT ? gap < found : gap_size < found_size)) {
+            found = gap;
+            found_size = gap_size;
+            if (pool_mgr->pool.policy == BEST_FIT && gap_size == need)
+                break;
+        }
+    }
+    if (found == MEM_TAG_NIL)
+        return NULL;
+
+    // split the rest off as a free block in its place, if it can be one
+    size_t prev = _mem_tag_block(pool_mgr, found)->prev_free;
+    _mem_tag_unlink(pool_mgr, found);
+    if (found_size - need >= MEM_TAG_MIN_BLOCK) {
+        _mem_tag_set(pool_mgr, found + need, found_size - need, 0);
+        _mem_tag_link(pool_mgr, found + need, prev);
+        pool_mgr->used_nodes++;
+    } else {
+        need = found_size;
+        pool_mgr->pool.num_gaps--;
+    }
+
+    tag_hdr_pt block = _mem_tag_block(pool_mgr, found);
+    _mem_tag_set(pool_mgr, found, need, 1);
+    block->alloc_record.size = size;
+    block->alloc_record.mem = (char *) block + MEM_TAG_PAYLOAD;
+    pool_mgr->pool.num_allocs++;
+    pool_mgr->pool.alloc_size += size;
+
+    return &block->alloc_record;
+}
+
+// _mem_del_alloc for inline pools: the neighbours are right there, by the
+// block's own tags
+static alloc_status _mem_tag_del_alloc(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    size_t total_size = pool_mgr->pool.total_size;
+    uintptr_t addr = (uintptr_t) alloc, base = (uintptr_t) pool_mgr->pool.mem;
+
+    // the record has to be in the header of an allocated block
+    tag_hdr_pt block = (addr < base) ? NULL : _mem_tag_allocated(pool_mgr, addr - base);
+    if (block == NULL || alloc->mem != (char *) block + MEM_TAG_PAYLOAD)
+        return ALLOC_FAIL;
+    size_t offset = addr - base;
+    size_t size = block->tag >> 1;
+
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= alloc->size;
+    pool_mgr->pool.num_gaps++;
+    alloc->mem = NULL;
+
+    // merge the next block in, if it is free, and take its place in the
+    // free list, or go first in it otherwise, so that deletes don't search
+    size_t prev = MEM_TAG_NIL;
+    int linked = 0;
+    if (offset + size < total_size && !(_mem_tag_block(pool_mgr, offset + size)->tag & 1)) {
+        tag_hdr_pt next = _mem_tag_block(pool_mgr, offset + size);
+        prev = next->prev_free;
+        linked = 1;
+        _mem_tag_unlink(pool_mgr, offset + size);
+        size += next->tag >> 1;
+        next->tag = 0;
+        pool_mgr->pool.num_gaps--;
+        pool_mgr->used_nodes--;
+    }
+
+    // merge into the previous block, if it is free, which stays where it is
+    size_t prev_tag = 1;
+    if (offset > 0)
+        memcpy(&prev_tag, pool_mgr->pool.mem + offset - sizeof(size_t), sizeof(size_t));
+    if (!(prev_tag & 1)) {
+        block->tag = 0;
+        _mem_tag_set(pool_mgr, offset - (prev_tag >> 1), (prev_tag >> 1) + size, 0);
+        pool_mgr->pool.num_gaps--;
+        pool_mgr->used_nodes--;
+        return ALLOC_OK;
+    }
+
+    _mem_tag_set(pool_mgr, offset, size, 0);
+    _mem_tag_link(pool_mgr, offset, linked ? prev : MEM_TAG_NIL);
+
+    return ALLOC_OK;
+}
+
+// claims the record of an allocation in the pool for a delete that's left
+// for later, swapping its mem for mark: the block, or NULL if the record
+// isn't one of an allocation in the pool, or is claimed already
+static char *_mem_claim(pool_mgr_pt pool_mgr, alloc_pt alloc, char *mark) {
+    _Atomic(char *) *record_mem = (_Atomic(char *) *) &alloc->mem;
+    char *mem = atomic_load_explicit(record_mem, memory_order_relaxed);
+    uintptr_t start = (uintptr_t) pool_mgr->pool.mem;
+
+    if ((uintptr_t) mem < start
+        || (uintptr_t) mem > start + pool_mgr->pool.total_size - sizeof(remote_free_t)
+        || !atomic_compare_exchange_strong_explicit(record_mem, &mem, mark,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed))
+        return NULL;
+
+    return mem;
+}
+
+// the allocated block at an offset, NULL if its tags say there's none there
+static tag_hdr_pt _mem_tag_allocated(pool_mgr_pt pool_mgr, size_t offset) {
+    size_t total_size = pool_mgr->pool.total_size;
+
+    if (offset > total_size - MEM_TAG_MIN_BLOCK || offset % 8 != 0)
+        return NULL;
+    tag_hdr_pt block = _mem_tag_block(pool_mgr, offset);
+    size_t size = block->tag >> 1, footer;
+    if (!(block->tag & 1) || size < MEM_TAG_MIN_BLOCK || size > total_size - offset)
+        return NULL;
+    memcpy(&footer, pool_mgr->pool.mem + offset + size - sizeof(size_t), sizeof(size_t));
+
+    return (footer == block->tag) ? block : NULL;
+}
+
+// the calling thread's cache for the pool, created on first use
+static thread_cache_pt _mem_cache_get(pool_mgr_pt pool_mgr) {
+    thread_cache_pt *link = &thread_caches;
+
+    // usually the first one, and drop the ones of closed pools on the way
+    while (*link != NULL) {
+        thread_cache_pt cache = *link;
+        pool_mgr_pt owner = atomic_load_explicit(&cache->pool_mgr, memory_order_relaxed);
+        if (owner == pool_mgr) {
+            // move to the front
+            *link = cache->next;
+            cache->next = thread_caches;
+            thread_caches = cache;
+            pthread_setspecific(thread_cache_key, thread_caches);
+            return cache;
+        }
+        if (owner == NULL) {
+            *link = cache->next;
+            free(cache);
+            continue;
+        }
+        link = &cache->next;
+    }
+    pthread_setspecific(thread_cache_key, thread_caches);
+
+    thread_cache_pt cache = calloc(1, sizeof(thread_cache_t));
+    if (cache == NULL)
+        return NULL;
+    atomic_init(&cache->pool_mgr, pool_mgr);
+
+    pthread_mutex_lock(&thread_cache_lock);
+    cache->pool_next = pool_mgr->caches;
+    pool_mgr->caches = cache;
+    pthread_mutex_unlock(&thread_cache_lock);
+
+    cache->next = thread_caches;
+    thread_caches = cache;
+    pthread_setspecific(thread_cache_key, thread_caches);
+
+    return cache;
+}
+
+static alloc_pt _mem_cache_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned class = (unsigned) ((size - 1) / MEM_CACHE_CLASS_SIZE);
+    thread_cache_pt cache = _mem_cache_get(pool_mgr);
+    alloc_pt alloc = NULL;
+
+    if (cache == NULL)
+        return NULL;
+
+    // hit: no lock
+    if (cache->counts[class] > 0)
+        return _mem_cache_take(cache->bins[class][--cache->counts[class]]);
+
+    // miss: refill the bin under one lock
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+    alloc = _mem_new_alloc(pool_mgr, (class + 1) * MEM_CACHE_CLASS_SIZE);
+    for (unsigned u = 1; alloc != NULL && u < MEM_CACHE_REFILL; u++) {
+        alloc_pt extra = _mem_new_alloc(pool_mgr, (class + 1) * MEM_CACHE_CLASS_SIZE);
+        if (extra == NULL)
+            break;
+        cache->bins[class][cache->counts[class]++] = _mem_cache_put(pool_mgr, extra);
+    }
+    _mem_sync_hdr(pool_mgr);
+    _mem_unlock(pool_mgr);
+
+    return alloc;
+}
+
+static alloc_status _mem_cache_free(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    unsigned class = (unsigned) (alloc->size / MEM_CACHE_CLASS_SIZE - 1);
+    thread_cache_pt cache = _mem_cache_get(pool_mgr);
+
+    if (cache == NULL)
+        return ALLOC_FAIL;
+
+    // only the record of an allocation in the pool goes, and only once
+    char *mem = _mem_cache_put(pool_mgr, alloc);
+    if (mem == NULL)
+        return ALLOC_FAIL;
+
+    // overflow: give the oldest blocks back under one lock
+    if (cache->counts[class] == MEM_CACHE_BIN_CAPACITY) {
+        if (_mem_lock(pool_mgr) != ALLOC_OK)
+            return ALLOC_FAIL;
+        _mem_cache_flush(cache, class, MEM_CACHE_FLUSH);
+        _mem_sync_hdr(pool_mgr);
+        _mem_unlock(pool_mgr);
+    }
+
+    cache->bins[class][cache->counts[class]++] = mem;
+
+    return ALLOC_OK;
+}
+
+// deletes the oldest count blocks of a bin from the pool, which is locked
+static void _mem_cache_flush(thread_cache_pt cache, unsigned class, unsigned count) {
+    pool_mgr_pt pool_mgr = atomic_load_explicit(&cache->pool_mgr, memory_order_relaxed);
+
+    if (count > cache->counts[class])
+        count = cache->counts[class];
+    for (unsigned u = 0; u < count; u++)
+        _mem_del_alloc(pool_mgr, _mem_cache_take(cache->bins[class][u]));
+    memmove(cache->bins[class], cache->bins[class] + count,
+            (cache->counts[class] - count) * sizeof(char *));
+    cache->counts[class] -= count;
+}
+
+// claims the record of a block going into a cache (see mem_cached_block),
+// and keeps it in the block, which the cache holds instead: the block, or
+// NULL if the record can't be claimed
+static char *_mem_cache_put(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    char *mem = _mem_claim(pool_mgr, alloc, &mem_cached_block);
+
+    if (mem != NULL)
+        memcpy(mem, &alloc, sizeof(alloc_pt));
+
+    return mem;
+}
+
+// the record of a block out of a cache, with its mem back
+static alloc_pt _mem_cache_take(char *mem) {
+    alloc_pt alloc;
+
+    memcpy(&alloc, mem, sizeof(alloc_pt));
+    atomic_store_explicit((_Atomic(char *) *) &alloc->mem, mem, memory_order_relaxed);
+
+    return alloc;
+}
+
+static void _mem_cache_key_init() {
+    pthread_key_create(&thread_cache_key, _mem_cache_exit);
+}
+
+// thread exit: flush and free the thread's caches
+static void _mem_cache_exit(void *caches) {
+    thread_cache_pt cache = caches;
+
+    while (cache != NULL) {
+        thread_cache_pt next = cache->next;
+
+        pthread_mutex_lock(&thread_cache_lock);
+        pool_mgr_pt pool_mgr = atomic_load_explicit(&cache->pool_mgr, memory_order_relaxed);
+        if (pool_mgr != NULL) {
+            thread_cache_pt *link = &pool_mgr->caches;
+            while (*link != cache)
+                link = &(*link)->pool_next;
+            *link = cache->pool_next;
+
+            if (_mem_lock(pool_mgr) == ALLOC_OK) {
+                for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++)
+                    _mem_cache_flush(cache, c, cache->counts[c]);
+                _mem_sync_hdr(pool_mgr);
+                _mem_unlock(pool_mgr);
+            }
+        }
+        pthread_mutex_unlock(&thread_cache_lock);
+
+        free(cache);
+        cache = next;
+    }
+    thread_caches = NULL;
+}
+
+static int _mem_cacheable(size_t size) {
+    return size > 0 && size <= MEM_CACHE_NUM_CLASSES * MEM_CACHE_CLASS_SIZE;
+}
+
+static alloc_status _mem_cpu_cache_init(pool_mgr_pt pool_mgr) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1)
+        num_cpus = 1;
+
+    pool_mgr->cpu_caches = aligned_alloc(_Alignof(cpu_cache_t), num_cpus * sizeof(cpu_cache_t));
+    if (pool_mgr->cpu_caches == NULL)
+        return ALLOC_FAIL;
+    memset(pool_mgr->cpu_caches, 0, num_cpus * sizeof(cpu_cache_t));
+    for (long cpu = 0; cpu < num_cpus; cpu++)
+        atomic_flag_clear(&pool_mgr->cpu_caches[cpu].lock);
+    pool_mgr->num_cpus = (unsigned) num_cpus;
+
+    // the same kind of access for every thread: restartable sequences if
+    // glibc registered them, locks otherwise
+    pool_mgr->rseq = 0;
+#ifdef MEM_RSEQ
+    if (__rseq_size > 0) {
+        const volatile struct rseq *rs = (const void *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+        pool_mgr->rseq = ((int32_t) rs->cpu_id >= 0);
+    }
+#endif
+
+    return ALLOC_OK;
+}
+
+#ifdef MEM_RSEQ
+// the restartable critical sections: each one checks that the thread is
+// still on cpu, then commits with its last store; the kernel restarts it
+// at the abort label if the thread is preempted, migrated or signaled
+// note: -1 if aborted (retry), 0 if the bin is full (push) or empty (pop)
+static int _mem_rseq_push(char *rs, uint32_t cpu,
+                          unsigned long *count, char **bin, char *mem) {
+    __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, 8(%[rs])\n\t"              // rseq->rseq_cs
+            "1:\n\t"
+            "cmpl %[cpu], 4(%[rs])\n\t"             // rseq->cpu_id
+            "jnz 4f\n\t"
+            "movq (%[count]), %%rcx\n\t"
+            "cmpq %[cap], %%rcx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[mem], (%[bin], %%rcx, 8)\n\t"
+            "incq %%rcx\n\t"
+            "movq %%rcx, (%[count])\n\t"            // commit
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long %c[sig]\n\t"
+            "4:\n\t"
+            "jmp %l[abort]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r" (rs), [cpu] "r" (cpu), [count] "r" (count), [bin] "r" (bin),
+              [mem] "r" (mem), [cap] "i" (MEM_CACHE_BIN_CAPACITY), [sig] "i" (RSEQ_SIG)
+            : "memory", "cc", "rax", "rcx"
+            : abort, full);
+    return 1;
+abort:
+    return -1;
+full:
+    return 0;
+}
+
+static int _mem_rseq_pop(char *rs, uint32_t cpu,
+                         unsigned long *count, char **bin, char **mem) {
+    __asm__ __volatile__ goto (
+            ".pushsection __rseq_cs, \"aw\"\n\t"
+            ".balign 32\n\t"
+            "3:\n\t"
+            ".long 0x0, 0x0\n\t"
+            ".quad 1f, (2f - 1f), 4f\n\t"
+            ".popsection\n\t"
+            "leaq 3b(%%rip), %%rax\n\t"
+            "movq %%rax, 8(%[rs])\n\t"              // rseq->rseq_cs
+            "1:\n\t"
+            "cmpl %[cpu], 4(%[rs])\n\t"             // rseq->cpu_id
+            "jnz 4f\n\t"
+            "movq (%[count]), %%rcx\n\t"
+            "testq %%rcx, %%rcx\n\t"
+            "jz %l[empty]\n\t"
+            "decq %%rcx\n\t"
+            "movq (%[bin], %%rcx, 8), %%rdx\n\t"
+            "movq %%rdx, (%[mem])\n\t"
+            "movq %%rcx, (%[count])\n\t"            // commit
+            "2:\n\t"
+            ".pushsection __rseq_failure, \"ax\"\n\t"
+            ".byte 0x0f, 0xb9, 0x3d\n\t"
+            ".long %c[sig]\n\t"
+            "4:\n\t"
+            "jmp %l[abort]\n\t"
+            ".popsection\n\t"
+            :
+            : [rs] "r" (rs), [cpu] "r" (cpu), [count] "r" (count), [bin] "r" (bin),
+              [mem] "r" (mem), [sig] "i" (RSEQ_SIG)
+            : "memory", "cc", "rax", "rcx", "rdx"
+            : abort, empty);
+    return 1;
+abort:
+    return -1;
+empty:
+    return 0;
+}
+#endif
+
+// pushes a block to the current CPU's bin: 1 if pushed, 0 if the bin is
+// full, -1 if the thread can't use the cache (go to the pool)
+static int _mem_cpu_push(pool_mgr_pt pool_mgr, unsigned class, char *mem) {
+#ifdef MEM_RSEQ
+    if (pool_mgr->rseq) {
+        char *rs = (char *) __builtin_thread_pointer() + __rseq_offset;
+        for (;;) {
+            uint32_t cpu = ((const volatile struct rseq *) rs)->cpu_id_start;
+            if (cpu >= pool_mgr->num_cpus || (int32_t) ((const volatile struct rseq *) rs)->cpu_id < 0)
+                return -1;
+            cpu_cache_pt cache = &pool_mgr->cpu_caches[cpu];
+            int ret = _mem_rseq_push(rs, cpu, &cache->counts[class], cache->bins[class], mem);
+            if (ret >= 0)
+                return ret;
+        }
+    }
+#endif
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (unsigned) cpu >= pool_mgr->num_cpus)
+        return -1;
+    cpu_cache_pt cache = &pool_mgr->cpu_caches[cpu];
+    while (atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire))
+        sched_yield();
+    int ret = 0;
+    if (cache->counts[class] < MEM_CACHE_BIN_CAPACITY) {
+        cache->bins[class][cache->counts[class]++] = mem;
+        ret = 1;
+    }
+    atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+
+    return ret;
+}
+
+// pops a block from the current CPU's bin: 1 if popped, 0 if the bin is
+// empty, -1 if the thread can't use the cache (go to the pool)
+static int _mem_cpu_pop(pool_mgr_pt pool_mgr, unsigned class, char **mem) {
+#ifdef MEM_RSEQ
+    if (pool_mgr->rseq) {
+        char *rs = (char *) __builtin_thread_pointer() + __rseq_offset;
+        for (;;) {
+            uint32_t cpu = ((const volatile struct rseq *) rs)->cpu_id_start;
+            if (cpu >= pool_mgr->num_cpus || (int32_t) ((const volatile struct rseq *) rs)->cpu_id < 0)
+                return -1;
+            cpu_cache_pt cache = &pool_mgr->cpu_caches[cpu];
+            int ret = _mem_rseq_pop(rs, cpu, &cache->counts[class], cache->bins[class], mem);
+            if (ret >= 0)
+                return ret;
+        }
+    }
+#endif
+
+    int cpu = sched_getcpu();
+    if (cpu < 0 || (unsigned) cpu >= pool_mgr->num_cpus)
+        return -1;
+    cpu_cache_pt cache = &pool_mgr->cpu_caches[cpu];
+    while (atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire))
+        sched_yield();
+    int ret = 0;
+    if (cache->counts[class] > 0) {
+        *mem = cache->bins[class][--cache->counts[class]];
+        ret = 1;
+    }
+    atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+
+    return ret;
+}
+
+static alloc_pt _mem_cpu_cache_alloc(pool_mgr_pt pool_mgr, size_t size) {
+    unsigned class = (unsigned) ((size - 1) / MEM_CACHE_CLASS_SIZE);
+    alloc_pt allocs[MEM_CACHE_REFILL];
+    char *mems[MEM_CACHE_REFILL];
+    unsigned count = 0;
+
+    // hit: no lock
+    int ret = _mem_cpu_pop(pool_mgr, class, &mems[0]);
+    if (ret > 0)
+        return _mem_cache_take(mems[0]);
+
+    // miss: allocate a batch under one lock, and cache all but the first
+    if (_mem_lock(pool_mgr) != ALLOC_OK)
+        return NULL;
+    for (; count < ((ret == 0) ? MEM_CACHE_REFILL : 1); count++) {
+        allocs[count] = _mem_new_alloc(pool_mgr, (class + 1) * MEM_CACHE_CLASS_SIZE);
+        if (allocs[count] == NULL)
+            break;
+    }
+    _mem_sync_hdr(pool_mgr);
+    _mem_unlock(pool_mgr);
+    if (count == 0)
+        return NULL;
+
+    // note: the thread may be on another CPU by now, which is fine
+    for (unsigned u = 1; u < count; u++)
+        mems[u] = _mem_cache_put(pool_mgr, allocs[u]);
+    unsigned u = 1;
+    while (u < count && _mem_cpu_push(pool_mgr, class, mems[u]) > 0)
+        u++;
+    _mem_cpu_cache_drop(pool_mgr, mems + u, count - u);
 
-    free(pool_store);
-    pool_store = NULL;
-    pool_store_size = 0;
-    pool_store_capacity = 0;
-    return  ALLOC_OK;
+    return allocs[0];
 }
 
-pool_pt mem_pool_open(size_t size, alloc_policy policy) {
-    // make sure there the pool store is allocated
-    if (pool_store == NULL)
-        return NULL;
+static alloc_status _mem_cpu_cache_free(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    unsigned class = (unsigned) (alloc->size / MEM_CACHE_CLASS_SIZE - 1);
+    char *mems[MEM_CACHE_FLUSH + 1];
+    unsigned count = 0;
 
-    // expand the pool store, if necessary
-    _mem_resize_pool_store();
+    // only the record of an allocation in the pool goes, and only once
+    char *mem = _mem_cache_put(pool_mgr, alloc);
+    if (mem == NULL)
+        return ALLOC_FAIL;
 
-    // allocate a new mem pool mgr
-    pool_mgr_pt pool_mgr = malloc(sizeof(pool_mgr_t));
+    // hit: no lock
+    int ret = _mem_cpu_push(pool_mgr, class, mem);
+    if (ret > 0)
+        return ALLOC_OK;
 
-    // check success, on error return null
-    if (pool_mgr == NULL)
-        return  NULL;
+    // overflow: give a batch back under one lock, with the block
+    while (ret == 0 && count < MEM_CACHE_FLUSH && _mem_cpu_pop(pool_mgr, class, &mems[count]) > 0)
+        count++;
+    mems[count++] = mem;
+    _mem_cpu_cache_drop(pool_mgr, mems, count);
 
-    // allocate a new memory pool
-    pool_mgr->pool.mem = malloc(size);
-    pool_mgr->pool.policy = policy;
-    pool_mgr->pool.total_size = size;
+    return ALLOC_OK;
+}
 
-    // check success, on error deallocate mgr and return null
-    if (pool_mgr->pool.mem == NULL) {
-        free(pool_mgr->pool.mem);
-        free(pool_mgr);
-        return NULL;
-    }
+// deletes blocks that did not fit in a per-CPU cache from the pool
+static void _mem_cpu_cache_drop(pool_mgr_pt pool_mgr, char **mems, unsigned count) {
+    if (count == 0 || _mem_lock(pool_mgr) != ALLOC_OK)
+        return;
+    for (unsigned u = 0; u < count; u++)
+        _mem_del_alloc(pool_mgr, _mem_cache_take(mems[u]));
+    _mem_sync_hdr(pool_mgr);
+    _mem_unlock(pool_mgr);
+}
 
-    // allocate a new node heap
-    pool_mgr->node_heap = calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
-    pool_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+// deletes the blocks other threads left on a thread-safe pool, which is locked
+static void _mem_drain_remote(pool_mgr_pt pool_mgr) {
+    // take them all at once, so pushes never race with pops
+    char *mem = atomic_exchange_explicit(&pool_mgr->remote_frees, NULL, memory_order_acquire);
 
-    // check success, on error deallocate mgr/pool and return null
-    if (pool_mgr->node_heap == NULL) {
-        free(pool_mgr->pool.mem);
-        free(pool_mgr->node_heap);
-        free(pool_mgr);
-        return NULL;
+    while (mem != NULL) {
+        // the record gets its mem back, to be deleted as usual
+        remote_free_t entry;
+        memcpy(&entry, mem, sizeof(remote_free_t));
+        entry.alloc->mem = mem;
+        _mem_del_alloc(pool_mgr, entry.alloc);
+        mem = entry.next;
     }
+}
 
-    // allocate a new gap index
-    pool_mgr->gap_ix = calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-    pool_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+// blocks in the caches of the pool, which count as allocated until flushed
+// note: with thread_cache_lock and the pool's lock held
+static size_t _mem_cached_blocks(pool_mgr_pt pool_mgr) {
+    size_t blocks = 0;
 
-    // check success, on error deallocate mgr/pool/heap and return null
-    if (pool_mgr->gap_ix == NULL) {
-        free(pool_mgr->pool.mem);
-        free(pool_mgr->node_heap);
-        free(pool_mgr->gap_ix);
-        free(pool_mgr);
-        return NULL;
+    for (thread_cache_pt cache = pool_mgr->caches; cache != NULL; cache = cache->pool_next)
+        for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++)
+            blocks += cache->counts[c];
+    if (pool_mgr->cpu_caches != NULL)
+        for (unsigned cpu = 0; cpu < pool_mgr->num_cpus; cpu++)
+            for (unsigned c = 0; c < MEM_CACHE_NUM_CLASSES; c++)
+                blocks += pool_mgr->cpu_caches[cpu].counts[c];
+
+    return blocks;
+}
+
+static alloc_status _mem_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ALLOC_FAIL;
+        p += ret;
+        len -= ret;
     }
 
-    // assign all the pointers and update meta data:
+    return ALLOC_OK;
+}
 
-    //   initialize top node of node heap
-    pool_mgr->node_heap[0].alloc_record.mem = pool_mgr->pool.mem;
-    pool_mgr->node_heap[0].alloc_record.size = size;
-    pool_mgr->node_heap[0].used = 1;
-    pool_mgr->used_nodes = 1;
-    pool_mgr->pool.num_gaps = 0;
+static alloc_status _mem_read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
 
-    //   initialize top node of gap index
-    _mem_add_to_gap_ix(pool_mgr, size, &pool_mgr->node_heap[0]);
-    //pool_mgr->gap_ix[0].node = &pool_mgr->node_heap[0];
-    //pool_mgr->gap_ix[0].node->alloc_record.size = size;
+    while (len > 0) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return ALLOC_FAIL;
+        p += ret;
+        len -= ret;
+    }
 
-    //   link pool mgr to pool store
-    pool_store[pool_store_size] = pool_mgr;
-    pool_store_size++;
+    return ALLOC_OK;
+}
 
-    // return the address of the mgr, cast to (pool_pt)
-    return (pool_pt) pool_mgr;
+static size_t _mem_map_len(size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+
+    // at least a page, so that empty pools map too
+    return (size == 0) ? page : (size + page - 1) / page * page;
 }
 
-alloc_status mem_pool_close(pool_pt pool) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+// copies the pages of mem that are not backed by a file, i.e. the ones
+// written since they were last mapped from the base file of a cloned pool,
+// to the same offsets in dst, or in the file dst_fd
+// note: without /proc/self/pagemap, every page is copied
+static alloc_status _mem_copy_dirty(const char *mem,
+                                    size_t len,
+                                    char *dst,
+                                    int dst_fd) {
+    const uint64_t PRESENT = 1ULL << 63, SWAPPED = 1ULL << 62, FILE_PAGE = 1ULL << 61;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t num_pages = len / page;
+    size_t run_start = 0, run_len = 0;
+    alloc_status status = ALLOC_OK;
+    uint64_t entries[512];
 
-    // check if this pool is allocated
-    if (pool_mgr == NULL)
-        return ALLOC_NOT_FREED;
+    int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
 
-    // check if pool has only one gap
-    if (pool_mgr->pool.num_gaps != 1)
-        return ALLOC_NOT_FREED;
+    for (size_t first = 0; first < num_pages && status == ALLOC_OK; first += 512) {
+        size_t n = (num_pages - first < 512) ? num_pages - first : 512;
+        off_t pos = (off_t) (((uintptr_t) mem / page + first) * sizeof(uint64_t));
+        int all_dirty = (pagemap < 0
+                         || pread(pagemap, entries, n * sizeof(uint64_t), pos)
+                            != (ssize_t) (n * sizeof(uint64_t)));
 
-    // check if it has zero allocations
-    if (pool_mgr->pool.num_allocs != 0)
-        return ALLOC_NOT_FREED;
+        for (size_t i = 0; i <= n && status == ALLOC_OK; i++) {
+            int dirty = (i < n)
+                        && (all_dirty
+                            || (entries[i] & SWAPPED)
+                            || ((entries[i] & PRESENT) && !(entries[i] & FILE_PAGE)));
+            if (dirty) {
+                if (run_len == 0)
+                    run_start = (first + i) * page;
+                run_len += page;
+                continue;
+            }
+            // flush the run at the first clean page, or at the last page
+            if (run_len == 0 || (i == n && first + n < num_pages))
+                continue;
+            if (dst != NULL)
+                memcpy(dst + run_start, mem + run_start, run_len);
+            else if (pwrite(dst_fd, mem + run_start, run_len, (off_t) run_start) != (ssize_t) run_len)
+                status = ALLOC_FAIL;
+            run_len = 0;
+        }
+    }
 
-    // free memory pool
-    free(pool_mgr->pool.mem);
+    if (pagemap >= 0)
+        close(pagemap);
+
+    return status;
+}
 
-    // free node heap
-    free(pool_mgr->node_heap);
+// an empty pool store
+static alloc_status _mem_ctx_init(mem_ctx_pt ctx) {
+    ctx->store = calloc(MEM_POOL_STORE_NUM_CHUNKS, sizeof(pool_slot_pt));
+    atomic_init(&ctx->store_size, 0);
+    atomic_init(&ctx->store_free, 0);
+    atomic_init(&ctx->store_live, 0);
+    atomic_init(&ctx->store_trim_at, 0);
+    atomic_init(&ctx->store_users, 0);
 
-    // free gap index
-    free(pool_mgr->gap_ix);
+    return (ctx->store == NULL) ? ALLOC_FAIL : ALLOC_OK;
+}
 
-    // find mgr in pool store and set to null
-    // note: don't decrement pool_store_size, because it only grows
-    for (int i = 0; i < pool_store_size; i++) {
-        if (pool_store[i] == pool_mgr)
-            pool_store[i] = NULL;
+// frees the pool store, with or without pools in it
+// note: pools still in it let go of the context, and close without it
+static alloc_status _mem_ctx_free(mem_ctx_pt ctx) {
+    unsigned size = atomic_load(&ctx->store_size);
+    for (unsigned ix = 0; ix < size; ix++) {
+        pool_slot_pt slot = _mem_store_slot(ctx, ix, 0);
+        pool_mgr_pt pool_mgr = (slot == NULL) ? NULL : atomic_load(&slot->pool_mgr);
+        if (pool_mgr != NULL)
+            pool_mgr->ctx = NULL;
     }
 
-    // free mgr
-    free(pool_mgr);
+    for (unsigned c = 0; c < MEM_POOL_STORE_NUM_CHUNKS; c++)
+        free(atomic_load(&ctx->store[c]));
+    free(ctx->store);
+    ctx->store = NULL;
 
     return ALLOC_OK;
 }
 
-alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+// the slot at ix, allocating its chunk if asked to
+static pool_slot_pt _mem_store_slot(mem_ctx_pt ctx, unsigned ix, int alloc) {
+    // chunk c holds the INIT_CAPACITY << c slots from INIT_CAPACITY * (2^c - 1)
+    unsigned n = ix / MEM_POOL_STORE_INIT_CAPACITY + 1;
+    unsigned c = 31 - __builtin_clz(n);
+    unsigned first = MEM_POOL_STORE_INIT_CAPACITY * ((1u << c) - 1);
 
-    // check if any gaps, return null if none
-    if (pool_mgr->pool.num_gaps == 0)
+    if (c >= MEM_POOL_STORE_NUM_CHUNKS)
         return NULL;
 
-    // expand heap node, if necessary, quit on error
-    if (_mem_resize_node_heap(pool_mgr) != ALLOC_OK)
-        return NULL;
+    pool_slot_pt chunk = atomic_load_explicit(&ctx->store[c], memory_order_acquire);
+    if (chunk == NULL && alloc) {
+        // racing threads allocate it, one of them installs it
+        pool_slot_pt expected = NULL;
+        chunk = calloc(MEM_POOL_STORE_INIT_CAPACITY << c, sizeof(pool_slot_t));
+        if (chunk == NULL)
+            return NULL;
+        if (!atomic_compare_exchange_strong_explicit(&ctx->store[c], &expected, chunk,
+                                                     memory_order_acq_rel,
+                                                     memory_order_acquire)) {
+            free(chunk);
+            chunk = expected;
+        }
+    }
 
-    // check used nodes fewer than total nodes, quit on error
-    if (pool_mgr->used_nodes > pool_mgr->total_nodes)
-        return NULL;
+    return (chunk == NULL) ? NULL : &chunk[ix - first];
+}
 
-    // get a node for allocation:
-    node_pt node = NULL;
+// links a new pool mgr to the context's pool store, in a vacated slot if
+// there is one
+static alloc_status _mem_store_pool(mem_ctx_pt ctx, pool_mgr_pt pool_mgr) {
+    pool_slot_pt slot = NULL;
+    unsigned ix;
 
-    // if FIRST_FIT, then find the first sufficient node in the node heap
-    if (pool->policy == FIRST_FIT) {
-        for (int i = 0; i < pool_mgr->total_nodes; i ++) {
-            if (pool_mgr->node_heap[i].used == 1
-                && pool_mgr->node_heap[i].allocated == 0
-                && pool_mgr->node_heap[i].alloc_record.size >= size) {
-                node = &pool_mgr->node_heap[i];
-                break;
-            }
-        }
-        // if BEST_FIT, then find the first sufficient node in the gap index
-    } else if  (pool->policy == BEST_FIT) {
-        for (int i = 0; i < pool_mgr->gap_ix_capacity && node == NULL; i++) {
-            if (pool_mgr->gap_ix[i].size >= size)
-                node = pool_mgr->gap_ix[i].node;
-        }
-    } else {
-        return NULL;
+    _mem_store_enter(ctx);
+
+    // pop a vacated slot
+    // note: the tag changes on every push and pop, so a slot that is popped
+    // and pushed back in between can't be mistaken for the same head
+    uint64_t head = atomic_load_explicit(&ctx->store_free, memory_order_acquire);
+    while ((uint32_t) head != 0) {
+        ix = (uint32_t) head - 1;
+        slot = _mem_store_slot(ctx, ix, 0);
+        uint64_t next = ((head >> 32) + 1) << 32
+                        | atomic_load_explicit(&slot->next_free, memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&ctx->store_free, &head, next,
+                                                  memory_order_acquire,
+                                                  memory_order_acquire))
+            break;
+        slot = NULL;
     }
 
-    // check if node found
-    if (node == NULL) {
-        return NULL;
+    // or take a slot that has never been used
+    if (slot == NULL) {
+        ix = atomic_fetch_add_explicit(&ctx->store_size, 1, memory_order_relaxed);
+        slot = _mem_store_slot(ctx, ix, 1);
+        if (slot == NULL) {
+            atomic_fetch_sub_explicit(&ctx->store_size, 1, memory_order_relaxed);
+            _mem_store_exit(ctx);
+            return ALLOC_FAIL;
+        }
+
+        // the first slot of a chunk sets when to trim the store back to the
+        // chunks below it: when a quarter of their slots are still in use
+        unsigned n = ix / MEM_POOL_STORE_INIT_CAPACITY + 1;
+        if ((n & (n - 1)) == 0 && ix == MEM_POOL_STORE_INIT_CAPACITY * (n - 1))
+            atomic_store_explicit(&ctx->store_trim_at, ix / 4, memory_order_relaxed);
     }
 
-    // update metadata (num_allocs, alloc_size)
-    pool->num_allocs++;
-    pool->alloc_size += size;
+    pool_mgr->ctx = ctx;
+    pool_mgr->store_ix = ix;
+    atomic_store_explicit(&slot->pool_mgr, pool_mgr, memory_order_release);
+    atomic_fetch_add_explicit(&ctx->store_live, 1, memory_order_relaxed);
 
-    // calculate the size of the remaining gap, if any
-    size_t remaining_gap_size = node->alloc_record.size - size;
+    _mem_store_exit(ctx);
 
-    // remove node from gap index
-    if (_mem_remove_from_gap_ix(pool_mgr, size, node) != ALLOC_OK)
-        return NULL;
+    return ALLOC_OK;
+}
 
-    // convert gap_node to an allocation node of given size
-    node->allocated = 1;
-    node->alloc_record.size = size;
+// vacates the pool mgr's slot in the pool store, in O(1), and trims the
+// store now and then, once most of its pools have closed
+static void _mem_unstore_pool(pool_mgr_pt pool_mgr) {
+    mem_ctx_pt ctx = pool_mgr->ctx;
 
-    // adjust node heap:
-    //   if remaining gap, need a new node
-    if (remaining_gap_size != 0) {
-        //   find an unused one in the node heap
-/*        node_pt unused_node = pool_mgr->node_heap;
-        while (unused_node != NULL && unused_node->used != 0) {
-            unused_node = unused_node->next;
-        }*/
-
-        node_pt unused_node = NULL;
-        for (int i = 0; i < pool_mgr->total_nodes; i ++) {
-            if (pool_mgr->node_heap[i].used == 0) {
-                unused_node = &pool_mgr->node_heap[i];
-                break;
-            }
-        }
+    // the pool outlived its context (see _mem_ctx_free)
+    if (ctx == NULL)
+        return;
 
-        //   make sure one was found
-        if (unused_node == NULL)
-            return NULL;
+    _mem_store_enter(ctx);
 
-        //   initialize it to a gap node
-        unused_node->allocated = 0;
-        unused_node->used = 1;
-        unused_node->alloc_record.size = remaining_gap_size;
-        unused_node->alloc_record.mem = node->alloc_record.mem + size;
+    pool_slot_pt slot = _mem_store_slot(ctx, pool_mgr->store_ix, 0);
 
-        //   update metadata (used_nodes)
-        pool_mgr->used_nodes++;
+    atomic_store_explicit(&slot->pool_mgr, NULL, memory_order_relaxed);
 
-        //   update linked list (new node right after the node for allocation)
-        unused_node->next = node->next;
-        if (node->next != NULL)  {
-            node->next->prev = unused_node;
-        } else {
-            unused_node->next = NULL;
-        }
-        node->next = unused_node;
-        unused_node->prev = node;
+    // push it on the vacated slots
+    uint64_t head = atomic_load_explicit(&ctx->store_free, memory_order_relaxed);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&slot->next_free, (uint32_t) head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (pool_mgr->store_ix + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&ctx->store_free, &head, next,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
 
-        //   add to gap index
-        //   check if successful
-        if (_mem_add_to_gap_ix(pool_mgr, remaining_gap_size, unused_node) != ALLOC_OK)
-            return NULL;
+    unsigned live = atomic_fetch_sub_explicit(&ctx->store_live, 1, memory_order_relaxed) - 1;
+
+    // trim only with the store to itself, other threads wait at the door
+    // note: a busy store skips the trim, the next close tries again
+    unsigned users = 1;
+    if (live <= atomic_load_explicit(&ctx->store_trim_at, memory_order_relaxed)
+        && atomic_load_explicit(&ctx->store_size, memory_order_relaxed) > MEM_POOL_STORE_INIT_CAPACITY
+        && atomic_compare_exchange_strong_explicit(&ctx->store_users, &users,
+                                                   1 | MEM_POOL_STORE_TRIMMING,
+                                                   memory_order_acquire,
+                                                   memory_order_relaxed)) {
+        _mem_trim_store(ctx);
+        atomic_store_explicit(&ctx->store_users, 1, memory_order_release);
     }
 
-    // return allocation record by casting the node to (alloc_pt)
-    return (alloc_pt) node;
+    _mem_store_exit(ctx);
 }
 
-alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+// every store and unstore happens between enter and exit, so that a trim can
+// wait for the store to be quiet
+static void _mem_store_enter(mem_ctx_pt ctx) {
+    unsigned users = atomic_load_explicit(&ctx->store_users, memory_order_relaxed);
+    for (;;) {
+        if (users & MEM_POOL_STORE_TRIMMING) {
+            sched_yield();
+            users = atomic_load_explicit(&ctx->store_users, memory_order_relaxed);
+        } else if (atomic_compare_exchange_weak_explicit(&ctx->store_users, &users, users + 1,
+                                                         memory_order_acquire,
+                                                         memory_order_relaxed)) {
+            return;
+        }
+    }
+}
 
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt node = (node_pt) alloc;
+static void _mem_store_exit(mem_ctx_pt ctx) {
+    atomic_fetch_sub_explicit(&ctx->store_users, 1, memory_order_release);
+}
 
-    // find the node in the node heap
-    int found = 0;
-    for (int i = 0; i < pool_mgr->total_nodes; i++) {
-        if (&pool_mgr->node_heap[i] == node) {
-            found = 1;
+// frees the chunks above the last pool in the store, and restacks the
+// vacated slots below it lowest first, so that the pools to come fill the
+// store from the bottom and leave its top chunks to be freed next time
+// note: only with the store to itself, so plain loads and stores will do
+static void _mem_trim_store(mem_ctx_pt ctx) {
+    unsigned size = atomic_load_explicit(&ctx->store_size, memory_order_relaxed);
+
+    unsigned top = 0; // slots up to the last pool
+    for (unsigned ix = size; ix-- > 0; ) {
+        if (atomic_load_explicit(&_mem_store_slot(ctx, ix, 0)->pool_mgr, memory_order_relaxed) != NULL) {
+            top = ix + 1;
             break;
         }
+    }
 
+    // keep the first chunk, and every chunk up to the one with the last pool
+    unsigned keep = (top == 0) ? 1 : 32 - __builtin_clz((top - 1) / MEM_POOL_STORE_INIT_CAPACITY + 1);
+    for (unsigned c = keep; c < MEM_POOL_STORE_NUM_CHUNKS; c++) {
+        free(atomic_load_explicit(&ctx->store[c], memory_order_relaxed));
+        atomic_store_explicit(&ctx->store[c], NULL, memory_order_relaxed);
     }
 
-    // this is node-to-delete
-    // make sure it's found
-    if (!found)
-        return ALLOC_FAIL;
+    unsigned kept = MEM_POOL_STORE_INIT_CAPACITY * ((1u << keep) - 1);
+    if (size > kept)
+        size = kept;
+    atomic_store_explicit(&ctx->store_size, size, memory_order_relaxed);
 
-    // convert to gap node
-    node->allocated = 0;
+    uint32_t head = 0;
+    for (unsigned ix = size; ix-- > 0; ) {
+        pool_slot_pt slot = _mem_store_slot(ctx, ix, 0);
+        if (atomic_load_explicit(&slot->pool_mgr, memory_order_relaxed) == NULL) {
+            atomic_store_explicit(&slot->next_free, head, memory_order_relaxed);
+            head = ix + 1;
+        }
+    }
+    uint64_t tag = (atomic_load_explicit(&ctx->store_free, memory_order_relaxed) >> 32) + 1;
+    atomic_store_explicit(&ctx->store_free, tag << 32 | head, memory_order_relaxed);
 
-    // update metadata (num_allocs, alloc_size)
-    pool_mgr->pool.num_allocs--;
-    pool_mgr->pool.alloc_size -= alloc->size;
+    // don't scan again until half of the pools left have closed
+    atomic_store_explicit(&ctx->store_trim_at,
+                          atomic_load_explicit(&ctx->store_live, memory_order_relaxed) / 2,
+                          memory_order_relaxed);
+}
 
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if (node->next != NULL && node->next->allocated == 0) {
-        //   remove the next node from gap index
-        //   check success
-        if (_mem_remove_from_gap_ix(pool_mgr, node->next->alloc_record.size, node->next) != ALLOC_OK)
-            return ALLOC_FAIL;
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+    // see above
 
-        //   add the size to the node-to-delete
-        node->alloc_record.size += node->next->alloc_record.size;
+    // realtime pools have all the nodes they can use
+    if (pool_mgr->max_segments != 0)
+        return ALLOC_OK;
 
-        //   update node as unused
-        node->next->used = 0;
+    if (((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
+        > pool_mgr->fill_factor) {
+        unsigned int updated_capacity = pool_mgr->total_nodes * pool_mgr->expand_factor;
 
-        //   update metadata (used nodes)
-        pool_mgr->used_nodes--;
+        // file-backed pools grow their metadata mapping instead
+        if (pool_mgr->hdr != NULL)
+            return _mem_resize_meta_map(pool_mgr, updated_capacity, pool_mgr->gap_ix_capacity);
 
-        //   update linked list:
-        /*
-                        if (next->next) {
-                            next->next->prev = node_to_del;
-                            node_to_del->next = next->next;
-                        } else {
-                            node_to_del->next = NULL;
-                        }
-                        next->next = NULL;
-                        next->prev = NULL;
-         */
-        node_pt node_to_del = node->next;
-        if (node->next->next) {
-            node->next->next->prev = node;
-            node->next = node->next->next;
-        } else {
-            node->next = NULL;
-        }
-        node_to_del->next = NULL;
-        node_to_del->prev = NULL;
+        // others add chunks, and nothing moves: the allocation records
+        // handed out stay valid, even where other threads are reading them
+        // note: a chunk at a time doubles the node heap (and then some)
+        unsigned total_nodes = pool_mgr->total_nodes;
+        while (pool_mgr->total_nodes < updated_capacity && _mem_add_chunk(pool_mgr) == ALLOC_OK)
+            ;
+        return (pool_mgr->total_nodes > total_nodes) ? ALLOC_OK : ALLOC_FAIL;
     }
 
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    if (node->prev != NULL && node->prev->allocated == 0) {
-        //   remove the previous node from gap index
-        //   check success
-        if (_mem_remove_from_gap_ix(pool_mgr, node->prev->alloc_record.size, node->prev) != ALLOC_OK)
-            return ALLOC_FAIL;
+    return ALLOC_OK;
+}
 
-        //   add the size of node-to-delete to the previous
-        node->prev->alloc_record.size += node->alloc_record.size;
+static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
+    // see above
 
-        //   update node-to-delete as unused
-        node->used = 0;
+    // realtime pools have room for all the gaps they can have
+    if (pool_mgr->max_segments != 0)
+        return ALLOC_OK;
 
-        //   update metadata (used_nodes)
-        pool_mgr->used_nodes--;
+    if (((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
+        > pool_mgr->fill_factor) {
+        unsigned int updated_capacity = pool_mgr->gap_ix_capacity * pool_mgr->expand_factor;
 
-        //   update linked list
-        /*
-                        if (node_to_del->next) {
-                            prev->next = node_to_del->next;
-                            node_to_del->next->prev = prev;
-                        } else {
-                            prev->next = NULL;
-                        }
-                        node_to_del->next = NULL;
-                        node_to_del->prev = NULL;
-         */
-        node_pt prev_node = node->prev;
-        if (node->next) {
-            node->prev->next = node->next;
-            node->next->prev = node->prev;
-        } else {
-            node->prev->next = NULL;
-        }
-        node->next = NULL;
-        node->prev = NULL;
-        //   change the node to add to the previous node!
-        node = prev_node;
-    }
+        // file-backed pools grow their metadata mapping instead
+        if (pool_mgr->hdr != NULL)
+            return _mem_resize_meta_map(pool_mgr, pool_mgr->total_nodes, updated_capacity);
 
-    // add the resulting node to the gap index
-    // check success
-    if (_mem_add_to_gap_ix(pool_mgr, node->alloc_record.size, node) != ALLOC_OK)
-        return ALLOC_FAIL;
+        gap_pt updated_ix = _mem_meta_realloc(pool_mgr, pool_mgr->gap_ix,
+                                              sizeof(gap_t) * pool_mgr->gap_ix_capacity,
+                                              sizeof(gap_t) * updated_capacity);
+        if (updated_ix == NULL)
+            return ALLOC_FAIL;
+
+        // new entries have to start out empty
+        memset(updated_ix + pool_mgr->gap_ix_capacity, 0,
+               sizeof(gap_t) * (updated_capacity - pool_mgr->gap_ix_capacity));
+        pool_mgr->gap_ix = updated_ix;
+        pool_mgr->gap_ix_capacity = updated_capacity;
+    }
 
     return ALLOC_OK;
 }
 
-void mem_inspect_pool(pool_pt pool,
-                      pool_segment_pt *segments,
-                      unsigned *num_segments) {
-    // get the mgr from the pool
-    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+// shrinks the gap index and the node heap of a pool that has become sparse,
+// a round of growth at a time, once they are down to a fill that growing
+// back would take as many new gaps or segments again (hysteresis)
+// note: the nodes of allocations never move, their records are handed out,
+// so the last chunk goes once it holds none, after its gaps have moved down
+static void _mem_shrink_meta(pool_mgr_pt pool_mgr) {
+    // mapped pools keep their metadata mapping, realtime pools their reserve
+    if (pool_mgr->hdr != NULL || pool_mgr->max_segments != 0)
+        return;
 
-    // allocate the segments array with size == used_nodes
-    pool_segment_pt seg_array = calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+    float low = pool_mgr->fill_factor / pool_mgr->expand_factor;
 
-    // check successful
-    if (seg_array == NULL)
-        return;
+    // the gap index, down to the capacity it starts out with
+    unsigned capacity = pool_mgr->gap_ix_capacity / pool_mgr->expand_factor;
+    if (capacity >= MEM_GAP_IX_INIT_CAPACITY && capacity >= pool_mgr->reserved_gaps
+        && (float) pool_mgr->pool.num_gaps < capacity * low) {
+        gap_pt updated_ix = _mem_meta_realloc(pool_mgr, pool_mgr->gap_ix,
+                                              sizeof(gap_t) * pool_mgr->gap_ix_capacity,
+                                              sizeof(gap_t) * capacity);
+        if (updated_ix != NULL) {
+            pool_mgr->gap_ix = updated_ix;
+            pool_mgr->gap_ix_capacity = capacity;
+        }
+    }
 
-    // loop through the node heap and the segments array
-    //    for each node, write the size and allocated in the segment
-    // "return" the values:
-    /*
-                    *segments = segs;
-                    *num_segments = pool_mgr->used_nodes;
-     */
-    pool_segment_pt segment = seg_array;
-    node_pt target_node = pool_mgr->node_heap;
-    for (int i = 0; i < pool_mgr->used_nodes; i++) {
-        segment->size = target_node->alloc_record.size;
-        segment->allocated = target_node->allocated;
-        segment++;
-        target_node = target_node->next;
+    // the node heap, from the last chunk down to the first
+    // note: a chunk that still holds allocations is checked again only after
+    // some deletes, so the checks take a few nodes per delete at most
+    if (pool_mgr->shrink_wait > 0) {
+        pool_mgr->shrink_wait--;
+        return;
     }
+    while (pool_mgr->num_chunks > 1) {
+        unsigned c = pool_mgr->num_chunks - 1;
+        unsigned len = MEM_NODE_HEAP_INIT_CAPACITY << c;
+        if (pool_mgr->total_nodes - len < pool_mgr->reserved_nodes
+            || (float) pool_mgr->used_nodes >= (pool_mgr->total_nodes - len) * low)
+            return;
 
-    *segments = seg_array;
-    *num_segments = pool_mgr->used_nodes;
+        if (_mem_vacate_chunk(pool_mgr, c) != ALLOC_OK) {
+            pool_mgr->shrink_wait = len / 8;
+            return;
+        }
 
+        node_chunk_pt chunk = &pool_mgr->chunks[c];
+        _mem_meta_free(pool_mgr, chunk->nodes);
+        free(chunk->records);
+        free(chunk->gens);
+        _mem_meta_free(pool_mgr, chunk->gap_sizes);
+        _mem_meta_free(pool_mgr, chunk->used);
+        memset(chunk, 0, sizeof(node_chunk_t));
+        pool_mgr->num_chunks--;
+        pool_mgr->total_nodes -= len;
+    }
 }
 
+// moves the gaps in a chunk of the node heap to unused nodes in the chunks
+// before it, unless it holds allocations
+static alloc_status _mem_vacate_chunk(pool_mgr_pt pool_mgr, unsigned c) {
+    node_chunk_pt chunk = &pool_mgr->chunks[c];
+    unsigned first = _mem_chunk_first(c);
+    unsigned len = _mem_chunk_len(pool_mgr, c);
 
+    for (unsigned i = 0; i < len; i++)
+        if (chunk->nodes[i].used && chunk->nodes[i].allocated)
+            return ALLOC_FAIL;
 
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store() {
-    // check if necessary
-    /*
-                if (((float) pool_store_size / pool_store_capacity)
-                    > MEM_POOL_STORE_FILL_FACTOR) {...}
-     */
-    // don't forget to update capacity variables
+    unsigned to_ix = 0;
+    for (unsigned i = 0; i < len; i++) {
+        node_pt node = &chunk->nodes[i];
+        if (!node->used)
+            continue;
 
-    if (((float) pool_store_size / pool_store_capacity)
-        > MEM_POOL_STORE_FILL_FACTOR) {
-        unsigned int updated_capacity = pool_store_capacity * MEM_EXPAND_FACTOR;
-        pool_store = realloc(pool_store, sizeof(pool_mgr_pt) * updated_capacity);
-        if (pool_store == NULL)
+        // the next unused node down (there are plenty, the pool is sparse)
+        while (to_ix < first && _mem_node(pool_mgr, to_ix)->used)
+            to_ix++;
+        if (to_ix == first)
             return ALLOC_FAIL;
-        pool_store_capacity = updated_capacity;
+
+        // the gap's neighbours and its gap index entry follow it there
+        node_pt to = _mem_node(pool_mgr, to_ix);
+        *to = *node;
+        _mem_set_used(pool_mgr, to, 1);
+        _mem_set_gap_size(pool_mgr, to_ix, to->size);
+        _mem_place_record(pool_mgr, to);
+        if (to->prev != MEM_NIL)
+            _mem_node(pool_mgr, to->prev)->next = to_ix;
+        if (to->next != MEM_NIL)
+            _mem_node(pool_mgr, to->next)->prev = to_ix;
+        for (unsigned g = 0; g < pool_mgr->pool.num_gaps; g++) {
+            if (pool_mgr->gap_ix[g].node == first + i) {
+                pool_mgr->gap_ix[g].node = to_ix;
+                break;
+            }
+        }
+        if (pool_mgr->head == first + i)
+            pool_mgr->head = to_ix;
+        _mem_set_used(pool_mgr, node, 0);
+        _mem_set_gap_size(pool_mgr, first + i, 0);
     }
 
     return ALLOC_OK;
 }
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-    // see above
+static alloc_status _mem_resize_meta_map(pool_mgr_pt pool_mgr,
+                                         unsigned total_nodes,
+                                         unsigned gap_ix_capacity) {
+    // the metadata mapping holds the node heap followed by the gap index
+    size_t meta_len = total_nodes * sizeof(node_t) + gap_ix_capacity * sizeof(gap_t);
 
-    if (((float) pool_mgr->used_nodes / pool_mgr->total_nodes)
-        > MEM_NODE_HEAP_FILL_FACTOR) {
-        unsigned int updated_capacity = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
-        pool_mgr->node_heap = realloc(pool_mgr->node_heap, sizeof(node_t) * updated_capacity);
-        if (pool_mgr->node_heap  == NULL)
-            return ALLOC_FAIL;
-        pool_mgr->total_nodes = updated_capacity;
-    }
+    // as many nodes as the chunks can hold
+    if (total_nodes > _mem_chunk_first(MEM_NODE_HEAP_NUM_CHUNKS))
+        return ALLOC_FAIL;
 
-    return ALLOC_OK;
-}
+    // grow the file first, the new tail of the mapping has to be backed
+    if (ftruncate(pool_mgr->fd, (off_t) (pool_mgr->hdr->meta_off + meta_len)) != 0)
+        return ALLOC_FAIL;
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
-    // see above
+    void *meta = mremap(pool_mgr->node_heap, pool_mgr->meta_len, meta_len, MREMAP_MAYMOVE);
+    if (meta == MAP_FAILED)
+        return ALLOC_FAIL;
 
-    if (((float) pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity)
-        > MEM_GAP_IX_FILL_FACTOR) {
-        unsigned int updated_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
-        pool_mgr->gap_ix = realloc(pool_mgr->gap_ix, sizeof(gap_t) * updated_capacity);
-        if (pool_mgr->gap_ix  == NULL)
-            return ALLOC_FAIL;
-        pool_mgr->gap_ix_capacity = updated_capacity;
-    }
+    node_pt node_heap = meta;
+    gap_pt old_gap_ix = (gap_pt) (node_heap + pool_mgr->total_nodes);
+    gap_pt gap_ix = (gap_pt) (node_heap + total_nodes);
+
+    // move the gap index up behind the grown node heap, then clear the new slots
+    memmove(gap_ix, old_gap_ix, sizeof(gap_t) * pool_mgr->gap_ix_capacity);
+    memset(node_heap + pool_mgr->total_nodes, 0,
+           sizeof(node_t) * (total_nodes - pool_mgr->total_nodes));
+    memset(gap_ix + pool_mgr->gap_ix_capacity, 0,
+           sizeof(gap_t) * (gap_ix_capacity - pool_mgr->gap_ix_capacity));
+
+    unsigned old_total_nodes = pool_mgr->total_nodes;
+    pool_mgr->node_heap = node_heap;
+    pool_mgr->total_nodes = total_nodes;
+    pool_mgr->gap_ix = gap_ix;
+    pool_mgr->gap_ix_capacity = gap_ix_capacity;
+    pool_mgr->meta_len = meta_len;
+    _mem_map_chunks(pool_mgr);
+    _mem_soa_grow(pool_mgr, old_total_nodes);
+    _mem_sync_hdr(pool_mgr);
 
     return ALLOC_OK;
 }
@@ -561,11 +4508,13 @@ static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                                        node_pt node) {
     // check success
     // expand the gap index, if necessary (call the function)
-    _mem_resize_gap_ix(pool_mgr);
+    if (_mem_resize_gap_ix(pool_mgr) != ALLOC_OK)
+        return ALLOC_FAIL;
 
     // add the entry at the end
     pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = size;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = _mem_node_ix(pool_mgr, node);
+    _mem_set_gap_size(pool_mgr, pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node, size);
 
     // update metadata (num_gaps)
     pool_mgr->pool.num_gaps++;
@@ -582,9 +4531,10 @@ static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                                             node_pt node) {
 
     // find the position of the node in the gap index
+    unsigned node_ix = _mem_node_ix(pool_mgr, node);
     int pos = -1;
     for (int i = 0; i < pool_mgr->pool.num_gaps; i++) {
-        if (pool_mgr->gap_ix[i].node == node) {
+        if (pool_mgr->gap_ix[i].node == node_ix) {
             pos = i;
             break;
         }
@@ -592,6 +4542,10 @@ static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
 
     if (pos == -1)
         return ALLOC_FAIL;
+    _mem_set_gap_size(pool_mgr, node_ix, 0);
+
+    // up to the entry, and the ones after it
+    pool_mgr->cost += pool_mgr->pool.num_gaps + 1;
 
     // loop from there to the end of the array:
     //    pull the entries (i.e. copy over) one position up
@@ -606,7 +4560,7 @@ static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
 
     // zero out the element at position num_gaps!
     pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = 0;
-    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = NULL;
+    pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = MEM_NIL;
 
     return ALLOC_OK;
 }
@@ -617,16 +4571,19 @@ static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
     if (pool_mgr->pool.num_gaps < 2)
         return ALLOC_OK;
 
+    pool_mgr->cost += pool_mgr->pool.num_gaps - 1;
+
     // the new entry is at the end, so "bubble it up"
     // loop from num_gaps - 1 until but not including 0:
     for (int i = pool_mgr->pool.num_gaps - 1; i > 0; i--) {
         //    if the size of the current entry is less than the previous (u - 1)
         //    or if the sizes are the same but the current entry points to a
-        //    node with a lower address of pool allocation address (mem)
+        //    node with a lower offset into the pool
         //       swap them (by copying) (remember to use a temporary variable)
         if (pool_mgr->gap_ix[i].size < pool_mgr->gap_ix[i - 1].size
             || (pool_mgr->gap_ix[i].size == pool_mgr->gap_ix[i - 1].size
-                && pool_mgr->gap_ix[i].node->alloc_record.mem < pool_mgr->gap_ix[i-1].node->alloc_record.mem)) {
+                && _mem_node(pool_mgr, pool_mgr->gap_ix[i].node)->offset
+                   < _mem_node(pool_mgr, pool_mgr->gap_ix[i - 1].node)->offset)) {
             gap_t temp = pool_mgr->gap_ix[i];
             pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i - 1];
             pool_mgr->gap_ix[i - 1] = temp;
@@ -634,4 +4591,4 @@ static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
     }
 
     return ALLOC_OK;
-}
\ No newline at end of file
+}
@@ -6,6 +6,7 @@
 #define DENVER_OS_PA_C_MEM_POOL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* type declarations */
 
@@ -37,6 +38,38 @@ typedef enum _alloc_status {
     ALLOC_NOT_FREED
 } alloc_status;
 
+// features of a pool opened by mem_pool_open_ex, as with the functions below
+typedef enum _pool_flags {
+    POOL_MT         = 1,    // mem_pool_open_mt
+    POOL_INLINE     = 2,    // mem_pool_open_inline
+    POOL_CACHE      = 4,    // mem_pool_enable_cache, thread-safe pools only
+    POOL_CPU_CACHE  = 8,    // mem_pool_enable_cpu_cache, thread-safe pools only
+    POOL_REALTIME   = 16    // bounded latency, see below
+} pool_flags;
+
+// the metadata and features of a pool opened by mem_pool_open_ex, 0 for the
+// defaults throughout
+typedef struct _pool_config {
+    unsigned expected_allocs;  // allocations to size the metadata for up front
+    unsigned max_segments;     // realtime pools only, allocations and gaps at most
+    float fill_factor;         // the metadata grows when this full, below 1 (0.75)
+    unsigned expand_factor;    // by this factor, 2 to 16 (2)
+    unsigned flags;            // pool_flags
+} pool_config_t, *pool_config_pt;
+
+// called by mem_pool_compact for every allocation it moves, after the move,
+// with the old and the new address of its memory
+typedef void (*mem_relocate_fn)(void *old_mem, void *new_mem, size_t size, void *ctx);
+
+// a relocatable allocation, see mem_handle_new (0 for none)
+typedef unsigned mem_handle_t;
+
+// a generation-checked reference to an allocation, see mem_ref_of (0 for none)
+typedef uint64_t mem_ref_t;
+
+// an allocator context, with a pool store of its own (opaque)
+typedef struct _mem_ctx mem_ctx_t, *mem_ctx_pt;
+
 /* function declarations */
 
 alloc_status
@@ -45,19 +78,272 @@ mem_init();
 alloc_status
 mem_free();
 
+// opens a context of its own, independent of mem_init/mem_free and of other
+// contexts: pools opened in it share nothing with pools in other contexts
+mem_ctx_pt
+mem_ctx_open();
+
+// closes a context opened by mem_ctx_open
+// note: close its pools first; pools left open (as after mem_free) still
+// close, but can't be cloned
+alloc_status
+mem_ctx_close(mem_ctx_pt ctx);
+
+// slots in the pool store of mem_init (or of the context), for the pools
+// open and for pools to come, which shrink back as pools close (0 if none)
+unsigned
+mem_store_slots();
+
+unsigned
+mem_ctx_store_slots(mem_ctx_pt ctx);
+
+// the functions that open a pool have a variant (mem_ctx_...) that opens it in
+// the given context instead of the one of mem_init, and the functions that
+// take a pool work on pools of any context
+// note: clones are opened in the context of the pool they are cloned from
+// note: a pool of up to 16 KB is a single allocation, along with its mgr and
+// the metadata it starts out with
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_ctx_pool_open(mem_ctx_pt ctx, size_t size, alloc_policy policy);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
+// thread-safe pool: like mem_pool_open, but every call on the pool takes a
+// lock of its own, so threads using different pools never wait for each other
+// note: allocation records stay valid until they are deleted, even as the
+// metadata grows under other threads
+// note: threads other than the one that opened the pool delete blocks of 16
+// bytes or more without the lock, and the deletes take effect (and errors are
+// dropped) the next time any thread takes it, e.g. in mem_new_alloc or
+// mem_inspect_pool, and deleting a record again meanwhile fails
+pool_pt
+mem_pool_open_mt(size_t size, alloc_policy policy);
+
+pool_pt
+mem_ctx_pool_open_mt(mem_ctx_pt ctx, size_t size, alloc_policy policy);
+
+// inline pool: like mem_pool_open, but the metadata is in the pool memory
+// itself, as a header and a footer (boundary tags) around every block, with
+// the allocation record in the header, so that deleting finds and merges the
+// neighbouring gaps right next to the block, and there is no node heap to grow
+// note: every block takes 32 bytes of the pool on top of the allocation, and
+// is rounded up to a multiple of 8 bytes, of 48 bytes at least; the segments
+// of mem_inspect_pool are the blocks
+// note: can't be saved or cloned
+pool_pt
+mem_pool_open_inline(size_t size, alloc_policy policy);
+
+pool_pt
+mem_ctx_pool_open_inline(mem_ctx_pt ctx, size_t size, alloc_policy policy);
+
+// inline pool in the caller's buffer (a static or stack array, a mapped
+// device region, ..): the pool's mgr and all of its metadata are carved out of
+// the buffer, and nothing is ever allocated, so the pool needs no mem_init
+// and isn't part of any context
+// note: the pool memory is what's left of the buffer after the mgr (about
+// 1 KB), see pool->total_size; closing the pool leaves the buffer to the caller
+pool_pt
+mem_pool_open_in(void *buffer, size_t size, alloc_policy policy);
+
+// like mem_pool_open, but with the metadata sized and grown as configured,
+// and with the configured features (config NULL: as mem_pool_open)
+// note: a pool expected to hold many allocations skips the rounds of growing
+// its metadata on the way there, and a higher expand factor skips rounds
+// later on, both at the cost of metadata that may go unused
+pool_pt
+mem_pool_open_ex(size_t size, alloc_policy policy, const pool_config_t *config);
+
+pool_pt
+mem_ctx_pool_open_ex(mem_ctx_pt ctx, size_t size, alloc_policy policy, const pool_config_t *config);
+
+// realtime pools (POOL_REALTIME): the metadata of max_segments segments is
+// reserved when the pool opens, and mem_new_alloc and mem_del_alloc never
+// allocate, and never visit more than mem_pool_worst_case metadata entries
+// (a small multiple of max_segments, see mem_pool_last_cost); an allocation
+// that would leave more segments than that fails instead
+// note: not inline or cached; thread-safe realtime pools still wait for the lock
+size_t
+mem_pool_worst_case(pool_pt pool);
+
+// metadata entries the last mem_new_alloc or mem_del_alloc on the pool visited
+// (not for inline pools)
+size_t
+mem_pool_last_cost(pool_pt pool);
+
+// puts a cache per thread in front of a thread-safe pool: allocations of up
+// to 512 bytes are rounded up to a multiple of 16 and reuse the blocks the
+// thread deleted, without taking the pool's lock
+// note: cached blocks count as allocated until they are flushed, which
+// happens in batches, when a thread exits, or when the pool closes, and
+// deleting a record again meanwhile fails
+// note: call before other threads use the pool
+alloc_status
+mem_pool_enable_cache(pool_pt pool);
+
+// like mem_pool_enable_cache, but with a cache per CPU instead of per thread,
+// so that the memory held in caches scales with the cores, not the threads
+// note: lock-free through restartable sequences where available (x86-64 with
+// glibc 2.35 or later), with a short lock per CPU otherwise
+alloc_status
+mem_pool_enable_cpu_cache(pool_pt pool);
+
+// gives the calling thread's (or the current CPU's) cached blocks back to
+// the pool
+alloc_status
+mem_pool_flush_cache(pool_pt pool);
+
+// file-backed pool: the pool memory and all of its metadata live in the file
+// at path, which is created with the given size if it is empty, and reopened
+// with every allocation intact otherwise (size 0 accepts the stored size, and
+// the policy has to be the stored one)
+// note: closing a file-backed pool keeps its allocations
+pool_pt
+mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+
+pool_pt
+mem_ctx_pool_open_file(mem_ctx_pt ctx, const char *path, size_t size, alloc_policy policy);
+
+// shared pool: like a file-backed pool, but in the POSIX shared memory object
+// name, which any number of processes can have open at the same time
+// note: alloc->mem is the address in the process that made the allocation,
+// other processes should go by offsets into pool->mem (see mem_pool_alloc_at)
+// note: shm_unlink(name) removes the pool once every process has closed it
+pool_pt
+mem_pool_open_shm(const char *name, size_t size, alloc_policy policy);
+
+pool_pt
+mem_ctx_pool_open_shm(mem_ctx_pt ctx, const char *name, size_t size, alloc_policy policy);
+
+// note: the allocation record stays put until it is deleted, except in
+// file-backed and shared pools, whose metadata moves as it grows (keep the
+// offset, see mem_pool_alloc_at)
 alloc_pt
 mem_new_alloc(pool_pt pool, size_t size);
 
+// note: the metadata of a pool that has become sparse shrinks back, a round
+// of growth at a time, except in file-backed and shared pools, and below
+// what mem_pool_open_ex reserved
 alloc_status
 mem_del_alloc(pool_pt pool, alloc_pt alloc);
 
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 
+// allocation record of the allocation starting at the given offset into
+// pool->mem, or NULL if there is none (e.g. to recover a reopened pool)
+alloc_pt
+mem_pool_alloc_at(pool_pt pool, size_t offset);
+
+// where the pool keeps the record of an allocation, the same in every process
+// sharing the pool, or UINT_MAX for a record that isn't one of the pool's
+unsigned
+mem_pool_alloc_ix(pool_pt pool, alloc_pt alloc);
+
+// deletes the allocation at the given offset into pool->mem in O(1), by where
+// its record is kept (see mem_pool_alloc_ix), e.g. in another process
+alloc_status
+mem_del_alloc_ix(pool_pt pool, unsigned ix, size_t offset);
+
+// writes a snapshot of the pool (its segments and the contents of its
+// allocations, but not of its gaps) to fd, at the current position
+alloc_status
+mem_pool_save(pool_pt pool, int fd);
+
+// opens a new pool with the segments and contents of the snapshot at the
+// current position of fd (recover the allocations with mem_pool_alloc_at)
+pool_pt
+mem_pool_load(int fd);
+
+pool_pt
+mem_ctx_pool_load(mem_ctx_pt ctx, int fd);
+
+// slides the allocations of the pool down to the start of the pool memory,
+// in order, leaving all of its free memory in a single gap at the end, and
+// calls relocate (unless NULL) with ctx for every allocation it moves, so
+// that their owners can fix their pointers into them
+// note: the allocation records stay valid, with mem updated, and allocations
+// of pinned handles (see mem_handle_new) stay put, with gaps left before them
+// note: other threads mustn't use the pool's memory meanwhile, and relocate
+// mustn't call into the pool; not for file-backed, shared, inline or cached
+// pools
+alloc_status
+mem_pool_compact(pool_pt pool, mem_relocate_fn relocate, void *ctx);
+
+// relocatable allocation: like mem_new_alloc, but the allocation is known by a
+// handle into a table of the pool's, instead of by its record, and its memory
+// only while it is pinned, so that compaction moves it without its owner
+// taking part (pinned allocations stay put)
+// note: not for file-backed, shared, inline or cached pools
+mem_handle_t
+mem_handle_new(pool_pt pool, size_t size);
+
+// note: pinned handles can't be deleted
+alloc_status
+mem_handle_del(pool_pt pool, mem_handle_t handle);
+
+// the memory of the allocation, valid until the matching mem_handle_unpin
+// (pins nest), or NULL for a handle that isn't live
+void *
+mem_handle_pin(pool_pt pool, mem_handle_t handle);
+
+alloc_status
+mem_handle_unpin(pool_pt pool, mem_handle_t handle);
+
+// reference to an allocation: the index of its node in the pool's node heap
+// and a generation that no other allocation of the pool shares (for 2^32
+// refs), so that a ref to a deleted allocation is told apart in constant time,
+// and never mistaken for a later allocation in the same place (0 if none)
+// note: the same allocation has the same ref, which stays valid as compaction
+// moves it, and in clones of the pool
+// note: not for file-backed, shared, inline or cached pools
+mem_ref_t
+mem_ref_of(pool_pt pool, alloc_pt alloc);
+
+// mem_new_alloc, by ref
+mem_ref_t
+mem_ref_new(pool_pt pool, size_t size);
+
+// allocation record of a live ref, or NULL for a stale one
+alloc_pt
+mem_ref_resolve(pool_pt pool, mem_ref_t ref);
+
+// mem_del_alloc, by ref (a stale one fails)
+alloc_status
+mem_ref_del(pool_pt pool, mem_ref_t ref);
+
+// how fragmented the free memory of the pool is, from 0 (all in one gap) to
+// nearly 1 (in many small gaps): 1 - largest gap / free memory
+double
+mem_pool_fragmentation(pool_pt pool);
+
+// a step of incremental defragmentation: moves unpinned handle allocations
+// (see mem_handle_new) down into the tightest gaps before them that fit,
+// up to max_bytes (or a single larger allocation), and returns the bytes it
+// moved, 0 once there's nothing more to move
+// note: the handles take turns from one step to the next, so that a step
+// visits each handle once at most
+size_t
+mem_pool_defrag(pool_pt pool, size_t max_bytes);
+
+// starts a thread that defragments the pool in the background: every period,
+// it takes steps of 64 KB for a slice of time, while the pool is more than
+// 10% fragmented, releasing the pool between steps
+// note: thread-safe pools only, see mem_pool_open_mt; mem_pool_close stops it
+alloc_status
+mem_pool_defrag_start(pool_pt pool, unsigned period_ms, unsigned slice_us);
+
+alloc_status
+mem_pool_defrag_stop(pool_pt pool);
+
+// opens an independent copy of the pool, with the same allocations at the
+// same offsets, sharing the pool's pages copy-on-write until either writes
+// (pools of up to 16 KB are copied outright)
+// note: not for file-backed, shared or inline pools
+pool_pt
+mem_pool_clone(pool_pt pool);
+
 #endif //DENVER_OS_PA_C_MEM_POOL_H
@@ -2,8 +2,18 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _GNU_SOURCE // for mkstemp()
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -11,6 +21,7 @@
 
 #include "cmocka.h"
 #include "mem_pool.h"
+#include "mem_chan.h"
 #include "test_suite.h"
 
 
@@ -77,6 +88,33 @@ static void check_pool(pool_pt pool, const pool_segment_pt exp) {
 #endif
 }
 
+static void check_segments_consistent(pool_pt pool) {
+    pool_segment_pt segs = NULL;
+    unsigned size = 0;
+    size_t total = 0;
+    unsigned num_allocs = 0, num_gaps = 0;
+
+    mem_inspect_pool(pool, &segs, &size);
+    assert_non_null(segs);
+
+    for (unsigned u = 0; u < size; u++) {
+        total += segs[u].size;
+        if (segs[u].allocated) {
+            num_allocs++;
+        } else {
+            num_gaps++;
+            // gaps are always merged
+            if (u > 0)
+                assert_true(segs[u - 1].allocated);
+        }
+    }
+    assert_int_equal(total, pool->total_size);
+    assert_int_equal(num_allocs, pool->num_allocs);
+    assert_int_equal(num_gaps, pool->num_gaps);
+
+    free(segs);
+}
+
 static void check_metadata(pool_pt pool,
                     alloc_policy policy,
                     size_t total_size,
@@ -153,6 +191,121 @@ static void test_pool_store_smoketest(void **state) {
     }
 }
 
+#define STORE_NUM_POOLS 2000
+
+static void test_pool_store_reuse(void **state) {
+    (void) state; /* unused */
+
+    static pool_pt pools[STORE_NUM_POOLS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // grow the store, then reuse its slots around a few pools that stay open
+    for (int round = 0; round < 3; round++) {
+        INFO("Opening %d pools, round %d\n", STORE_NUM_POOLS, round);
+        for (unsigned p = 0; p < STORE_NUM_POOLS; p++) {
+            if (round > 0 && p % 500 == 499)
+                continue;
+            pools[p] = mem_pool_open(64, FIRST_FIT);
+            assert_non_null(pools[p]);
+        }
+        assert_int_equal(mem_store_slots(), STORE_NUM_POOLS);
+
+        for (unsigned p = 0; p < STORE_NUM_POOLS; p++) {
+            alloc_pt alloc = mem_new_alloc(pools[p], 64);
+            assert_non_null(alloc);
+            assert_int_equal(mem_del_alloc(pools[p], alloc), ALLOC_OK);
+            if (p % 500 != 499)
+                assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+        }
+        assert_int_equal(mem_store_slots(), STORE_NUM_POOLS);
+    }
+
+    // the store shrinks back once they close
+    for (unsigned p = 499; p < STORE_NUM_POOLS; p += 500)
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    assert_true(mem_store_slots() <= STORE_NUM_POOLS / 50);
+
+    // and around pools that stay open at its bottom, the newest ones closing
+    // first
+    for (unsigned p = 0; p < STORE_NUM_POOLS; p++)
+        assert_non_null(pools[p] = mem_pool_open(64, FIRST_FIT));
+    assert_int_equal(mem_store_slots(), STORE_NUM_POOLS);
+    for (unsigned p = STORE_NUM_POOLS; p-- > 10; )
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    assert_true(mem_store_slots() <= STORE_NUM_POOLS / 50);
+    for (unsigned p = 0; p < 10; p++)
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_store_slots(), 0);
+}
+
+static void test_pool_ctx(void **state) {
+    (void) state; /* unused */
+
+    mem_ctx_pt ctx1 = mem_ctx_open();
+    mem_ctx_pt ctx2 = mem_ctx_open();
+    assert_non_null(ctx1);
+    assert_non_null(ctx2);
+
+    // contexts don't need mem_init, and outlive it
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    pool_pt pool1 = mem_ctx_pool_open(ctx1, POOL_SIZE, FIRST_FIT);
+    pool_pt pool2 = mem_ctx_pool_open_mt(ctx2, POOL_SIZE, BEST_FIT);
+    assert_non_null(pool0);
+    assert_non_null(pool1);
+    assert_non_null(pool2);
+    assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_null(mem_pool_open(POOL_SIZE, FIRST_FIT));
+
+    INFO("Using pools of two contexts\n");
+    alloc_pt alloc1 = mem_new_alloc(pool1, 100);
+    alloc_pt alloc2 = mem_new_alloc(pool2, 200);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+
+    // a clone is opened in the context of its pool
+    pool_pt clone = mem_pool_clone(pool1);
+    assert_non_null(clone);
+    assert_int_equal(mem_del_alloc(clone, mem_pool_alloc_at(clone, 0)), ALLOC_OK);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+
+    assert_int_equal(mem_del_alloc(pool1, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool2, alloc2), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool1), ALLOC_OK);
+    assert_int_equal(mem_ctx_close(ctx1), ALLOC_OK);
+
+    // the other context is unaffected
+    pool_pt pool3 = mem_ctx_pool_open(ctx2, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool3);
+    assert_int_equal(mem_pool_close(pool3), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool2), ALLOC_OK);
+    assert_int_equal(mem_ctx_close(ctx2), ALLOC_OK);
+
+    // pools left open outlive mem_free and their context, and still close
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool0);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool4 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool4);
+    assert_null(mem_pool_clone(pool0));
+    assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool4), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+
+    ctx1 = mem_ctx_open();
+    assert_non_null(ctx1);
+    pool1 = mem_ctx_pool_open_mt(ctx1, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool1);
+    assert_int_equal(mem_ctx_close(ctx1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool1), ALLOC_OK);
+}
+
 static void test_pool_smoketest(void **state) {
     (void) state; /* unused */
 
@@ -462,6 +615,802 @@ static void test_pool_bf_metadata(void **state) {
 }
 
 
+static void test_pool_alloc_records(void **state) {
+    (void) state; /* unused */
+
+    alloc_pt allocs[3];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    allocs[0] = mem_new_alloc(pool, 100);
+    allocs[1] = mem_new_alloc(pool, 200);
+    allocs[2] = mem_new_alloc(pool, 300);
+
+    // the record of an allocation is the same however it is looked up
+    size_t offset = 0;
+    for (unsigned u = 0; u < 3; u++) {
+        assert_non_null(allocs[u]);
+        assert_ptr_equal(allocs[u]->mem, pool->mem + offset);
+        assert_int_equal(allocs[u]->size, 100 * (u + 1));
+        assert_ptr_equal(mem_pool_alloc_at(pool, offset), allocs[u]);
+        offset += allocs[u]->size;
+    }
+    assert_null(mem_pool_alloc_at(pool, 50));
+    assert_null(mem_pool_alloc_at(pool, offset));
+
+    // and goes away with it
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_null(mem_pool_alloc_at(pool, 100));
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_FAIL);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define STABLE_NUM_ALLOCS 1000
+
+static void test_pool_stable_records(void **state) {
+    (void) state; /* unused */
+
+    alloc_pt allocs[STABLE_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    // enough allocations for the node heap to grow several times
+    for (unsigned u = 0; u < STABLE_NUM_ALLOCS; u++) {
+        allocs[u] = mem_new_alloc(pool, 10);
+        assert_non_null(allocs[u]);
+    }
+
+    // and the records handed out before it grew are still the ones
+    for (unsigned u = 0; u < STABLE_NUM_ALLOCS; u++) {
+        assert_ptr_equal(allocs[u]->mem, pool->mem + 10 * u);
+        assert_int_equal(allocs[u]->size, 10);
+        assert_ptr_equal(mem_pool_alloc_at(pool, 10 * u), allocs[u]);
+    }
+    for (unsigned u = 0; u < STABLE_NUM_ALLOCS; u++)
+        assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_inline(void **state) {
+    (void) state; /* unused */
+
+    alloc_policy policies[] = { FIRST_FIT, BEST_FIT };
+    size_t sizes[] = { 300, 100, 200, 100 };
+    alloc_pt allocs[4];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // too small for a single block
+    assert_null(mem_pool_open_inline(16, FIRST_FIT));
+
+    for (unsigned p = 0; p < 2; p++) {
+        pool_pt pool = mem_pool_open_inline(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+        check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+
+        // the records are in the pool, in front of their allocations
+        for (unsigned u = 0; u < 4; u++) {
+            allocs[u] = mem_new_alloc(pool, sizes[u]);
+            assert_non_null(allocs[u]);
+            assert_int_equal(allocs[u]->size, sizes[u]);
+            assert_true((char *) allocs[u] >= pool->mem && allocs[u]->mem > (char *) allocs[u]);
+            assert_true(allocs[u]->mem + sizes[u] <= pool->mem + POOL_SIZE);
+            assert_ptr_equal(mem_pool_alloc_at(pool, allocs[u]->mem - pool->mem), allocs[u]);
+            memset(allocs[u]->mem, 'a' + (int) u, sizes[u]);
+        }
+        check_segments_consistent(pool);
+        check_metadata(pool, policies[p], POOL_SIZE, 700, 4, 1);
+
+        // two gaps in front of the one at the end, and no second delete
+        alloc_t first = *allocs[0], third = *allocs[2];
+        assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_FAIL);
+        assert_null(mem_pool_alloc_at(pool, third.mem - pool->mem));
+        check_segments_consistent(pool);
+        check_metadata(pool, policies[p], POOL_SIZE, 200, 2, 3);
+
+        // both fit: FIRST_FIT takes the first, BEST_FIT the smaller one
+        alloc_pt alloc = mem_new_alloc(pool, 150);
+        assert_non_null(alloc);
+        assert_ptr_equal(alloc->mem, (policies[p] == FIRST_FIT) ? first.mem : third.mem);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+        // the neighbours merge on either side, and the rest is left alone
+        assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+        check_segments_consistent(pool);
+        check_metadata(pool, policies[p], POOL_SIZE, 100, 1, 2);
+        for (unsigned u = 0; u < sizes[3]; u++)
+            assert_int_equal(allocs[3]->mem[u], 'd');
+        assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+        check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+
+        // inline pools have their records in the pool memory, which the
+        // snapshots and clones don't carry
+        assert_null(mem_pool_clone(pool));
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_open_in(void **state) {
+    (void) state; /* unused */
+
+    static char buffer[8192];
+
+    // too small for the mgr and a block
+    assert_null(mem_pool_open_in(buffer, 64, FIRST_FIT));
+    assert_null(mem_pool_open_in(NULL, sizeof(buffer), FIRST_FIT));
+
+    // no mem_init: the pool is all in the buffer, even at an odd address
+    pool_pt pool = mem_pool_open_in(buffer + 1, sizeof(buffer) - 1, BEST_FIT);
+    assert_non_null(pool);
+    assert_true((char *) pool > buffer && pool->mem > (char *) pool);
+    assert_true(pool->mem + pool->total_size == buffer + sizeof(buffer));
+    assert_true(pool->total_size > sizeof(buffer) / 2);
+    check_metadata(pool, BEST_FIT, pool->total_size, 0, 0, 1);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 1000);
+    alloc_pt alloc1 = mem_new_alloc(pool, 2000);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_true((char *) alloc0 > buffer && alloc1->mem + 2000 <= buffer + sizeof(buffer));
+    memset(alloc0->mem, 0, 1000);
+    memset(alloc1->mem, 1, 2000);
+    assert_null(mem_new_alloc(pool, sizeof(buffer)));
+    check_segments_consistent(pool);
+    check_metadata(pool, BEST_FIT, pool->total_size, 3000, 2, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, BEST_FIT, pool->total_size, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // the buffer can be used again right away
+    pool = mem_pool_open_in(buffer, sizeof(buffer), FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, pool->total_size, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+}
+
+
+#define EX_NUM_ALLOCS 5000
+
+static void test_pool_open_ex(void **state) {
+    (void) state; /* unused */
+
+    pool_config_t bad[] = {
+        { .fill_factor = 1 },
+        { .expand_factor = 1 },
+        { .expand_factor = 17 },
+        { .flags = POOL_CACHE },
+        { .flags = POOL_MT | POOL_CACHE | POOL_CPU_CACHE },
+        { .flags = 32 },
+        { .expected_allocs = 2100000000, .expand_factor = 2 },
+        { .expected_allocs = UINT_MAX / 2 },
+        { .expected_allocs = 1500000000, .fill_factor = 0.5f },
+    };
+    alloc_pt allocs[EX_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned u = 0; u < sizeof(bad) / sizeof(bad[0]); u++)
+        assert_null(mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &bad[u]));
+
+    // no config is no different from mem_pool_open
+    pool_pt pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, NULL);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // metadata for the expected allocations and gaps from the start: none
+    // of them allocates
+    pool_config_t config = { .expected_allocs = EX_NUM_ALLOCS };
+    pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &config);
+    assert_non_null(pool);
+    size_t before = mallinfo2().uordblks;
+    for (unsigned u = 0; u < EX_NUM_ALLOCS; u++)
+        assert_non_null(allocs[u] = mem_new_alloc(pool, 100));
+    for (unsigned u = 0; u < EX_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+    assert_int_equal(mallinfo2().uordblks, before);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100 * EX_NUM_ALLOCS / 2, EX_NUM_ALLOCS / 2, EX_NUM_ALLOCS / 2 + 1);
+    for (unsigned u = 1; u < EX_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // other growth factors, and features
+    pool_config_t configs[] = {
+        { .fill_factor = 0.95f, .expand_factor = 16 },
+        { .fill_factor = 0.1f, .flags = POOL_MT | POOL_CPU_CACHE },
+        { .expected_allocs = 100, .flags = POOL_MT | POOL_INLINE | POOL_CACHE },
+    };
+    for (unsigned c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, &configs[c]);
+        assert_non_null(pool);
+        for (unsigned u = 0; u < 1000; u++)
+            assert_non_null(allocs[u] = mem_new_alloc(pool, (u % 2) ? 64 : 900));
+        for (unsigned u = 0; u < 1000; u++)
+            assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+        assert_int_equal(mem_pool_flush_cache(pool), (configs[c].flags & POOL_MT) ? ALLOC_OK : ALLOC_FAIL);
+        check_segments_consistent(pool);
+        check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define RT_MAX_SEGMENTS 500
+#define RT_NUM_OPS 20000
+
+static void test_pool_realtime(void **state) {
+    (void) state; /* unused */
+
+    pool_config_t bad[] = {
+        { .flags = POOL_REALTIME },
+        { .max_segments = 100, .flags = POOL_REALTIME | POOL_INLINE },
+        { .max_segments = 100, .flags = POOL_REALTIME | POOL_MT | POOL_CACHE },
+        { .max_segments = UINT_MAX - 1, .flags = POOL_REALTIME },
+        { .max_segments = 2100000000, .flags = POOL_REALTIME },
+    };
+    alloc_policy policies[] = { FIRST_FIT, BEST_FIT };
+    alloc_pt held[RT_MAX_SEGMENTS] = { NULL };
+    unsigned seed = 45;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned u = 0; u < sizeof(bad) / sizeof(bad[0]); u++)
+        assert_null(mem_pool_open_ex(POOL_SIZE, FIRST_FIT, &bad[u]));
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_int_equal(mem_pool_worst_case(pool), 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    for (unsigned p = 0; p < 2; p++) {
+        pool_config_t config = { .max_segments = RT_MAX_SEGMENTS, .flags = POOL_REALTIME };
+        pool = mem_pool_open_ex(POOL_SIZE, policies[p], &config);
+        assert_non_null(pool);
+        size_t worst_case = mem_pool_worst_case(pool);
+        assert_true(worst_case > 0);
+
+        // random churn up to the cap and over it: no allocations, and no
+        // operation over the worst case
+        size_t before = mallinfo2().uordblks;
+        for (unsigned u = 0; u < RT_NUM_OPS; u++) {
+            unsigned slot = rand_r(&seed) % RT_MAX_SEGMENTS;
+            if (held[slot] != NULL) {
+                assert_int_equal(mem_del_alloc(pool, held[slot]), ALLOC_OK);
+                held[slot] = NULL;
+            } else {
+                held[slot] = mem_new_alloc(pool, 1 + rand_r(&seed) % 1000);
+            }
+            assert_true(mem_pool_last_cost(pool) <= worst_case);
+        }
+        assert_int_equal(mallinfo2().uordblks, before);
+
+        pool_segment_pt segments = NULL;
+        unsigned num_segments = 0;
+        mem_inspect_pool(pool, &segments, &num_segments);
+        assert_true(num_segments <= RT_MAX_SEGMENTS);
+        free(segments);
+        check_segments_consistent(pool);
+
+        for (unsigned u = 0; u < RT_MAX_SEGMENTS; u++) {
+            if (held[u] != NULL)
+                assert_int_equal(mem_del_alloc(pool, held[u]), ALLOC_OK);
+            held[u] = NULL;
+        }
+        check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    // at the cap, allocations that would leave a gap fail, and exact fits don't
+    pool_config_t config = { .max_segments = 8, .flags = POOL_REALTIME };
+    pool = mem_pool_open_ex(POOL_SIZE, BEST_FIT, &config);
+    assert_non_null(pool);
+    for (unsigned u = 0; u < 7; u++)
+        assert_non_null(held[u] = mem_new_alloc(pool, 100));
+    assert_null(mem_new_alloc(pool, 100));
+    assert_non_null(held[7] = mem_new_alloc(pool, POOL_SIZE - 700));
+    assert_int_equal(mem_del_alloc(pool, held[3]), ALLOC_OK);
+    assert_null(mem_new_alloc(pool, 50));
+    assert_non_null(held[3] = mem_new_alloc(pool, 100));
+    check_metadata(pool, BEST_FIT, POOL_SIZE, POOL_SIZE, 8, 0);
+    for (unsigned u = 0; u < 8; u++)
+        assert_int_equal(mem_del_alloc(pool, held[u]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define SHRINK_NUM_ALLOCS 20000
+
+static void test_pool_meta_shrink(void **state) {
+    (void) state; /* unused */
+
+    alloc_policy policies[] = { FIRST_FIT, BEST_FIT };
+    alloc_pt allocs[SHRINK_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned p = 0; p < 2; p++) {
+        pool_pt pool = mem_pool_open(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+        size_t base = mallinfo2().uordblks;
+
+        for (unsigned round = 0; round < 2; round++) {
+            for (unsigned u = 0; u < SHRINK_NUM_ALLOCS; u++)
+                assert_non_null(allocs[u] = mem_new_alloc(pool, 16));
+            size_t peak = mallinfo2().uordblks;
+
+            // a gap on a node past all the others, which has to move down
+            // for the node heap to shrink
+            assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK);
+            assert_non_null(allocs[5] = mem_new_alloc(pool, 8));
+
+            // thousands of gaps, then down to a few segments
+            for (unsigned u = 6; u < SHRINK_NUM_ALLOCS; u += 2)
+                assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+            for (unsigned u = SHRINK_NUM_ALLOCS - 1; u > 6; u -= 2)
+                assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+            check_segments_consistent(pool);
+            check_metadata(pool, policies[p], POOL_SIZE, 16 * 5 + 8, 6, 1);
+            assert_true(mallinfo2().uordblks <= base + (peak - base) / 20);
+
+            // the metadata grows back as needed
+            assert_non_null(mem_new_alloc(pool, 8));
+            for (unsigned u = 0; u < 6; u++)
+                assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+            assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, 16 * 5 + 8)), ALLOC_OK);
+            check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+        }
+
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define COMPACT_NUM_ALLOCS 300
+
+typedef struct _compact_owners {
+    char *mem[COMPACT_NUM_ALLOCS];
+    unsigned moves;
+} compact_owners_t;
+
+static void compact_relocate(void *old_mem, void *new_mem, size_t size, void *ctx) {
+    compact_owners_t *owners = ctx;
+
+    assert_true((char *) new_mem < (char *) old_mem);
+    for (unsigned u = 0; u < COMPACT_NUM_ALLOCS; u++) {
+        if (owners->mem[u] == old_mem) {
+            assert_int_equal(((char *) new_mem)[0], (char) u);
+            assert_int_equal(((char *) new_mem)[size - 1], (char) u);
+            owners->mem[u] = new_mem;
+        }
+    }
+    owners->moves++;
+}
+
+static void test_pool_compact(void **state) {
+    (void) state; /* unused */
+
+    alloc_policy policies[] = { FIRST_FIT, BEST_FIT };
+    alloc_pt allocs[COMPACT_NUM_ALLOCS];
+    compact_owners_t owners;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_int_equal(mem_pool_compact(NULL, NULL, NULL), ALLOC_FAIL);
+    pool_pt pool = mem_pool_open_inline(POOL_SIZE, FIRST_FIT);
+    assert_int_equal(mem_pool_compact(pool, NULL, NULL), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    for (unsigned p = 0; p < 2; p++) {
+        pool = mem_pool_open(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+
+        // allocations of varied sizes, with every third deleted, starting
+        // with the first, so that the pool starts with a gap
+        size_t alloc_size = 0;
+        unsigned num_allocs = 0;
+        for (unsigned u = 0; u < COMPACT_NUM_ALLOCS; u++) {
+            size_t size = 10 + (u * 37) % 500;
+            assert_non_null(allocs[u] = mem_new_alloc(pool, size));
+            memset(allocs[u]->mem, (char) u, size);
+        }
+        for (unsigned u = 0; u < COMPACT_NUM_ALLOCS; u++) {
+            if (u % 3 == 0) {
+                assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+                allocs[u] = NULL;
+                owners.mem[u] = NULL;
+            } else {
+                owners.mem[u] = allocs[u]->mem;
+                alloc_size += allocs[u]->size;
+                num_allocs++;
+            }
+        }
+        owners.moves = 0;
+
+        // every allocation moves, down to the start, in order, with its
+        // record and its owner following it
+        assert_int_equal(mem_pool_compact(pool, compact_relocate, &owners), ALLOC_OK);
+        assert_int_equal(owners.moves, num_allocs);
+        check_segments_consistent(pool);
+        check_metadata(pool, policies[p], POOL_SIZE, alloc_size, num_allocs, 1);
+        size_t offset = 0;
+        for (unsigned u = 0; u < COMPACT_NUM_ALLOCS; u++) {
+            if (allocs[u] == NULL)
+                continue;
+            assert_ptr_equal(allocs[u]->mem, pool->mem + offset);
+            assert_ptr_equal(owners.mem[u], allocs[u]->mem);
+            assert_ptr_equal(mem_pool_alloc_at(pool, offset), allocs[u]);
+            for (size_t i = 0; i < allocs[u]->size; i++)
+                assert_int_equal(allocs[u]->mem[i], (char) u);
+            offset += allocs[u]->size;
+        }
+
+        // nothing left to move
+        assert_int_equal(mem_pool_compact(pool, compact_relocate, &owners), ALLOC_OK);
+        assert_int_equal(owners.moves, num_allocs);
+
+        // the rest of the pool is in one piece, and the pool carries on
+        alloc_pt rest = mem_new_alloc(pool, POOL_SIZE - alloc_size);
+        assert_non_null(rest);
+        assert_ptr_equal(rest->mem, pool->mem + alloc_size);
+        assert_int_equal(mem_del_alloc(pool, rest), ALLOC_OK);
+        for (unsigned u = 0; u < COMPACT_NUM_ALLOCS; u++)
+            if (allocs[u] != NULL)
+                assert_int_equal(mem_del_alloc(pool, allocs[u]), ALLOC_OK);
+        check_metadata(pool, policies[p], POOL_SIZE, 0, 0, 1);
+
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define HANDLE_NUM_ALLOCS 200
+
+static void test_pool_handles(void **state) {
+    (void) state; /* unused */
+
+    mem_handle_t handles[HANDLE_NUM_ALLOCS];
+    size_t sizes[HANDLE_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_inline(POOL_SIZE, FIRST_FIT);
+    assert_int_equal(mem_handle_new(pool, 100), 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    assert_null(mem_handle_pin(pool, 0));
+    assert_null(mem_handle_pin(pool, 1));
+
+    for (unsigned u = 0; u < HANDLE_NUM_ALLOCS; u++) {
+        sizes[u] = 20 + (u * 53) % 700;
+        handles[u] = mem_handle_new(pool, sizes[u]);
+        assert_int_not_equal(handles[u], 0);
+        char *mem = mem_handle_pin(pool, handles[u]);
+        assert_non_null(mem);
+        memset(mem, (char) u, sizes[u]);
+        assert_int_equal(mem_handle_unpin(pool, handles[u]), ALLOC_OK);
+    }
+    assert_int_equal(mem_handle_unpin(pool, handles[0]), ALLOC_FAIL);
+
+    // every other one goes, and a handle that goes is reused
+    for (unsigned u = 0; u < HANDLE_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_handle_del(pool, handles[u]), ALLOC_OK);
+    assert_null(mem_handle_pin(pool, handles[0]));
+    assert_int_equal(mem_handle_del(pool, handles[0]), ALLOC_FAIL);
+    mem_handle_t reused = mem_handle_new(pool, 10);
+    assert_int_equal(reused, handles[HANDLE_NUM_ALLOCS - 2]);
+    assert_int_equal(mem_handle_del(pool, reused), ALLOC_OK);
+
+    // compaction moves the others, but for the pinned ones
+    unsigned pinned[] = { 51, 121 };
+    char *pinned_mem[2];
+    for (unsigned i = 0; i < 2; i++)
+        pinned_mem[i] = mem_handle_pin(pool, handles[pinned[i]]);
+    assert_int_equal(mem_handle_del(pool, handles[pinned[0]]), ALLOC_FAIL);
+    assert_int_equal(mem_pool_compact(pool, NULL, NULL), ALLOC_OK);
+    check_segments_consistent(pool);
+    assert_true(pool->num_gaps <= 3);
+    for (unsigned i = 0; i < 2; i++) {
+        assert_ptr_equal(mem_handle_pin(pool, handles[pinned[i]]), pinned_mem[i]);
+        assert_int_equal(mem_handle_unpin(pool, handles[pinned[i]]), ALLOC_OK);
+        assert_int_equal(mem_handle_unpin(pool, handles[pinned[i]]), ALLOC_OK);
+    }
+    assert_ptr_equal(mem_handle_pin(pool, handles[1]), pool->mem);
+    assert_int_equal(mem_handle_unpin(pool, handles[1]), ALLOC_OK);
+
+    // and a clone has the same handles, to its own copies
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    for (unsigned u = 1; u < HANDLE_NUM_ALLOCS; u += 2) {
+        char *mem = mem_handle_pin(pool, handles[u]);
+        char *clone_mem = mem_handle_pin(clone, handles[u]);
+        assert_ptr_equal(clone_mem - clone->mem, mem - pool->mem);
+        for (size_t i = 0; i < sizes[u]; i++)
+            assert_int_equal(clone_mem[i], (char) u);
+        assert_int_equal(mem_handle_unpin(clone, handles[u]), ALLOC_OK);
+        assert_int_equal(mem_handle_del(clone, handles[u]), ALLOC_OK);
+        assert_int_equal(mem_handle_unpin(pool, handles[u]), ALLOC_OK);
+        assert_int_equal(mem_handle_del(pool, handles[u]), ALLOC_OK);
+    }
+    check_metadata(clone, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define DEFRAG_NUM_ALLOCS 400
+
+// size of a pool that defrag_fill fills up
+static size_t defrag_pool_size(void) {
+    size_t size = 0;
+    for (unsigned u = 0; u < DEFRAG_NUM_ALLOCS; u++)
+        size += 16 + (u * 71) % 900;
+    return size;
+}
+
+// fragments a pool with handles, every other one deleted
+static void defrag_fill(pool_pt pool, mem_handle_t *handles, size_t *sizes) {
+    for (unsigned u = 0; u < DEFRAG_NUM_ALLOCS; u++) {
+        sizes[u] = 16 + (u * 71) % 900;
+        handles[u] = mem_handle_new(pool, sizes[u]);
+        assert_int_not_equal(handles[u], 0);
+        memset(mem_handle_pin(pool, handles[u]), (char) u, sizes[u]);
+        assert_int_equal(mem_handle_unpin(pool, handles[u]), ALLOC_OK);
+    }
+    for (unsigned u = 0; u < DEFRAG_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_handle_del(pool, handles[u]), ALLOC_OK);
+}
+
+// checks the contents of the handles left by defrag_fill, and deletes them
+static void defrag_check(pool_pt pool, mem_handle_t *handles, size_t *sizes) {
+    check_segments_consistent(pool);
+    for (unsigned u = 1; u < DEFRAG_NUM_ALLOCS; u += 2) {
+        char *mem = mem_handle_pin(pool, handles[u]);
+        assert_non_null(mem);
+        for (size_t i = 0; i < sizes[u]; i++)
+            assert_int_equal(mem[i], (char) u);
+        assert_int_equal(mem_handle_unpin(pool, handles[u]), ALLOC_OK);
+        assert_int_equal(mem_handle_del(pool, handles[u]), ALLOC_OK);
+    }
+    check_metadata(pool, pool->policy, defrag_pool_size(), 0, 0, 1);
+}
+
+static void test_pool_defrag(void **state) {
+    (void) state; /* unused */
+
+    mem_handle_t handles[DEFRAG_NUM_ALLOCS];
+    size_t sizes[DEFRAG_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // steps of a bounded number of bytes, down to nothing to move, around a
+    // pinned handle
+    pool_pt pool = mem_pool_open(defrag_pool_size(), FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_defrag_start(pool, 1, 1000), ALLOC_FAIL);
+    assert_int_equal(mem_pool_defrag_stop(pool), ALLOC_FAIL);
+    defrag_fill(pool, handles, sizes);
+    char *pinned = mem_handle_pin(pool, handles[101]);
+    double before = mem_pool_fragmentation(pool);
+    assert_true(before > 0.5);
+    size_t moved;
+    unsigned steps = 0;
+    while ((moved = mem_pool_defrag(pool, 2000)) > 0) {
+        assert_true(moved <= 2000 || steps == 0 || moved <= 900);
+        check_segments_consistent(pool);
+        steps++;
+    }
+    assert_true(steps > 1);
+    assert_true(mem_pool_fragmentation(pool) < before / 2);
+    assert_ptr_equal(mem_handle_pin(pool, handles[101]), pinned);
+    assert_int_equal(mem_handle_unpin(pool, handles[101]), ALLOC_OK);
+    assert_int_equal(mem_handle_unpin(pool, handles[101]), ALLOC_OK);
+    defrag_check(pool, handles, sizes);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // in the background, with the pool in use meanwhile
+    pool = mem_pool_open_mt(defrag_pool_size(), BEST_FIT);
+    assert_non_null(pool);
+    defrag_fill(pool, handles, sizes);
+    assert_int_equal(mem_pool_defrag_start(pool, 1, 500), ALLOC_OK);
+    assert_int_equal(mem_pool_defrag_start(pool, 1, 500), ALLOC_FAIL);
+    for (unsigned round = 0; round < 2000 && mem_pool_fragmentation(pool) > 0.1; round++) {
+        unsigned u = 1 + 2 * (round % (DEFRAG_NUM_ALLOCS / 2));
+        char *mem = mem_handle_pin(pool, handles[u]);
+        assert_int_equal(mem[0], (char) u);
+        assert_int_equal(mem[sizes[u] - 1], (char) u);
+        assert_int_equal(mem_handle_unpin(pool, handles[u]), ALLOC_OK);
+        usleep(1000);
+    }
+    assert_true(mem_pool_fragmentation(pool) <= 0.1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_pool_defrag_stop(pool), ALLOC_OK);
+    defrag_check(pool, handles, sizes);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#define REF_NUM_ALLOCS 200
+
+static void test_pool_refs(void **state) {
+    (void) state; /* unused */
+
+    mem_ref_t refs[REF_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_inline(POOL_SIZE, FIRST_FIT);
+    assert_int_equal(mem_ref_new(pool, 100), 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_null(mem_ref_resolve(pool, 0));
+    assert_null(mem_ref_resolve(pool, (mem_ref_t) 1 << 32 | 1));
+
+    // refs to allocations of their own, over a growing node heap
+    alloc_pt first = mem_new_alloc(pool, 100);
+    assert_non_null(first);
+    for (unsigned u = 0; u < REF_NUM_ALLOCS; u++) {
+        refs[u] = mem_ref_new(pool, 10 + u);
+        assert_int_not_equal(refs[u], 0);
+        alloc_pt alloc = mem_ref_resolve(pool, refs[u]);
+        assert_non_null(alloc);
+        assert_int_equal(alloc->size, 10 + u);
+        assert_int_equal(mem_ref_of(pool, alloc), refs[u]);
+    }
+    mem_ref_t first_ref = mem_ref_of(pool, first);
+    assert_int_not_equal(first_ref, 0);
+    assert_ptr_equal(mem_ref_resolve(pool, first_ref), first);
+    assert_int_equal(mem_ref_of(pool, NULL), 0);
+    assert_int_equal(mem_pool_enable_cache(pool), ALLOC_FAIL);
+
+    // a deleted allocation's ref goes stale, by either delete, and stays
+    // stale once its node is reused
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_null(mem_ref_resolve(pool, first_ref));
+    assert_int_equal(mem_ref_del(pool, first_ref), ALLOC_FAIL);
+    for (unsigned u = 0; u < REF_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_ref_del(pool, refs[u]), ALLOC_OK);
+    assert_int_equal(mem_ref_del(pool, refs[0]), ALLOC_FAIL);
+    mem_ref_t reused = mem_ref_new(pool, 10);
+    assert_int_not_equal(reused, 0);
+    mem_ref_t stale = first_ref;
+    for (unsigned u = 0; u < REF_NUM_ALLOCS; u += 2)
+        if ((refs[u] & 0xffffffffu) == (reused & 0xffffffffu))
+            stale = refs[u];
+    assert_int_equal(reused & 0xffffffffu, stale & 0xffffffffu);
+    assert_int_not_equal(reused, stale);
+    assert_null(mem_ref_resolve(pool, stale));
+    assert_int_equal(mem_ref_del(pool, reused), ALLOC_OK);
+
+    // compaction moves the allocations, not their refs
+    assert_int_equal(mem_pool_compact(pool, NULL, NULL), ALLOC_OK);
+    check_segments_consistent(pool);
+    assert_ptr_equal(mem_ref_resolve(pool, refs[1])->mem, pool->mem);
+
+    // and a clone has the same refs, to its own copies
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    for (unsigned u = 1; u < REF_NUM_ALLOCS; u += 2) {
+        alloc_pt alloc = mem_ref_resolve(pool, refs[u]);
+        alloc_pt clone_alloc = mem_ref_resolve(clone, refs[u]);
+        assert_non_null(clone_alloc);
+        assert_int_equal(clone_alloc->mem - clone->mem, alloc->mem - pool->mem);
+        assert_int_equal(mem_ref_del(clone, refs[u]), ALLOC_OK);
+        assert_int_equal(mem_ref_del(pool, refs[u]), ALLOC_OK);
+        assert_null(mem_ref_resolve(pool, refs[u]));
+    }
+    check_metadata(clone, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define FIT_NUM_BLOCKS 300
+
+static void test_pool_fit_search(void **state) {
+    (void) state; /* unused */
+
+    alloc_policy policies[] = { FIRST_FIT, BEST_FIT };
+    size_t offsets[FIT_NUM_BLOCKS];
+    size_t sizes[FIT_NUM_BLOCKS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned p = 0; p < 2; p++) {
+        pool_pt pool = mem_pool_open(POOL_SIZE, policies[p]);
+        assert_non_null(pool);
+
+        // blocks of varied sizes, every other one deleted: gaps that can't
+        // merge, spread over a node heap much wider than a vector
+        size_t offset = 0;
+        for (unsigned u = 0; u < FIT_NUM_BLOCKS; u++) {
+            sizes[u] = 8 * (u % 11 + 1) + (u * 7) % 5;
+            offsets[u] = offset;
+            assert_non_null(mem_new_alloc(pool, sizes[u]));
+            offset += sizes[u];
+        }
+        for (unsigned u = 0; u < FIT_NUM_BLOCKS; u += 2)
+            assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offsets[u])), ALLOC_OK);
+
+        // FIRST_FIT takes the first gap that fits, BEST_FIT the smallest
+        // (the first of the smallest), and the end of the pool if none does
+        for (size_t size = 1; size <= 100; size += 3) {
+            size_t expected = offset;
+            size_t best = POOL_SIZE;
+            for (unsigned u = 0; u < FIT_NUM_BLOCKS; u += 2) {
+                if (sizes[u] < size)
+                    continue;
+                if (policies[p] == FIRST_FIT) {
+                    expected = offsets[u];
+                    break;
+                }
+                if (sizes[u] < best) {
+                    best = sizes[u];
+                    expected = offsets[u];
+                }
+            }
+
+            alloc_pt alloc = mem_new_alloc(pool, size);
+            assert_non_null(alloc);
+            assert_int_equal(alloc->mem - pool->mem, expected);
+            assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        }
+
+        // and sizes no gap can have fail, leaving the pool as it is
+        size_t huge[] = { (SIZE_MAX >> 1) + 6, SIZE_MAX };
+        size_t alloc_size = pool->alloc_size;
+        for (unsigned i = 0; i < 2; i++) {
+            assert_null(mem_new_alloc(pool, huge[i]));
+            assert_int_equal(pool->num_allocs, FIT_NUM_BLOCKS / 2);
+            assert_int_equal(pool->alloc_size, alloc_size);
+        }
+
+        for (unsigned u = 1; u < FIT_NUM_BLOCKS; u += 2)
+            assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offsets[u])), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
 /*******************************************/
 /***       3. FIRST_FIT SCENARIOS        ***/
 /*******************************************/
@@ -2408,18 +3357,991 @@ void test_pool_stresstest(void **state) {
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***        6. FILE-BACKED POOLS         ***/
+/*******************************************/
+
+static void test_pool_file_reopen(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocs = 100;
+    size_t offsets[num_allocs];
+    pool_segment_pt segs = NULL, reopened_segs = NULL;
+    unsigned num_segs = 0, num_reopened_segs = 0;
+
+    char path[] = "/tmp/mem_pool_file_XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Opening file-backed pool %s\n", path);
+    pool_pt pool = mem_pool_open_file(path, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    // only one process (or open) at a time
+    assert_null(mem_pool_open_file(path, POOL_SIZE, FIRST_FIT));
+
+    // enough allocations to grow the node heap and the gap index
+    // note: records move when the metadata grows, so keep the offsets
+    for (unsigned u = 0; u < num_allocs; u++) {
+        alloc_pt alloc = mem_new_alloc(pool, 100 + u);
+        assert_non_null(alloc);
+        memset(alloc->mem, (int) u, alloc->size);
+        offsets[u] = alloc->mem - pool->mem;
+    }
+    for (unsigned u = 0; u < num_allocs; u += 2) {
+        alloc_pt alloc = mem_pool_alloc_at(pool, offsets[u]);
+        assert_non_null(alloc);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 7500, 50, 51);
+    mem_inspect_pool(pool, &segs, &num_segs);
+
+    INFO("Closing and reopening file-backed pool\n");
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_null(mem_pool_open_file(path, 0, BEST_FIT));
+    pool = mem_pool_open_file(path, 0, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 7500, 50, 51);
+
+    mem_inspect_pool(pool, &reopened_segs, &num_reopened_segs);
+    assert_int_equal(num_segs, num_reopened_segs);
+    assert_memory_equal(segs, reopened_segs, num_segs * sizeof(pool_segment_t));
+    free(segs);
+    free(reopened_segs);
+
+    // every surviving allocation is back, contents included
+    for (unsigned u = 0; u < num_allocs; u++) {
+        alloc_pt alloc = mem_pool_alloc_at(pool, offsets[u]);
+        if (u % 2 == 0) {
+            assert_null(alloc);
+            continue;
+        }
+        assert_non_null(alloc);
+        assert_true(alloc->mem == pool->mem + offsets[u]);
+        assert_int_equal(alloc->size, 100 + u);
+        assert_int_equal(alloc->mem[0], (char) u);
+        assert_int_equal(alloc->mem[alloc->size - 1], (char) u);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    unlink(path);
+}
+
+
+/*******************************************/
+/***          7. SHARED POOLS            ***/
+/*******************************************/
+
+static void test_pool_shm_processes(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_procs = 4;
+    const unsigned num_iterations = 200;
+    char name[64];
+    int fds[2];
+
+    snprintf(name, sizeof(name), "/mem_pool_test_%d", (int) getpid());
+    shm_unlink(name);
+    assert_int_equal(pipe(fds), 0);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Opening shared pool %s\n", name);
+    pool_pt pool = mem_pool_open_shm(name, POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Allocating from %u processes\n", num_procs);
+    for (unsigned p = 0; p < num_procs; p++) {
+        pid_t pid = fork();
+        assert_true(pid >= 0);
+        if (pid == 0) {
+            // attach on our own, then churn and leave one allocation behind
+            pool_pt child_pool = mem_pool_open_shm(name, 0, BEST_FIT);
+            if (child_pool == NULL)
+                _exit(1);
+            for (unsigned u = 0; u < num_iterations; u++) {
+                alloc_pt alloc = mem_new_alloc(child_pool, 10 + u);
+                if (alloc == NULL)
+                    _exit(2);
+                memset(alloc->mem, (int) p, alloc->size);
+                if (mem_del_alloc(child_pool, alloc) != ALLOC_OK)
+                    _exit(3);
+            }
+            alloc_pt alloc = mem_new_alloc(child_pool, 1000);
+            if (alloc == NULL)
+                _exit(4);
+            memset(alloc->mem, 'a' + (int) p, alloc->size);
+            size_t offset = alloc->mem - child_pool->mem;
+            if (write(fds[1], &offset, sizeof(offset)) != sizeof(offset))
+                _exit(5);
+            mem_pool_close(child_pool);
+            _exit(0);
+        }
+    }
+    for (unsigned p = 0; p < num_procs; p++) {
+        int status = 0;
+        wait(&status);
+        assert_true(WIFEXITED(status));
+        assert_int_equal(WEXITSTATUS(status), 0);
+    }
+
+    // the counters are picked up on the next call
+    // note: where the processes interleave, the churn can leave small gaps
+    // between the allocations, so only the allocations are certain
+    check_segments_consistent(pool);
+    assert_int_equal(pool->num_allocs, num_procs);
+    assert_int_equal(pool->alloc_size, 1000 * num_procs);
+
+    for (unsigned p = 0; p < num_procs; p++) {
+        size_t offset = 0;
+        assert_int_equal(read(fds[0], &offset, sizeof(offset)), sizeof(offset));
+        char *mem = pool->mem + offset;
+        assert_true(mem[0] >= 'a' && mem[0] < 'a' + (int) num_procs);
+        assert_int_equal(mem[999], mem[0]);
+        alloc_pt alloc = mem_pool_alloc_at(pool, offset);
+        assert_non_null(alloc);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    shm_unlink(name);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_pool_shm_robust(void **state) {
+    (void) state; /* unused */
+
+    char name[64];
+
+    snprintf(name, sizeof(name), "/mem_pool_test_%d", (int) getpid());
+    shm_unlink(name);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_shm(name, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    // a process killed in the middle of its allocations, likely holding the lock
+    INFO("Killing a process allocating from shared pool %s\n", name);
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        alloc_pt allocs[16] = { NULL };
+        for (unsigned u = 0; ; u++) {
+            if (allocs[u % 16] != NULL)
+                mem_del_alloc(pool, allocs[u % 16]);
+            allocs[u % 16] = mem_new_alloc(pool, 10 + u % 100);
+        }
+    }
+    usleep(50000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+
+    // the pool is still usable and consistent
+    check_segments_consistent(pool);
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    check_segments_consistent(pool);
+
+    // clean up whatever the dead process left behind
+    pool_segment_pt segs = NULL;
+    unsigned size = 0;
+    size_t offset = 0;
+    mem_inspect_pool(pool, &segs, &size);
+    for (unsigned u = 0; u < size; u++) {
+        if (segs[u].allocated)
+            assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offset)), ALLOC_OK);
+        offset += segs[u].size;
+    }
+    free(segs);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    shm_unlink(name);
+}
+
+
+/*******************************************/
+/***        8. MESSAGE CHANNELS          ***/
+/*******************************************/
+
+static void test_chan_capacity(void **state) {
+    (void) state; /* unused */
+
+    alloc_pt allocs[5];
+    chan_msg_t msg;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+
+    for (unsigned kind = CHAN_SPSC; kind <= CHAN_MPMC; kind++) {
+        INFO("Filling a channel of capacity 4 (%s)\n", (kind == CHAN_SPSC) ? "SPSC" : "MPMC");
+        assert_null(mem_chan_open(pool, (1u << 31) + 1, (chan_kind) kind));
+        assert_null(mem_chan_open(pool, UINT_MAX, (chan_kind) kind));
+        chan_pt chan = mem_chan_open(pool, 3, (chan_kind) kind);
+        assert_non_null(chan);
+        assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_FAIL);
+
+        for (unsigned u = 0; u < 5; u++) {
+            allocs[u] = mem_new_alloc(pool, 10 + u);
+            assert_non_null(allocs[u]);
+            allocs[u]->mem[0] = (char) u;
+        }
+        for (unsigned u = 0; u < 4; u++)
+            assert_int_equal(mem_chan_send(chan, allocs[u]), ALLOC_OK);
+        assert_int_equal(mem_chan_send(chan, allocs[4]), ALLOC_FAIL);
+
+        // messages come out in order, and wrap around the ring
+        for (unsigned u = 0; u < 12; u++) {
+            assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_OK);
+            assert_int_equal(msg.mem[0], (char) u);
+            assert_int_equal(msg.size, 10 + u);
+            assert_int_equal(mem_chan_release(chan, &msg), ALLOC_OK);
+            if (u < 8) {
+                alloc_pt alloc = mem_new_alloc(pool, 14 + u);
+                assert_non_null(alloc);
+                alloc->mem[0] = (char) (u + 4);
+                assert_int_equal(mem_chan_send(chan, alloc), ALLOC_OK);
+            }
+        }
+        assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_FAIL);
+
+        // messages go by where the pool keeps their records, which has to
+        // hold the allocation
+        alloc_t stray = { 16, pool->mem };
+        assert_int_equal(mem_chan_send(chan, &stray), ALLOC_FAIL);
+        assert_int_equal(mem_chan_send(chan, allocs[4]), ALLOC_OK);
+        assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_OK);
+        unsigned ix = msg.ix;
+        msg.ix = UINT_MAX;
+        assert_int_equal(mem_chan_release(chan, &msg), ALLOC_FAIL);
+        msg.ix = ix;
+        msg.mem++;
+        assert_int_equal(mem_chan_release(chan, &msg), ALLOC_FAIL);
+        msg.mem--;
+        assert_int_equal(mem_chan_release(chan, &msg), ALLOC_OK);
+        assert_non_null(allocs[4] = mem_new_alloc(pool, 14));
+
+        assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK);
+        assert_int_equal(mem_chan_destroy(chan), ALLOC_OK);
+        check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    }
+
+    // attaching takes a whole ring, with a capacity that fits in the pool
+    const unsigned long magic = 0x4d454d4348414e31;
+    alloc_pt fake = mem_new_alloc(pool, 1024);
+    assert_non_null(fake);
+    char *at = (char *) (((uintptr_t) fake->mem + 63) & ~(uintptr_t) 63);
+    memset(at, 0, 512);
+    memcpy(at, &magic, sizeof(magic));
+    assert_null(mem_chan_attach(pool, at - pool->mem));
+    memset(at, 0x40, 512);
+    memcpy(at, &magic, sizeof(magic));
+    assert_null(mem_chan_attach(pool, at - pool->mem));
+    assert_int_equal(mem_del_alloc(pool, fake), ALLOC_OK);
+    at = (char *) (((uintptr_t) pool->mem + POOL_SIZE - 64) & ~(uintptr_t) 63);
+    memcpy(at, &magic, sizeof(magic));
+    assert_null(mem_chan_attach(pool, at - pool->mem));
+    assert_null(mem_chan_attach(pool, POOL_SIZE));
+    memset(at, 0, sizeof(magic));
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    // the records of inline pools are found by the offset alone
+    pool = mem_pool_open_inline(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    chan_pt chan = mem_chan_open(pool, 4, CHAN_SPSC);
+    assert_non_null(chan);
+    alloc_pt alloc = mem_new_alloc(pool, 40);
+    assert_non_null(alloc);
+    assert_int_equal(mem_chan_send(chan, alloc), ALLOC_OK);
+    assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_OK);
+    assert_ptr_equal(msg.mem, alloc->mem);
+    msg.mem += 8;
+    assert_int_equal(mem_chan_release(chan, &msg), ALLOC_FAIL);
+    msg.mem -= 8;
+    assert_int_equal(mem_chan_release(chan, &msg), ALLOC_OK);
+    assert_int_equal(mem_chan_destroy(chan), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_chan_processes(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_senders = 3;
+    const unsigned num_msgs = 2000;
+    char name[64];
+    chan_msg_t msg;
+
+    snprintf(name, sizeof(name), "/mem_pool_test_%d", (int) getpid());
+    shm_unlink(name);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_shm(name, POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    for (unsigned kind = CHAN_SPSC; kind <= CHAN_MPMC; kind++) {
+        unsigned senders = (kind == CHAN_SPSC) ? 1 : num_senders;
+        unsigned next_seq[num_senders];
+
+        INFO("Sending from %u process(es) over a shared pool channel\n", senders);
+        chan_pt chan = mem_chan_open(pool, 64, (chan_kind) kind);
+        assert_non_null(chan);
+        size_t chan_offset = mem_chan_offset(chan);
+
+        for (unsigned p = 0; p < senders; p++) {
+            next_seq[p] = 0;
+            pid_t pid = fork();
+            assert_true(pid >= 0);
+            if (pid == 0) {
+                pool_pt child_pool = mem_pool_open_shm(name, 0, BEST_FIT);
+                chan_pt child_chan = mem_chan_attach(child_pool, chan_offset);
+                if (child_chan == NULL)
+                    _exit(1);
+                for (unsigned u = 0; u < num_msgs; u++) {
+                    alloc_pt alloc = mem_new_alloc(child_pool, 16 + u % 32);
+                    if (alloc == NULL)
+                        _exit(2);
+                    alloc->mem[0] = (char) p;
+                    memcpy(alloc->mem + 1, &u, sizeof(u));
+                    while (mem_chan_send(child_chan, alloc) != ALLOC_OK)
+                        usleep(10);
+                }
+                mem_chan_close(child_chan);
+                mem_pool_close(child_pool);
+                _exit(0);
+            }
+        }
+
+        // zero-copy: the bytes the senders wrote, in per-sender order
+        for (unsigned u = 0; u < senders * num_msgs; u++) {
+            unsigned seq;
+            while (mem_chan_recv(chan, &msg) != ALLOC_OK)
+                usleep(10);
+            unsigned p = (unsigned) msg.mem[0];
+            assert_true(p < senders);
+            memcpy(&seq, msg.mem + 1, sizeof(seq));
+            assert_int_equal(seq, next_seq[p]);
+            assert_int_equal(msg.size, 16 + seq % 32);
+            next_seq[p]++;
+            assert_int_equal(mem_chan_release(chan, &msg), ALLOC_OK);
+        }
+        assert_int_equal(mem_chan_recv(chan, &msg), ALLOC_FAIL);
+
+        for (unsigned p = 0; p < senders; p++) {
+            int status = 0;
+            wait(&status);
+            assert_true(WIFEXITED(status));
+            assert_int_equal(WEXITSTATUS(status), 0);
+        }
+
+        assert_int_equal(mem_chan_destroy(chan), ALLOC_OK);
+        check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    }
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    shm_unlink(name);
+}
+
+
+/*******************************************/
+/***      9. SNAPSHOTS AND CLONES        ***/
+/*******************************************/
+
+static void check_snapshot(pool_pt pool, pool_pt loaded,
+                           const size_t *offsets, unsigned num_offsets) {
+    pool_segment_pt segs = NULL, loaded_segs = NULL;
+    unsigned num_segs = 0, num_loaded_segs = 0;
+
+    check_metadata(loaded, pool->policy, pool->total_size,
+                   pool->alloc_size, pool->num_allocs, pool->num_gaps);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    mem_inspect_pool(loaded, &loaded_segs, &num_loaded_segs);
+    assert_int_equal(num_segs, num_loaded_segs);
+    assert_memory_equal(segs, loaded_segs, num_segs * sizeof(pool_segment_t));
+    free(segs);
+    free(loaded_segs);
+
+    // same allocations at the same offsets, contents included
+    for (unsigned u = 0; u < num_offsets; u++) {
+        alloc_pt alloc = mem_pool_alloc_at(pool, offsets[u]);
+        alloc_pt loaded_alloc = mem_pool_alloc_at(loaded, offsets[u]);
+        if (alloc == NULL) {
+            assert_null(loaded_alloc);
+            continue;
+        }
+        assert_non_null(loaded_alloc);
+        assert_int_equal(alloc->size, loaded_alloc->size);
+        assert_memory_equal(alloc->mem, loaded_alloc->mem, alloc->size);
+    }
+}
+
+static void test_pool_snapshot(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocs = 100;
+    const char prefix[] = "not a snapshot";
+    size_t offsets[num_allocs];
+    char buf[sizeof(prefix)];
+    int fds[2];
+
+    char path[] = "/tmp/mem_pool_snap_XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    unlink(path);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    for (unsigned u = 0; u < num_allocs; u++) {
+        alloc_pt alloc = mem_new_alloc(pool, 100 + u);
+        assert_non_null(alloc);
+        memset(alloc->mem, (int) u, alloc->size);
+        offsets[u] = alloc->mem - pool->mem;
+    }
+    for (unsigned u = 0; u < num_allocs; u += 2) {
+        alloc_pt alloc = mem_pool_alloc_at(pool, offsets[u]);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    }
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 7500, 50, 51);
+
+    INFO("Saving snapshot after a prefix in %s\n", path);
+    assert_int_equal(write(fd, prefix, sizeof(prefix)), sizeof(prefix));
+    assert_int_equal(mem_pool_save(pool, fd), ALLOC_OK);
+
+    // the gaps are not in the snapshot
+    off_t snap_size = lseek(fd, 0, SEEK_CUR) - (off_t) sizeof(prefix);
+    assert_true(snap_size < (off_t) POOL_SIZE / 10);
+
+    // the prefix is not a snapshot, and does not get skipped
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_null(mem_pool_load(fd));
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_int_equal(read(fd, buf, sizeof(buf)), sizeof(buf));
+
+    INFO("Loading snapshot from the file\n");
+    pool_pt loaded = mem_pool_load(fd);
+    assert_non_null(loaded);
+    assert_int_equal(lseek(fd, 0, SEEK_CUR), sizeof(prefix) + snap_size);
+    check_snapshot(pool, loaded, offsets, num_allocs);
+
+    // a loaded pool is a pool like any other
+    alloc_pt alloc = mem_new_alloc(loaded, 100);
+    assert_non_null(alloc);
+    assert_true(alloc->mem == loaded->mem + offsets[0]);
+    assert_int_equal(mem_del_alloc(loaded, alloc), ALLOC_OK);
+    for (unsigned u = 1; u < num_allocs; u += 2)
+        assert_int_equal(mem_del_alloc(loaded, mem_pool_alloc_at(loaded, offsets[u])), ALLOC_OK);
+    assert_int_equal(mem_pool_close(loaded), ALLOC_OK);
+
+    // a snapshot whose contents are shorter than its allocations is no
+    // snapshot either
+    size_t hdr_sizes[8];
+    assert_int_equal(pread(fd, hdr_sizes, sizeof(hdr_sizes), sizeof(prefix)), sizeof(hdr_sizes));
+    unsigned field = 0;
+    while (field < 8 && hdr_sizes[field] != pool->alloc_size)
+        field++;
+    assert_true(field < 8);
+    hdr_sizes[field] -= 100;
+    assert_int_equal(pwrite(fd, hdr_sizes, sizeof(hdr_sizes), sizeof(prefix)), sizeof(hdr_sizes));
+    assert_int_equal(lseek(fd, sizeof(prefix), SEEK_SET), sizeof(prefix));
+    assert_null(mem_pool_load(fd));
+    close(fd);
+
+    INFO("Loading snapshot through a pipe\n");
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(mem_pool_save(pool, fds[1]), ALLOC_OK);
+    loaded = mem_pool_load(fds[0]);
+    assert_non_null(loaded);
+    check_snapshot(pool, loaded, offsets, num_allocs);
+    close(fds[0]);
+    close(fds[1]);
+
+    for (unsigned u = 1; u < num_allocs; u += 2) {
+        assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offsets[u])), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(loaded, mem_pool_alloc_at(loaded, offsets[u])), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(loaded), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_clone(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_allocs = 100;
+    size_t offsets[num_allocs];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    for (unsigned u = 0; u < num_allocs; u++) {
+        alloc_pt alloc = mem_new_alloc(pool, 100 + u);
+        assert_non_null(alloc);
+        memset(alloc->mem, (int) u, alloc->size);
+        offsets[u] = alloc->mem - pool->mem;
+    }
+    for (unsigned u = 0; u < num_allocs; u += 2)
+        assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offsets[u])), ALLOC_OK);
+
+    INFO("Cloning a pool\n");
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    assert_true(clone->mem != pool->mem);
+    check_snapshot(pool, clone, offsets, num_allocs);
+
+    // writes, allocations and deletions stay on their side
+    alloc_pt alloc = mem_pool_alloc_at(clone, offsets[1]);
+    memset(alloc->mem, 0xff, alloc->size);
+    assert_int_equal(mem_pool_alloc_at(pool, offsets[1])->mem[0], 1);
+    alloc = mem_pool_alloc_at(pool, offsets[3]);
+    memset(alloc->mem, 0xfe, alloc->size);
+    assert_int_equal(mem_pool_alloc_at(clone, offsets[3])->mem[0], 3);
+    assert_non_null(mem_new_alloc(clone, 1000));
+    assert_int_equal(mem_del_alloc(clone, mem_pool_alloc_at(clone, offsets[5])), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 7500, 50, 51);
+    check_metadata(clone, FIRST_FIT, POOL_SIZE, 7500 + 1000 - 105, 50, 50);
+
+    INFO("Cloning the pool and the clone again\n");
+    pool_pt clone2 = mem_pool_clone(pool);
+    assert_non_null(clone2);
+    check_snapshot(pool, clone2, offsets, num_allocs);
+    assert_int_equal((unsigned char) mem_pool_alloc_at(clone2, offsets[3])->mem[0], 0xfe);
+
+    pool_pt clone3 = mem_pool_clone(clone);
+    assert_non_null(clone3);
+    check_snapshot(clone, clone3, offsets, num_allocs);
+    assert_int_equal((unsigned char) mem_pool_alloc_at(clone3, offsets[1])->mem[0], 0xff);
+
+    // every pool closes on its own
+    pool_pt pools[] = { pool, clone, clone2, clone3 };
+    for (unsigned p = 0; p < 4; p++) {
+        pool_segment_pt segs = NULL;
+        unsigned num_segs = 0;
+        mem_inspect_pool(pools[p], &segs, &num_segs);
+        size_t offset = 0;
+        for (unsigned u = 0; u < num_segs; u++) {
+            if (segs[u].allocated)
+                assert_int_equal(mem_del_alloc(pools[p], mem_pool_alloc_at(pools[p], offset)), ALLOC_OK);
+            offset += segs[u].size;
+        }
+        free(segs);
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+#define SMALL_POOL_SIZE     12000
+#define SMALL_NUM_ALLOCS    80
+
+static void test_pool_clone_small(void **state) {
+    (void) state; /* unused */
+
+    size_t offsets[SMALL_NUM_ALLOCS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // a small pool, with more segments than its metadata starts out with
+    pool_pt pool = mem_pool_open(SMALL_POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    for (unsigned u = 0; u < SMALL_NUM_ALLOCS; u++) {
+        alloc_pt alloc = mem_new_alloc(pool, 100 + u);
+        assert_non_null(alloc);
+        memset(alloc->mem, (int) u, alloc->size);
+        offsets[u] = alloc->mem - pool->mem;
+    }
+    for (unsigned u = 0; u < SMALL_NUM_ALLOCS; u += 2)
+        assert_int_equal(mem_del_alloc(pool, mem_pool_alloc_at(pool, offsets[u])), ALLOC_OK);
+    check_segments_consistent(pool);
+
+    INFO("Cloning a small pool\n");
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    assert_true(clone->mem != pool->mem);
+    check_snapshot(pool, clone, offsets, SMALL_NUM_ALLOCS);
+
+    // writes stay on their side
+    memset(mem_pool_alloc_at(clone, offsets[1])->mem, 0xff, 101);
+    assert_int_equal(mem_pool_alloc_at(pool, offsets[1])->mem[0], 1);
+
+    pool_pt pools[] = { pool, clone };
+    for (unsigned p = 0; p < 2; p++) {
+        for (unsigned u = 1; u < SMALL_NUM_ALLOCS; u += 2)
+            assert_int_equal(mem_del_alloc(pools[p], mem_pool_alloc_at(pools[p], offsets[u])), ALLOC_OK);
+        check_metadata(pools[p], BEST_FIT, SMALL_POOL_SIZE, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pools[p]), ALLOC_OK);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+/*******************************************/
+/***       10. THREAD-SAFE POOLS         ***/
+/*******************************************/
+
+#define MT_NUM_THREADS      4
+#define MT_NUM_HELD         64
+
+static void *mt_churn(void *arg) {
+    pool_pt pool = arg;
+    alloc_pt held[MT_NUM_HELD] = { NULL };
+    unsigned seed = (unsigned) (uintptr_t) &held;
+    long errors = 0;
+
+    // hold on to some records while other threads grow the metadata
+    for (unsigned u = 0; u < 20000; u++) {
+        unsigned slot = rand_r(&seed) % MT_NUM_HELD;
+        if (held[slot] != NULL) {
+            char tag = (char) slot;
+            if (held[slot]->mem[0] != tag || held[slot]->mem[held[slot]->size - 1] != tag)
+                errors++;
+            if (mem_del_alloc(pool, held[slot]) != ALLOC_OK)
+                errors++;
+            held[slot] = NULL;
+        } else if ((held[slot] = mem_new_alloc(pool, 1 + rand_r(&seed) % 256)) != NULL) {
+            memset(held[slot]->mem, (int) slot, held[slot]->size);
+        }
+    }
+    for (unsigned slot = 0; slot < MT_NUM_HELD; slot++) {
+        if (held[slot] != NULL && mem_del_alloc(pool, held[slot]) != ALLOC_OK)
+            errors++;
+    }
+
+    return (void *) errors;
+}
+
+static void test_pool_mt_threads(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[MT_NUM_THREADS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_mt(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+
+    INFO("Churning a thread-safe pool from %d threads\n", MT_NUM_THREADS);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++)
+        assert_int_equal(pthread_create(&threads[t], NULL, mt_churn, pool), 0);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++) {
+        void *errors = NULL;
+        assert_int_equal(pthread_join(threads[t], &errors), 0);
+        assert_int_equal((long) errors, 0);
+    }
+
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_mt_cache(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[MT_NUM_THREADS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // only thread-safe pools take caches
+    pool_pt pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_int_equal(mem_pool_enable_cache(pool), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_mt(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_enable_cache(pool), ALLOC_OK);
+
+    // a miss refills the bin, a delete and a new allocation hit it
+    alloc_pt alloc = mem_new_alloc(pool, 20);
+    assert_non_null(alloc);
+    assert_int_equal(alloc->size, 32);
+    assert_true(pool->num_allocs > 1);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_ptr_equal(mem_new_alloc(pool, 30), alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    // a record deleted again doesn't go in the cache twice, to be handed out
+    // to two owners
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_FAIL);
+    alloc_pt first = mem_new_alloc(pool, 32), second = mem_new_alloc(pool, 32);
+    assert_non_null(first);
+    assert_non_null(second);
+    assert_ptr_not_equal(first, second);
+    assert_ptr_not_equal(first->mem, second->mem);
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_FAIL);
+
+    // a clone has the allocations of the pool, but not the blocks in its
+    // caches, and closes once they are deleted
+    assert_non_null(alloc = mem_new_alloc(pool, 32));
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    check_segments_consistent(clone);
+    assert_int_equal(clone->num_allocs, 1);
+    assert_int_equal(clone->alloc_size, 32);
+    alloc_pt cloned = mem_pool_alloc_at(clone, alloc->mem - pool->mem);
+    assert_non_null(cloned);
+    assert_int_equal(mem_del_alloc(clone, cloned), ALLOC_OK);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    // big allocations go straight to the pool
+    alloc = mem_new_alloc(pool, 1000);
+    assert_int_equal(alloc->size, 1000);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    assert_int_equal(mem_pool_flush_cache(pool), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Churning a cached pool from %d threads\n", MT_NUM_THREADS);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++)
+        assert_int_equal(pthread_create(&threads[t], NULL, mt_churn, pool), 0);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++) {
+        void *errors = NULL;
+        assert_int_equal(pthread_join(threads[t], &errors), 0);
+        assert_int_equal((long) errors, 0);
+    }
+
+    // exited threads gave their blocks back
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    // a pool with allocations doesn't close, and keeps its caches
+    alloc_pt big = mem_new_alloc(pool, 1000);
+    assert_non_null(big);
+    assert_non_null(alloc = mem_new_alloc(pool, 20));
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_ptr_equal(mem_new_alloc(pool, 20), alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, big), ALLOC_OK);
+
+    // closing takes the blocks back from live threads too
+    assert_non_null(alloc = mem_new_alloc(pool, 100));
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_mt_cpu_cache(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[MT_NUM_THREADS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_mt(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_enable_cpu_cache(pool), ALLOC_OK);
+
+    // one kind of cache at a time
+    assert_int_equal(mem_pool_enable_cache(pool), ALLOC_FAIL);
+    assert_int_equal(mem_pool_enable_cpu_cache(pool), ALLOC_FAIL);
+
+    // a miss refills the bin, a delete and a new allocation hit it
+    // note: unless the thread changes CPUs in between
+    alloc_pt alloc = mem_new_alloc(pool, 20);
+    assert_non_null(alloc);
+    assert_int_equal(alloc->size, 32);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    alloc = mem_new_alloc(pool, 30);
+    assert_non_null(alloc);
+    assert_int_equal(alloc->size, 32);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    // a record deleted again doesn't go in a cache twice, to be handed out
+    // to two owners
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_FAIL);
+    alloc_pt first = mem_new_alloc(pool, 32), second = mem_new_alloc(pool, 32);
+    assert_non_null(first);
+    assert_non_null(second);
+    assert_ptr_not_equal(first, second);
+    assert_ptr_not_equal(first->mem, second->mem);
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_FAIL);
+
+    // a clone has the allocations of the pool, but not the blocks in its
+    // caches, and closes once they are deleted
+    assert_non_null(alloc = mem_new_alloc(pool, 32));
+    pool_pt clone = mem_pool_clone(pool);
+    assert_non_null(clone);
+    check_segments_consistent(clone);
+    assert_int_equal(clone->num_allocs, 1);
+    assert_int_equal(clone->alloc_size, 32);
+    alloc_pt cloned = mem_pool_alloc_at(clone, alloc->mem - pool->mem);
+    assert_non_null(cloned);
+    assert_int_equal(mem_del_alloc(clone, cloned), ALLOC_OK);
+    assert_int_equal(mem_pool_close(clone), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    INFO("Churning a per-CPU cached pool from %d threads\n", MT_NUM_THREADS);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++)
+        assert_int_equal(pthread_create(&threads[t], NULL, mt_churn, pool), 0);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++) {
+        void *errors = NULL;
+        assert_int_equal(pthread_join(threads[t], &errors), 0);
+        assert_int_equal((long) errors, 0);
+    }
+
+    // the caches of every CPU go back to the pool when it closes
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+typedef struct {
+    pool_pt pool;
+    alloc_pt allocs[100];
+} mt_remote_t;
+
+static void *mt_free_all(void *arg) {
+    mt_remote_t *remote = arg;
+    long errors = 0;
+
+    for (unsigned u = 0; u < 100; u++) {
+        if (mem_del_alloc(remote->pool, remote->allocs[u]) != ALLOC_OK)
+            errors++;
+    }
+
+    return (void *) errors;
+}
+
+static void test_pool_mt_remote_free(void **state) {
+    (void) state; /* unused */
+
+    mt_remote_t remote;
+    pthread_t thread;
+    void *errors = NULL;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    remote.pool = mem_pool_open_mt(POOL_SIZE, FIRST_FIT);
+    assert_non_null(remote.pool);
+    for (unsigned u = 0; u < 100; u++)
+        assert_non_null(remote.allocs[u] = mem_new_alloc(remote.pool, 100 + u));
+
+    INFO("Deleting allocations from another thread\n");
+    assert_int_equal(pthread_create(&thread, NULL, mt_free_all, &remote), 0);
+    assert_int_equal(pthread_join(thread, &errors), 0);
+    assert_int_equal((long) errors, 0);
+
+    // the deletes wait for the lock to be taken, and a record whose delete
+    // is pending can't be deleted again meanwhile
+    assert_int_equal(remote.pool->num_allocs, 100);
+    assert_int_equal(pthread_create(&thread, NULL, mt_free_all, &remote), 0);
+    assert_int_equal(pthread_join(thread, &errors), 0);
+    assert_int_equal((long) errors, 100);
+    assert_int_equal(mem_del_alloc(remote.pool, remote.allocs[0]), ALLOC_FAIL);
+    check_metadata(remote.pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    // the thread that opened the pool deletes right away
+    alloc_pt alloc = mem_new_alloc(remote.pool, 100);
+    assert_int_equal(mem_del_alloc(remote.pool, alloc), ALLOC_OK);
+    assert_int_equal(remote.pool->num_allocs, 0);
+
+    // and a pool closes with deletes pending
+    for (unsigned u = 0; u < 100; u++)
+        assert_non_null(remote.allocs[u] = mem_new_alloc(remote.pool, 100 + u));
+    assert_int_equal(pthread_create(&thread, NULL, mt_free_all, &remote), 0);
+    assert_int_equal(pthread_join(thread, &errors), 0);
+    assert_int_equal(mem_pool_close(remote.pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void *mt_open_close(void *arg) {
+    (void) arg; /* unused */
+    pool_pt pools[8];
+    long errors = 0;
+
+    // short-lived pools, a few at a time
+    for (unsigned u = 0; u < 2000; u++) {
+        unsigned p = u % 8;
+        if (u >= 8 && mem_pool_close(pools[p]) != ALLOC_OK)
+            errors++;
+        if ((pools[p] = mem_pool_open(1000, FIRST_FIT)) == NULL)
+            errors++;
+        else if (mem_new_alloc(pools[p], 10) == NULL)
+            errors++;
+        else if (mem_del_alloc(pools[p], mem_pool_alloc_at(pools[p], 0)) != ALLOC_OK)
+            errors++;
+    }
+    for (unsigned p = 0; p < 8; p++) {
+        if (mem_pool_close(pools[p]) != ALLOC_OK)
+            errors++;
+    }
+
+    return (void *) errors;
+}
+
+static void test_pool_mt_open_close(void **state) {
+    (void) state; /* unused */
+
+    pthread_t threads[MT_NUM_THREADS];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    INFO("Opening and closing pools from %d threads\n", MT_NUM_THREADS);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++)
+        assert_int_equal(pthread_create(&threads[t], NULL, mt_open_close, NULL), 0);
+    for (unsigned t = 0; t < MT_NUM_THREADS; t++) {
+        void *errors = NULL;
+        assert_int_equal(pthread_join(threads[t], &errors), 0);
+        assert_int_equal((long) errors, 0);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+/*******************************************/
+/***        11. DRIVER ROUTINE           ***/
 /*******************************************/
 
 int run_test_suite() {
     const struct CMUnitTest tests[] = {
             cmocka_unit_test(test_pool_store_smoketest),
+            cmocka_unit_test(test_pool_store_reuse),
+            cmocka_unit_test(test_pool_ctx),
             cmocka_unit_test(test_pool_smoketest),
 
             cmocka_unit_test(test_pool_nonempty),
 
             cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test(test_pool_alloc_records),
+            cmocka_unit_test(test_pool_stable_records),
+            cmocka_unit_test(test_pool_inline),
+            cmocka_unit_test(test_pool_open_in),
+            cmocka_unit_test(test_pool_open_ex),
+            cmocka_unit_test(test_pool_realtime),
+            cmocka_unit_test(test_pool_meta_shrink),
+            cmocka_unit_test(test_pool_compact),
+            cmocka_unit_test(test_pool_handles),
+            cmocka_unit_test(test_pool_defrag),
+            cmocka_unit_test(test_pool_refs),
+            cmocka_unit_test(test_pool_fit_search),
 
             cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
@@ -2443,6 +4365,24 @@ int run_test_suite() {
             cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
 
+            cmocka_unit_test(test_pool_file_reopen),
+
+            cmocka_unit_test(test_pool_shm_processes),
+            cmocka_unit_test(test_pool_shm_robust),
+
+            cmocka_unit_test(test_chan_capacity),
+            cmocka_unit_test(test_chan_processes),
+
+            cmocka_unit_test(test_pool_snapshot),
+            cmocka_unit_test(test_pool_clone),
+            cmocka_unit_test(test_pool_clone_small),
+
+            cmocka_unit_test(test_pool_mt_threads),
+            cmocka_unit_test(test_pool_mt_cache),
+            cmocka_unit_test(test_pool_mt_cpu_cache),
+            cmocka_unit_test(test_pool_mt_remote_free),
+            cmocka_unit_test(test_pool_mt_open_close),
+
             // do not uncomment until the project is changed to return the allocation address
 //            cmocka_unit_test(test_pool_stresstest),
     };